@@ -0,0 +1,472 @@
+#include "BmpOutput.h"
+#include "FileStreams.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+BmpOutputFile::BmpOutputFile(
+	const std::filesystem::path& filePath,
+	const std::vector<uint8_t>& headerBytes,
+	int64_t rowDataBytes,
+	int64_t rowStrideBytes,
+	int64_t rowsCount,
+	OutputBackend backend)
+	: backend_(backend),
+	headerBytes_((int64_t)headerBytes.size()),
+	rowDataBytes_(rowDataBytes),
+	rowStrideBytes_(rowStrideBytes),
+	rowsCount_(rowsCount)
+{
+	const int64_t fileSize = headerBytes_ + rowStrideBytes_ * rowsCount_;
+
+	if (backend_ == OutputBackend::Auto)
+	{
+		backend_ = IsSeekablePath(filePath) ? OutputBackend::MemoryMapped : OutputBackend::Stream;
+	}
+
+	if (backend_ == OutputBackend::Stream)
+	{
+		stream_ = &OpenOutputStream(filePath, streamFile_);
+	}
+	else
+	{
+		OpenPreallocated(filePath, fileSize);
+
+		// Если файловая система не поддерживает отображение (или не хватает
+		// адресного пространства), запись идёт через буфер
+		if (backend_ == OutputBackend::MemoryMapped && !TryMap(fileSize))
+		{
+			backend_ = OutputBackend::CoalescingWrite;
+		}
+	}
+
+	WriteAt(0, headerBytes.data(), headerBytes_);
+}
+
+BmpOutputFile::~BmpOutputFile()
+{
+	try
+	{
+		Close();
+	}
+	catch (...)
+	{
+	}
+}
+
+void BmpOutputFile::OpenPreallocated(const std::filesystem::path& filePath, int64_t fileSize)
+{
+	std::string errorMessage = "Can't save file with output path: ";
+
+#ifdef _WIN32
+	fileHandle_ = CreateFileW(
+		filePath.c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		0,
+		nullptr,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr);
+
+	if (fileHandle_ == INVALID_HANDLE_VALUE)
+	{
+		fileHandle_ = nullptr;
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+
+	// Размер известен заранее, файл выделяется целиком
+	LARGE_INTEGER size{};
+	size.QuadPart = fileSize;
+	if (!SetFilePointerEx(fileHandle_, size, nullptr, FILE_BEGIN) || !SetEndOfFile(fileHandle_))
+	{
+		CloseFile();
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+#else
+	fileDescriptor_ = open(filePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fileDescriptor_ < 0)
+	{
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+
+	// Размер известен заранее, файл выделяется целиком
+	if (ftruncate(fileDescriptor_, fileSize) != 0)
+	{
+		CloseFile();
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+#endif
+}
+
+bool BmpOutputFile::TryMap(int64_t fileSize)
+{
+	if ((uint64_t)fileSize > SIZE_MAX)
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	mappingHandle_ = CreateFileMappingW(fileHandle_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (mappingHandle_ == nullptr)
+	{
+		return false;
+	}
+
+	mapping_ = (uint8_t*)MapViewOfFile(mappingHandle_, FILE_MAP_WRITE, 0, 0, 0);
+	if (mapping_ == nullptr)
+	{
+		CloseHandle(mappingHandle_);
+		mappingHandle_ = nullptr;
+		return false;
+	}
+#else
+	void* mapping = mmap(nullptr, (size_t)fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor_, 0);
+	if (mapping == MAP_FAILED)
+	{
+		return false;
+	}
+
+	mapping_ = (uint8_t*)mapping;
+#endif
+
+	return true;
+}
+
+void BmpOutputFile::CloseFile() noexcept
+{
+#ifdef _WIN32
+	if (mapping_ != nullptr)
+	{
+		UnmapViewOfFile(mapping_);
+		CloseHandle(mappingHandle_);
+	}
+	if (fileHandle_ != nullptr)
+	{
+		CloseHandle(fileHandle_);
+	}
+
+	mappingHandle_ = nullptr;
+	fileHandle_ = nullptr;
+#else
+	if (mapping_ != nullptr)
+	{
+		munmap(mapping_, (size_t)RowOffset(rowsCount_));
+	}
+	if (fileDescriptor_ >= 0)
+	{
+		close(fileDescriptor_);
+	}
+
+	fileDescriptor_ = -1;
+#endif
+
+	mapping_ = nullptr;
+}
+
+OutputBackend BmpOutputFile::Backend() const noexcept
+{
+	return backend_;
+}
+
+int64_t BmpOutputFile::RowDataBytes() const noexcept
+{
+	return rowDataBytes_;
+}
+
+int64_t BmpOutputFile::RowStrideBytes() const noexcept
+{
+	return rowStrideBytes_;
+}
+
+int64_t BmpOutputFile::RowsCount() const noexcept
+{
+	return rowsCount_;
+}
+
+int64_t BmpOutputFile::RowOffset(int64_t y) const noexcept
+{
+	return headerBytes_ + rowStrideBytes_ * y;
+}
+
+uint8_t* BmpOutputFile::MappedRow(int64_t y) const noexcept
+{
+	return mapping_ + RowOffset(y);
+}
+
+void BmpOutputFile::WriteAt(int64_t offset, const uint8_t* data, int64_t size)
+{
+	if (mapping_ != nullptr)
+	{
+		std::memcpy(mapping_ + offset, data, (size_t)size);
+		return;
+	}
+
+	if (stream_ != nullptr)
+	{
+		if (offset != streamPosition_)
+		{
+			throw std::invalid_argument("Can't write rows out of order to a stream");
+		}
+
+		stream_->write((const char*)data, size);
+		streamPosition_ += size;
+
+		if (!*stream_)
+		{
+			throw std::runtime_error("Can't write to output stream");
+		}
+		return;
+	}
+
+	// Позиционная запись не меняет общую позицию файла,
+	// поэтому её могут выполнять несколько потоков одновременно
+	while (size > 0)
+	{
+#ifdef _WIN32
+		DWORD chunk = (DWORD)std::min<int64_t>(size, 1 << 30);
+		DWORD written = 0;
+
+		OVERLAPPED overlapped{};
+		overlapped.Offset = (DWORD)(offset & 0xffffffff);
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		if (!WriteFile(fileHandle_, data, chunk, &written, &overlapped) || written == 0)
+		{
+			throw std::runtime_error("Can't write to output file");
+		}
+#else
+		ssize_t written = pwrite(
+			fileDescriptor_, data, (size_t)std::min<int64_t>(size, 1 << 30), offset);
+
+		if (written <= 0)
+		{
+			throw std::runtime_error("Can't write to output file");
+		}
+#endif
+
+		data += written;
+		offset += written;
+		size -= written;
+	}
+}
+
+void BmpOutputFile::Close()
+{
+	if (stream_ != nullptr)
+	{
+		std::ostream& stream = *stream_;
+		stream_ = nullptr;
+
+		stream.flush();
+
+		if (!stream)
+		{
+			CloseFile();
+			throw std::runtime_error("Can't write to output stream");
+		}
+	}
+
+	CloseFile();
+}
+
+BmpRowWriter::BmpRowWriter(BmpOutputFile& file)
+	: BmpRowWriter(file, 0, 0, file.RowsCount())
+{
+}
+
+BmpRowWriter::BmpRowWriter(
+	BmpOutputFile& file,
+	int64_t rowsShift,
+	int64_t windowFirstRow,
+	int64_t windowRowsCount)
+	: file_(file),
+	rowsShift_(rowsShift),
+	windowFirstRow_(windowFirstRow),
+	windowRowsCount_(windowRowsCount)
+{
+	bufferCapacityRows_ = std::max<int64_t>(1, CoalescingBufferBytes / file_.RowStrideBytes());
+}
+
+BmpRowWriter::~BmpRowWriter()
+{
+	try
+	{
+		Flush();
+	}
+	catch (...)
+	{
+	}
+}
+
+uint8_t* BmpRowWriter::FileRows(int64_t firstRow, int64_t rowsCount)
+{
+	const int64_t stride = file_.RowStrideBytes();
+	const int64_t paddingBytes = stride - file_.RowDataBytes();
+
+	acquiredRowsCount_ = rowsCount;
+	isAcquiredBeforePending_ = false;
+
+	uint8_t* rows = nullptr;
+
+	if (file_.Backend() == OutputBackend::MemoryMapped)
+	{
+		rows = file_.MappedRow(firstRow);
+	}
+	else
+	{
+		// Новые строки продолжают накопленные, если идут сразу за ними или сразу перед ними
+		bool isContinuation = pendingRowsCount_ != 0 &&
+			firstRow == pendingFirstRow_ + pendingRowsCount_ &&
+			pendingBufferRow_ + pendingRowsCount_ + rowsCount <= bufferCapacityRows_;
+
+		bool isPrecedence = pendingRowsCount_ != 0 &&
+			firstRow + rowsCount == pendingFirstRow_ &&
+			pendingRowsCount_ + rowsCount <= bufferCapacityRows_;
+
+		if (isPrecedence)
+		{
+			// Накопленные строки один раз переносятся в конец буфера, дальше строки
+			// по убыванию номеров ложатся перед ними без копирования
+			if (pendingBufferRow_ < rowsCount)
+			{
+				int64_t bufferRow = bufferCapacityRows_ - pendingRowsCount_;
+
+				if ((int64_t)buffer_.size() < bufferCapacityRows_ * stride)
+				{
+					buffer_.resize(bufferCapacityRows_ * stride);
+				}
+
+				std::memmove(
+					buffer_.data() + bufferRow * stride,
+					buffer_.data() + pendingBufferRow_ * stride,
+					(size_t)(pendingRowsCount_ * stride));
+				pendingBufferRow_ = bufferRow;
+			}
+
+			isAcquiredBeforePending_ = true;
+			rows = buffer_.data() + (pendingBufferRow_ - rowsCount) * stride;
+		}
+		else
+		{
+			if (!isContinuation)
+			{
+				Flush();
+				pendingFirstRow_ = firstRow;
+				pendingBufferRow_ = 0;
+			}
+
+			int64_t requiredBytes = (pendingBufferRow_ + pendingRowsCount_ + rowsCount) * stride;
+			if ((int64_t)buffer_.size() < requiredBytes)
+			{
+				buffer_.resize(requiredBytes);
+			}
+
+			rows = buffer_.data() + (pendingBufferRow_ + pendingRowsCount_) * stride;
+		}
+	}
+
+	if (paddingBytes != 0)
+	{
+		for (int64_t y = 0; y < rowsCount; y++)
+		{
+			std::memset(rows + y * stride + file_.RowDataBytes(), 0, paddingBytes);
+		}
+	}
+
+	return rows;
+}
+
+uint8_t* BmpRowWriter::Rows(int64_t firstRow, int64_t rowsCount)
+{
+	firstRow += rowsShift_;
+
+	if (firstRow >= windowFirstRow_ &&
+		firstRow + rowsCount <= windowFirstRow_ + windowRowsCount_)
+	{
+		isAcquiredToDiscard_ = false;
+		return FileRows(firstRow, rowsCount);
+	}
+
+	// Нужная часть строк копируется в файл при подтверждении
+	isAcquiredToDiscard_ = true;
+	discardFirstRow_ = firstRow;
+	acquiredRowsCount_ = rowsCount;
+
+	int64_t requiredBytes = rowsCount * file_.RowStrideBytes();
+	if ((int64_t)discardBuffer_.size() < requiredBytes)
+	{
+		discardBuffer_.resize(requiredBytes);
+	}
+
+	return discardBuffer_.data();
+}
+
+void BmpRowWriter::CommitRows()
+{
+	if (isAcquiredToDiscard_)
+	{
+		isAcquiredToDiscard_ = false;
+
+		const int64_t stride = file_.RowStrideBytes();
+		int64_t firstRow = std::max(discardFirstRow_, windowFirstRow_);
+		int64_t endRow = std::min(discardFirstRow_ + acquiredRowsCount_, windowFirstRow_ + windowRowsCount_);
+
+		acquiredRowsCount_ = 0;
+
+		if (firstRow >= endRow)
+		{
+			return;
+		}
+
+		uint8_t* rows = FileRows(firstRow, endRow - firstRow);
+
+		for (int64_t y = firstRow; y < endRow; y++)
+		{
+			std::memcpy(
+				rows + (y - firstRow) * stride,
+				discardBuffer_.data() + (y - discardFirstRow_) * stride,
+				(size_t)file_.RowDataBytes());
+		}
+	}
+
+	if (file_.Backend() != OutputBackend::MemoryMapped)
+	{
+		if (isAcquiredBeforePending_)
+		{
+			pendingFirstRow_ -= acquiredRowsCount_;
+			pendingBufferRow_ -= acquiredRowsCount_;
+		}
+
+		pendingRowsCount_ += acquiredRowsCount_;
+	}
+
+	acquiredRowsCount_ = 0;
+	isAcquiredBeforePending_ = false;
+}
+
+void BmpRowWriter::Flush()
+{
+	if (pendingRowsCount_ == 0)
+	{
+		return;
+	}
+
+	file_.WriteAt(
+		file_.RowOffset(pendingFirstRow_),
+		buffer_.data() + pendingBufferRow_ * file_.RowStrideBytes(),
+		pendingRowsCount_ * file_.RowStrideBytes());
+	pendingRowsCount_ = 0;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <vector>
+
+/// <summary>
+/// Способ записи выходного bmp.
+/// </summary>
+enum class OutputBackend
+{
+	// Отображение в память для обычных файлов, поток для каналов
+	Auto,
+
+	// Последовательная запись в поток, строки только по порядку
+	Stream,
+
+	// Файл заранее выделяется и отображается в память,
+	// строки записываются прямо в отображение
+	MemoryMapped,
+
+	// Соседние строки копятся в буфере и пишутся одной позиционной записью.
+	// Для файловых систем, где запись через отображение медленная
+	CoalescingWrite
+};
+
+/// <summary>
+/// Выходной bmp известного размера: заголовки и rowsCount строк по rowStrideBytes байт.
+/// Позиционная запись и запись в отображение потокобезопасны
+/// для непересекающихся диапазонов строк.
+/// </summary>
+class BmpOutputFile
+{
+private:
+	OutputBackend backend_;
+
+	int64_t headerBytes_;
+	int64_t rowDataBytes_;
+	int64_t rowStrideBytes_;
+	int64_t rowsCount_;
+
+	uint8_t* mapping_ = nullptr;
+
+	// Поток для OutputBackend::Stream и позиция следующей записи в нём
+	std::ofstream streamFile_;
+	std::ostream* stream_ = nullptr;
+	int64_t streamPosition_ = 0;
+
+#ifdef _WIN32
+	void* fileHandle_ = nullptr;
+	void* mappingHandle_ = nullptr;
+#else
+	int fileDescriptor_ = -1;
+#endif
+
+	void OpenPreallocated(const std::filesystem::path& filePath, int64_t fileSize);
+
+	bool TryMap(int64_t fileSize);
+
+	void CloseFile() noexcept;
+
+public:
+	BmpOutputFile(
+		const std::filesystem::path& filePath,
+		const std::vector<uint8_t>& headerBytes,
+		int64_t rowDataBytes,
+		int64_t rowStrideBytes,
+		int64_t rowsCount,
+		OutputBackend backend = OutputBackend::Auto);
+
+	BmpOutputFile(const BmpOutputFile&) = delete;
+	BmpOutputFile& operator=(const BmpOutputFile&) = delete;
+
+	~BmpOutputFile();
+
+	OutputBackend Backend() const noexcept;
+
+	int64_t RowDataBytes() const noexcept;
+
+	int64_t RowStrideBytes() const noexcept;
+
+	int64_t RowsCount() const noexcept;
+
+	/// <summary>
+	/// Смещение строки y (в порядке хранения) от начала файла.
+	/// </summary>
+	int64_t RowOffset(int64_t y) const noexcept;
+
+	/// <summary>
+	/// Начало строки y (в порядке хранения) в отображении. Только для MemoryMapped.
+	/// </summary>
+	uint8_t* MappedRow(int64_t y) const noexcept;
+
+	/// <summary>
+	/// Записывает size байт со смещения offset от начала файла.
+	/// В режиме Stream смещения должны идти строго подряд.
+	/// </summary>
+	void WriteAt(int64_t offset, const uint8_t* data, int64_t size);
+
+	/// <summary>
+	/// Сбрасывает записанные данные, закрывает файл. Вызывается и из деструктора,
+	/// который ошибки глотает, поэтому успешная запись подтверждается явным вызовом.
+	/// </summary>
+	void Close();
+};
+
+/// <summary>
+/// Запись строк в BmpOutputFile. У каждого потока выполнения свой объект.
+/// Строки заполняются прямо в отображении либо во внутреннем буфере,
+/// подряд идущие строки буфера сбрасываются одной записью - и по возрастанию,
+/// и по убыванию номеров (перевёрнутый bmp заполняется с последней строки).
+/// </summary>
+class BmpRowWriter
+{
+private:
+	BmpOutputFile& file_;
+
+	std::vector<uint8_t> buffer_;
+	int64_t bufferCapacityRows_;
+
+	// Диапазон строк, накопленных в буфере, и номер строки буфера, с которой он начинается
+	int64_t pendingFirstRow_ = 0;
+	int64_t pendingRowsCount_ = 0;
+	int64_t pendingBufferRow_ = 0;
+
+	// Число строк, выданных Rows и ещё не подтверждённых, и идут ли они перед накопленными
+	int64_t acquiredRowsCount_ = 0;
+	bool isAcquiredBeforePending_ = false;
+
+	// Строка r вызывающего попадает в строку r + rowsShift_ файла,
+	// записываются только строки окна [windowFirstRow_, windowFirstRow_ + windowRowsCount_)
+	int64_t rowsShift_ = 0;
+	int64_t windowFirstRow_ = 0;
+	int64_t windowRowsCount_;
+
+	// Строки, выданные Rows хотя бы частично вне окна, заполняются здесь
+	std::vector<uint8_t> discardBuffer_;
+	int64_t discardFirstRow_ = 0;
+	bool isAcquiredToDiscard_ = false;
+
+	uint8_t* FileRows(int64_t firstRow, int64_t rowsCount);
+
+public:
+	explicit BmpRowWriter(BmpOutputFile& file);
+
+	/// <summary>
+	/// Запись полосы изображения: строка r полосы соответствует строке r + rowsShift файла,
+	/// строки вне [windowFirstRow, windowFirstRow + windowRowsCount) (ореол полосы) отбрасываются.
+	/// </summary>
+	BmpRowWriter(
+		BmpOutputFile& file,
+		int64_t rowsShift,
+		int64_t windowFirstRow,
+		int64_t windowRowsCount);
+
+	BmpRowWriter(const BmpRowWriter&) = delete;
+	BmpRowWriter& operator=(const BmpRowWriter&) = delete;
+
+	~BmpRowWriter();
+
+	/// <summary>
+	/// Память под строки [firstRow, firstRow + rowsCount), идущие подряд через RowStrideBytes.
+	/// Выравнивающие байты уже обнулены, заполнять нужно только RowDataBytes каждой строки.
+	/// </summary>
+	uint8_t* Rows(int64_t firstRow, int64_t rowsCount);
+
+	/// <summary>
+	/// Подтверждает заполнение строк, выданных последним вызовом Rows.
+	/// </summary>
+	void CommitRows();
+
+	/// <summary>
+	/// Записывает накопленные строки. Деструктор тоже вызывает Flush, но глотает ошибки.
+	/// </summary>
+	void Flush();
+};
+
+/// <summary>
+/// Размер буфера BmpRowWriter, при котором запись выходит за пределы кэша файловой системы.
+/// </summary>
+const int64_t CoalescingBufferBytes = 4 << 20;
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+/// <summary>
+/// Путь "-" обозначает стандартный ввод или вывод,
+/// через которые изображение передаётся по каналу следующему процессу.
+/// </summary>
+inline bool IsStandardStreamPath(const std::filesystem::path& filePath)
+{
+	return filePath == "-";
+}
+
+/// <summary>
+/// Можно ли произвольно позиционироваться в файле (отображать его в память, писать с конца).
+/// </summary>
+inline bool IsSeekablePath(const std::filesystem::path& filePath)
+{
+	std::error_code error;
+	return !IsStandardStreamPath(filePath) &&
+		(!std::filesystem::exists(filePath, error) ||
+			std::filesystem::is_regular_file(filePath, error));
+}
+
+inline void SetBinaryMode(std::FILE* standardStream)
+{
+#ifdef _WIN32
+	_setmode(_fileno(standardStream), _O_BINARY);
+#else
+	(void)standardStream;
+#endif
+	std::ios::sync_with_stdio(false);
+}
+
+/// <summary>
+/// Открывает файл для чтения или возвращает std::cin в двоичном режиме.
+/// </summary>
+inline std::istream& OpenInputStream(
+	const std::filesystem::path& inputFilePath,
+	std::ifstream& file)
+{
+	if (IsStandardStreamPath(inputFilePath))
+	{
+		SetBinaryMode(stdin);
+		return std::cin;
+	}
+
+	file.open(inputFilePath, std::ios::in | std::ios::binary);
+	if (!file.is_open())
+	{
+		std::string errorMessage = "Can't find or open file with input path: ";
+		throw std::invalid_argument(errorMessage + inputFilePath.string());
+	}
+
+	return file;
+}
+
+/// <summary>
+/// Открывает файл для записи или возвращает std::cout в двоичном режиме.
+/// </summary>
+inline std::ostream& OpenOutputStream(
+	const std::filesystem::path& outputFilePath,
+	std::ofstream& file)
+{
+	if (IsStandardStreamPath(outputFilePath))
+	{
+		SetBinaryMode(stdout);
+		return std::cout;
+	}
+
+	file.open(outputFilePath, std::ios::out | std::ios::binary);
+	if (!file.is_open())
+	{
+		std::string errorMessage = "Can't save file with output path: ";
+		throw std::invalid_argument(errorMessage + outputFilePath.string());
+	}
+
+	return file;
+}
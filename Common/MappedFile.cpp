@@ -0,0 +1,105 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::filesystem::path& filePath)
+{
+	std::string errorMessage = "Can't map file with input path: ";
+
+#ifdef _WIN32
+	fileHandle_ = CreateFileW(
+		filePath.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr);
+
+	if (fileHandle_ == INVALID_HANDLE_VALUE)
+	{
+		fileHandle_ = nullptr;
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+
+	LARGE_INTEGER fileSize{};
+	GetFileSizeEx(fileHandle_, &fileSize);
+	size_ = (size_t)fileSize.QuadPart;
+
+	mappingHandle_ = CreateFileMappingW(fileHandle_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle_ == nullptr)
+	{
+		CloseHandle(fileHandle_);
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+
+	data_ = (const uint8_t*)MapViewOfFile(mappingHandle_, FILE_MAP_READ, 0, 0, 0);
+	if (data_ == nullptr)
+	{
+		CloseHandle(mappingHandle_);
+		CloseHandle(fileHandle_);
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+#else
+	fileDescriptor_ = open(filePath.c_str(), O_RDONLY);
+	if (fileDescriptor_ < 0)
+	{
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+
+	struct stat fileStat{};
+	fstat(fileDescriptor_, &fileStat);
+	size_ = (size_t)fileStat.st_size;
+
+	void* mapping = size_ == 0 ? MAP_FAILED :
+		mmap(nullptr, size_, PROT_READ, MAP_SHARED, fileDescriptor_, 0);
+	if (mapping == MAP_FAILED)
+	{
+		close(fileDescriptor_);
+		throw std::invalid_argument(errorMessage + filePath.string());
+	}
+
+	data_ = (const uint8_t*)mapping;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data_);
+	CloseHandle(mappingHandle_);
+	CloseHandle(fileHandle_);
+#else
+	munmap((void*)data_, size_);
+	close(fileDescriptor_);
+#endif
+}
+
+const uint8_t* MappedFile::Data() const noexcept
+{
+	return data_;
+}
+
+size_t MappedFile::Size() const noexcept
+{
+	return size_;
+}
+
+void MappedFile::AdviseRandomAccess() const noexcept
+{
+#ifndef _WIN32
+	madvise((void*)data_, size_, MADV_RANDOM);
+#endif
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+/// <summary>
+/// Файл, отображённый в память только для чтения.
+/// </summary>
+class MappedFile
+{
+private:
+	const uint8_t* data_ = nullptr;
+	size_t size_ = 0;
+
+#ifdef _WIN32
+	void* fileHandle_ = nullptr;
+	void* mappingHandle_ = nullptr;
+#else
+	int fileDescriptor_ = -1;
+#endif
+
+public:
+	explicit MappedFile(const std::filesystem::path& filePath);
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile();
+
+	const uint8_t* Data() const noexcept;
+
+	size_t Size() const noexcept;
+
+	// Подсказка системе не читать страницы наперёд,
+	// когда обращения к файлу идут с большим шагом
+	void AdviseRandomAccess() const noexcept;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+/// <summary>
+/// Формат пикселя BMP, известный на этапе компиляции.
+/// Каждый канал занимает ровно один байт.
+/// </summary>
+template<int bytePerPx, int channelCount>
+struct PixelFormat
+{
+	static constexpr int BytePerPx = bytePerPx;
+	static constexpr int ChannelCount = channelCount;
+	static constexpr uint16_t BitPerPixel = bytePerPx * 8;
+};
+
+// 8 бит, индексы палитры оттенков серого
+using Gray8 = PixelFormat<1, 1>;
+
+// 24 бита, BGR
+using Bgr24 = PixelFormat<3, 3>;
+
+// 32 бита, BGRA или BGRX. Четвёртый байт обрабатывается как обычный канал, чтобы пиксель
+// оставался выровненным словом: альфа фильтруется как данные, а не копируется. Сглаживание
+// сохраняет постоянную альфу, но производные (градиенты) переводят непрозрачную альфу 255 в 0 -
+// маску прозрачности такого выхода нужно восстанавливать отдельно или переводить вход в яркость
+using Bgra32 = PixelFormat<4, 4>;
+
+/// <summary>
+/// Вызывает func с пустым объектом формата, соответствующего bitPerPixel.
+/// </summary>
+template<class Func>
+void DispatchPixelFormat(uint16_t bitPerPixel, Func&& func)
+{
+	switch (bitPerPixel)
+	{
+	case Gray8::BitPerPixel:
+		func(Gray8{});
+		break;
+
+	case Bgr24::BitPerPixel:
+		func(Bgr24{});
+		break;
+
+	case Bgra32::BitPerPixel:
+		func(Bgra32{});
+		break;
+
+	default:
+		throw std::invalid_argument(
+			"Can't work with " + std::to_string(bitPerPixel) + " bit per pixel images");
+	}
+}
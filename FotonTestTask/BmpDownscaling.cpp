@@ -1,234 +1,315 @@
 #include <fstream>
+#include <algorithm>
+#include <cstring>
 #include "BmpDownscaling.h"
 #include "BmpFileHeader.h"
 #include "DibHeader.h"
+#include "PixelFormats.h"
+#include "MappedFile.h"
+#include "StridedGather.h"
+#include "FileStreams.h"
+#include "BmpOutput.h"
 
 
 void DownscaleBmpWithPixelSkipping(
 	path inputFilePath,
 	path outputFilePath,
-	int n) 
+	int n,
+	OutputBackend backend) 
 {
-	std::ifstream input(inputFilePath, std::ios::in | std::ios::binary);
-	std::ofstream output(outputFilePath, std::ios::out | std::ios::binary);
+	std::ifstream inputFile;
+	std::istream& input = OpenInputStream(inputFilePath, inputFile);
+
+	vector<uint8_t> outputHeaders;
+	RequiredBmpValues info = ReadChangeHeaders(input, outputHeaders, n);
+
+	BmpOutputFile output(
+		outputFilePath,
+		outputHeaders,
+		(int64_t)info.outputWidth * info.bitPerPixel / 8,
+		info.outputStride,
+		info.outputHeight,
+		backend);
+	BmpRowWriter writer(output);
+
+	// Канал или стандартный ввод нельзя отобразить в память,
+	// строки читаются последовательно, пропущенные - отбрасываются
+	if (!IsSeekablePath(inputFilePath))
+	{
+		DispatchPixelFormat(info.bitPerPixel, [&](auto format)
+			{
+				DownscaleRowsWithPixelSkipping<decltype(format)>(input, writer, info, n);
+			});
+
+		writer.Flush();
+		output.Close();
+		return;
+	}
+
+	inputFile.close();
 
-	if (!input.is_open())
+	// Пиксели читаются прямо из отображения, пропущенные строки не загружаются вовсе
+	MappedFile source(inputFilePath);
+
+	if ((int64_t)source.Size() < info.inputImageOffset + info.inputStride * info.inputHeight)
 	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + inputFilePath.string());
+		throw std::invalid_argument("Input bmp image is truncated");
 	}
-	if (!output.is_open())
+
+	// Пропускаемые строки не должны подтягиваться упреждающим чтением
+	if (info.inputStride * (n - 1) >= RandomAccessThresholdBytes)
 	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + outputFilePath.string());
+		source.AdviseRandomAccess();
 	}
 
-	RequiredBmpValues info = ReadChangeWriteHeaders(input, output, n);
+	DispatchPixelFormat(info.bitPerPixel, [&](auto format)
+		{
+			DownscaleRowsWithPixelSkipping<decltype(format)>(source, writer, info, n);
+		});
 
-	vector<std::byte> inputRowBuffer(info.inputWidth * BytePerPx);
-	vector<std::byte> outputRowBuffer(info.outputStride);
+	// Деструкторы глотают ошибки записи, поэтому последние строки сбрасываются явно
+	writer.Flush();
+	output.Close();
+}
 
-	for (size_t i = 0; i < info.inputHeight; i += n)
-	{
-		// Read row excluding padding bytes
-		input.read((char*)inputRowBuffer.data(), info.inputWidth * BytePerPx);
+template<class Px>
+void DownscaleRowsWithPixelSkipping(
+	const MappedFile& source,
+	BmpRowWriter& writer,
+	const RequiredBmpValues& info,
+	int n)
+{
+	const uint8_t* pixels = source.Data() + info.inputImageOffset;
+
+	StridedGather<Px> gather(n);
 
-		for (size_t j = 0; j < info.inputWidth; j += n)
+	for (int32_t y = 0; y < info.inputHeight; y += n)
+	{
+		// Следующая оставляемая строка подгружается, пока обрабатывается текущая
+		if (y + n < info.inputHeight)
 		{
-			// B
-			outputRowBuffer[(j * BytePerPx) / n] = inputRowBuffer[j * BytePerPx];
-			// G
-			outputRowBuffer[(j * BytePerPx) / n + 1] = inputRowBuffer[j * BytePerPx + 1];
-			// R
-			outputRowBuffer[(j * BytePerPx) / n + 2] = inputRowBuffer[j * BytePerPx + 2];
+			gather.Prefetch(pixels + info.inputStride * (y + n), info.inputWidth);
 		}
 
-		// Writing thinned row with padding bytes
-		output.write((char*)outputRowBuffer.data(), info.outputStride);
+		gather(pixels + info.inputStride * y, writer.Rows(y / n, 1), info.inputWidth);
+		writer.CommitRows();
+	}
+}
+
+template<class Px>
+void DownscaleRowsWithPixelSkipping(
+	std::istream& input,
+	BmpRowWriter& writer,
+	const RequiredBmpValues& info,
+	int n)
+{
+	const int64_t inputRowBytes = (int64_t)info.inputWidth * Px::BytePerPx;
+
+	StridedGather<Px> gather(n);
 
-		// In input stream skip padding bytes and n-1 rows
-		input.seekg(
-			info.inputPaddingBytesCount + info.inputStride * (n - 1),
-			std::ios_base::cur);
+	vector<uint8_t> inputRowBuffer(inputRowBytes);
+
+	for (int32_t y = 0; y < info.inputHeight; y += n)
+	{
+		input.read((char*)inputRowBuffer.data(), inputRowBytes);
+
+		gather(inputRowBuffer.data(), writer.Rows(y / n, 1), info.inputWidth);
+		writer.CommitRows();
+
+		// Отбрасывание выравнивания и n-1 строк без позиционирования
+		int rowsToSkip = std::min(n, info.inputHeight - y) - 1;
+		input.ignore(info.inputPaddingBytesCount + info.inputStride * rowsToSkip);
 	}
 }
 
 void DownscaleBmpWithAvgScailing(
 	path inputFilePath,
 	path outputFilePath,
-	int n)
+	int n,
+	OutputBackend backend)
 {
-	std::ifstream input(inputFilePath, std::ios::in | std::ios::binary);
-	std::ofstream output(outputFilePath, std::ios::out | std::ios::binary);
+	std::ifstream inputFile;
+	std::istream& input = OpenInputStream(inputFilePath, inputFile);
 
-	if (!input.is_open())
-	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + inputFilePath.string());
-	}
-	if (!output.is_open())
+	vector<uint8_t> outputHeaders;
+	RequiredBmpValues info = ReadChangeHeaders(input, outputHeaders, n);
+
+	// Усреднение индексов имеет смысл, только если палитра - оттенки серого
+	if (info.bitPerPixel == Gray8::BitPerPixel && !info.hasGrayscalePalette)
 	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + outputFilePath.string());
+		throw std::invalid_argument("Can't average 8 bit images with non-grayscale palette");
 	}
 
-	RequiredBmpValues info = ReadChangeWriteHeaders(input, output, n);
+	BmpOutputFile output(
+		outputFilePath,
+		outputHeaders,
+		(int64_t)info.outputWidth * info.bitPerPixel / 8,
+		info.outputStride,
+		info.outputHeight,
+		backend);
+	BmpRowWriter writer(output);
 
-	vector<uint8_t> inputRowBuffer(info.inputWidth * BytePerPx);
-	vector<uint8_t> outputRowBuffer(info.outputStride);
-	vector<float> avgValuesBuffer(info.outputWidth * BytePerPx);
+	DispatchPixelFormat(info.bitPerPixel, [&](auto format)
+		{
+			DownscaleRowsWithAvgScaling<decltype(format)>(input, writer, info, n);
+		});
 
-	// ���������� �������� � ������� � ��������� ����
-	int remainingHeight = info.inputHeight % n;
+	writer.Flush();
+	output.Close();
+}
 
-	// ���������� �������� � ������ � ��������� ����
-	int remainingWidth = info.inputWidth % n;
+template<class Px>
+void DownscaleRowsWithAvgScaling(
+	std::istream& input,
+	BmpRowWriter& writer,
+	const RequiredBmpValues& info,
+	int n)
+{
+	// n строк вместе с выравниванием читаются одним вызовом read
+	vector<uint8_t> inputRowsBuffer(info.inputStride * n);
+	vector<uint32_t> colSumBuffer((size_t)info.inputWidth * Px::BytePerPx);
+	vector<uint32_t> windowSumBuffer((size_t)info.outputWidth * Px::BytePerPx);
 
-	for (size_t i = 0; i < info.inputHeight - remainingHeight; i += n)
+	for (int32_t y = 0; y < info.inputHeight; y += n)
 	{
-		// ���������� ����
-		for (size_t j = 0; j < n; j++)
-		{
-			input.read((char*)inputRowBuffer.data(), info.inputWidth * BytePerPx);
-			input.seekg(info.inputPaddingBytesCount, std::ios_base::cur);
-
-			SumWindowsInRow(
-				inputRowBuffer,
-				avgValuesBuffer,
-				info.inputWidth,
-				n);
-		}
+		// У последнего окна по вертикали может быть меньше n строк
+		int windowHeight = std::min(n, info.inputHeight - y);
 
-		/*FindAvgValuesInSumBuffer(
-			avgValuesBuffer,
-			info.inputWidth,
-			info.inputHeight,
-			false,
-			n);*/
+		input.read((char*)inputRowsBuffer.data(), info.inputStride * windowHeight);
 
-		std::copy(begin(avgValuesBuffer), end(avgValuesBuffer), begin(outputRowBuffer));
+		SumRowsInBlock(
+			inputRowsBuffer,
+			colSumBuffer,
+			info.inputStride,
+			windowHeight);
 
-		output.write((char*)outputRowBuffer.data(), info.outputStride);
+		SumWindowsInRow<Px>(
+			colSumBuffer,
+			windowSumBuffer,
+			info.inputWidth,
+			n);
 
-		// ��������� ������� ������� ��������
-		std::fill(begin(avgValuesBuffer), end(avgValuesBuffer), 0.f);
-	}
+		FindAvgValuesInSumBuffer<Px>(
+			windowSumBuffer,
+			writer.Rows(y / n, 1),
+			info.inputWidth,
+			windowHeight,
+			n);
 
-	// ��������� ���������� �����
-	if (remainingHeight != 0)
-	{
-		for (size_t j = 0; j < remainingHeight; j++)
-		{
-			input.read((char*)inputRowBuffer.data(), info.inputWidth * BytePerPx);
-			input.seekg(info.inputPaddingBytesCount, std::ios_base::cur);
-
-			SumWindowsInRow(
-				inputRowBuffer,
-				avgValuesBuffer,
-				info.inputWidth,
-				n);
-		}
+		writer.CommitRows();
+	}
+}
 
-		/*FindAvgValuesInSumBuffer(
-			avgValuesBuffer,
-			info.inputWidth,
-			info.inputHeight,
-			true,
-			n);*/
+void SumRowsInBlock(
+	const vector<uint8_t>& inputRows,
+	vector<uint32_t>& colSumBuffer,
+	int64_t inputStride,
+	int rowsCount)
+{
+	const size_t rowWidthBytes = colSumBuffer.size();
+	uint32_t* sums = colSumBuffer.data();
 
-		std::copy(begin(avgValuesBuffer), end(avgValuesBuffer), begin(outputRowBuffer));
+	std::fill(begin(colSumBuffer), end(colSumBuffer), 0u);
 
-		output.write((char*)outputRowBuffer.data(), info.outputStride);
+	// Побайтовое сложение строк без зависимостей между итерациями,
+	// компилятор разворачивает цикл в векторные сложения
+	for (int j = 0; j < rowsCount; j++)
+	{
+		const uint8_t* row = inputRows.data() + inputStride * j;
 
-		std::fill(begin(avgValuesBuffer), end(avgValuesBuffer), 0.f);
+		for (size_t i = 0; i < rowWidthBytes; i++)
+		{
+			sums[i] += row[i];
+		}
 	}
 }
 
+template<class Px>
 void SumWindowsInRow(
-	const vector<unsigned char>& inputRow,
-	vector<float>& sumBuffer,
+	const vector<uint32_t>& colSums,
+	vector<uint32_t>& sumBuffer,
 	int32_t inputImageWidthInPixels,
 	int n)
 {
 	int remainingWidth = inputImageWidthInPixels % n;
+	size_t lastWindowOffset = (size_t)inputImageWidthInPixels - remainingWidth;
 
-	// ������������ ������ ����� ������ �� ����� � ������� �����
-	for (size_t x = 0;
-		x < inputImageWidthInPixels - remainingWidth;
-		x += n)
+	// Суммирование полных окон
+	for (size_t x = 0; x < lastWindowOffset; x += n)
 	{
-		for (size_t w = x * BytePerPx; w < (x + n) * BytePerPx; w += BytePerPx)
+		uint32_t sums[Px::ChannelCount]{};
+
+		for (size_t w = x * Px::BytePerPx; w < (x + n) * Px::BytePerPx; w += Px::BytePerPx)
 		{
-			sumBuffer[x * BytePerPx / n] += inputRow[w];
-			sumBuffer[x * BytePerPx / n + 1] += inputRow[w + 1];
-			sumBuffer[x * BytePerPx / n + 2] += inputRow[w + 2];
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				sums[c] += colSums[w + c];
+			}
+		}
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			sumBuffer[x / n * Px::BytePerPx + c] = sums[c];
+		}
+	}
+
+	// Суммирование неполного правого окна
+	if (remainingWidth != 0)
+	{
+		uint32_t sums[Px::ChannelCount]{};
+
+		for (size_t w = lastWindowOffset * Px::BytePerPx;
+			w < (size_t)inputImageWidthInPixels * Px::BytePerPx;
+			w += Px::BytePerPx)
+		{
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				sums[c] += colSums[w + c];
+			}
+		}
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			sumBuffer[lastWindowOffset / n * Px::BytePerPx + c] = sums[c];
 		}
 	}
+}
 
-	size_t lastWindowOffset = inputImageWidthInPixels - remainingWidth;
+template<class Px>
+void FindAvgValuesInSumBuffer(
+	const vector<uint32_t>& sumBuffer,
+	uint8_t* outputRow,
+	int32_t srcW,
+	int windowHeight,
+	int n)
+{
+	// Количество пикселей в строке в последнем окне
+	int remainingWidth = srcW % n;
+
+	// Площади полного окна и неполного правого окна
+	uint32_t windowSquare = (uint32_t)n * windowHeight;
+	uint32_t lastWindowSquare = (uint32_t)remainingWidth * windowHeight;
+
+	size_t fullWindowsBytes = (size_t)(srcW / n) * Px::BytePerPx;
+
+	// Деление с округлением к ближайшему
+	for (size_t k = 0; k < fullWindowsBytes; k++)
+	{
+		outputRow[k] = (uint8_t)((sumBuffer[k] + windowSquare / 2) / windowSquare);
+	}
 
-	// ������������ �������� ���������� ��������
-	for (size_t w = lastWindowOffset * BytePerPx;
-		w < (lastWindowOffset + remainingWidth) * BytePerPx;
-		w += BytePerPx)
+	if (remainingWidth != 0)
 	{
-		sumBuffer[lastWindowOffset * BytePerPx / n] += inputRow[w];
-		sumBuffer[lastWindowOffset * BytePerPx / n + 1] += inputRow[w + 1];
-		sumBuffer[lastWindowOffset * BytePerPx / n + 2] += inputRow[w + 2];
+		for (size_t k = fullWindowsBytes; k < fullWindowsBytes + Px::BytePerPx; k++)
+		{
+			outputRow[k] = (uint8_t)((sumBuffer[k] + lastWindowSquare / 2) / lastWindowSquare);
+		}
 	}
 }
 
-//void FindAvgValuesInSumBuffer(
-//	vector<float>& sumBuffer,
-//	int32_t srcW, int32_t srcH,
-//	bool isTopEdge,
-//	int n)
-//{
-//	// ���������� �������� � ������ � ��������� ����
-//	int remainingWidth = srcW % n;
-//
-//	int windowSquare;
-//	int lastWindowSquare;
-//
-//	if (isTopEdge)
-//	{
-//		// ���������� �������� � ������� � ��������� ����
-//		int remainingHeight = srcH % n;
-//
-//		// ��������� ������ ����
-//		windowSquare = n * remainingHeight;
-//		lastWindowSquare = remainingWidth * remainingHeight;
-//	}
-//	else
-//	{
-//		windowSquare = n * n;
-//		lastWindowSquare = remainingWidth * n;
-//	}
-//
-//	// ���������� ������� ��������
-//	for (size_t k = 0;
-//		k < (size_t)srcW - remainingWidth;
-//		k += n)
-//	{
-//		sumBuffer[k * BytePerPx / n] /= windowSquare;
-//		sumBuffer[k * BytePerPx / n + 1] /= windowSquare;
-//		sumBuffer[k * BytePerPx / n + 2] /= windowSquare;
-//	}
-//
-//	// ���������� ������� �������� � ���������� ����� ��������
-//	if (remainingWidth != 0)
-//	{
-//		size_t lastPixelOffset = (size_t)srcW - remainingWidth;
-//		
-//		sumBuffer[lastPixelOffset * BytePerPx / n] /= lastWindowSquare;
-//		sumBuffer[lastPixelOffset * BytePerPx / n + 1] /= lastWindowSquare;
-//		sumBuffer[lastPixelOffset * BytePerPx / n + 2] /= lastWindowSquare;
-//	}
-//}
-
-RequiredBmpValues ReadChangeWriteHeaders(
-	std::ifstream& input,
-	std::ofstream& output,
+RequiredBmpValues ReadChangeHeaders(
+	std::istream& input,
+	vector<uint8_t>& outputHeaders,
 	int n) 
 {
 	BmpFileHeader fileHeader{};
@@ -238,22 +319,90 @@ RequiredBmpValues ReadChangeWriteHeaders(
 	input.read((char*)&fileHeader, sizeof(BmpFileHeader));
 	input.read((char*)&dibHeader, sizeof(DibHeader));
 
-	info.inputHeight = dibHeader.imageHeight;
+	if (fileHeader.bm != BmpSignature)
+	{
+		throw std::invalid_argument("Input file is not a bmp image");
+	}
+	if (dibHeader.headerSize < sizeof(DibHeader))
+	{
+		throw std::invalid_argument("Can't work with OS/2 bmp headers");
+	}
+	if (dibHeader.compressionMethod != BmpWithoutCompression &&
+		!(dibHeader.compressionMethod == BmpBitFields && dibHeader.bitPerPixel == 32))
+	{
+		throw std::invalid_argument("Can't work with compressed bmp images");
+	}
+	if (fileHeader.imageOffset < sizeof(BmpFileHeader) + sizeof(DibHeader))
+	{
+		throw std::invalid_argument("Invalid bmp image data offset");
+	}
+
+	// Расширенная часть DIB заголовка, маски каналов и палитра
+	// лежат между стандартными заголовками и началом данных изображения
+	vector<uint8_t> extraHeaderBytes(
+		fileHeader.imageOffset - sizeof(BmpFileHeader) - sizeof(DibHeader));
+	input.read((char*)extraHeaderBytes.data(), extraHeaderBytes.size());
+
+	int bytePerPx = dibHeader.bitPerPixel / 8;
+
+	// Отрицательная высота - строки хранятся сверху вниз.
+	// Окна строятся в порядке хранения строк, поэтому переупорядочивать
+	// их не нужно, достаточно сохранить знак высоты
+	info.inputImageOffset = fileHeader.imageOffset;
+	info.isTopDown = dibHeader.imageHeight < 0;
+	info.bitPerPixel = dibHeader.bitPerPixel;
+	info.hasGrayscalePalette = dibHeader.bitPerPixel == 8 &&
+		IsGrayscalePalette(extraHeaderBytes, dibHeader);
+
+	info.inputHeight = info.isTopDown ? -dibHeader.imageHeight : dibHeader.imageHeight;
 	info.inputWidth = dibHeader.imageWidth;
-	info.inputStride = (int64_t)(info.inputWidth * BytePerPx + 3) & ~3;
-	info.inputPaddingBytesCount = info.inputStride - (int64_t)info.inputWidth * BytePerPx;
+	info.inputStride = ((int64_t)info.inputWidth * bytePerPx + 3) & ~3;
+	info.inputPaddingBytesCount = info.inputStride - (int64_t)info.inputWidth * bytePerPx;
 
-	int32_t outputHeight = (info.inputHeight + n - 1) / n;
+	info.outputHeight = (info.inputHeight + n - 1) / n;
 	info.outputWidth = (info.inputWidth + n - 1) / n;
-	info.outputStride = (int64_t)(info.outputWidth * BytePerPx + 3) & ~3;
+	info.outputStride = ((int64_t)info.outputWidth * bytePerPx + 3) & ~3;
 
-	dibHeader.imageHeight = outputHeight;
+	dibHeader.imageHeight = info.isTopDown ? -info.outputHeight : info.outputHeight;
 	dibHeader.imageWidth = info.outputWidth;
-	dibHeader.imageSize = info.outputStride * outputHeight;
-	fileHeader.fileSize = dibHeader.imageSize + sizeof(BmpFileHeader) + sizeof(DibHeader);
+	dibHeader.imageSize = info.outputStride * info.outputHeight;
+	fileHeader.fileSize = dibHeader.imageSize + fileHeader.imageOffset;
 
-	output.write((char*)&fileHeader, sizeof(BmpFileHeader));
-	output.write((char*)&dibHeader, sizeof(DibHeader));
+	outputHeaders.resize(fileHeader.imageOffset);
+	std::memcpy(outputHeaders.data(), &fileHeader, sizeof(BmpFileHeader));
+	std::memcpy(outputHeaders.data() + sizeof(BmpFileHeader), &dibHeader, sizeof(DibHeader));
+	std::copy(
+		begin(extraHeaderBytes),
+		end(extraHeaderBytes),
+		begin(outputHeaders) + sizeof(BmpFileHeader) + sizeof(DibHeader));
 
 	return info;
-}
\ No newline at end of file
+}
+
+bool IsGrayscalePalette(
+	const vector<uint8_t>& extraHeaderBytes,
+	const DibHeader& dibHeader)
+{
+	const size_t paletteEntryBytes = 4;
+
+	// Палитра идёт сразу после DIB заголовка, который может быть длиннее 40 байт
+	size_t paletteOffset = dibHeader.headerSize - sizeof(DibHeader);
+	size_t colorsCount = dibHeader.paletteColorsCount == 0 ? 256 : dibHeader.paletteColorsCount;
+
+	if (paletteOffset + colorsCount * paletteEntryBytes > extraHeaderBytes.size())
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < colorsCount; i++)
+	{
+		const uint8_t* entry = &extraHeaderBytes[paletteOffset + i * paletteEntryBytes];
+
+		if (entry[0] != i || entry[1] != i || entry[2] != i)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
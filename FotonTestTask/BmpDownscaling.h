@@ -1,37 +1,78 @@
 #pragma once
 
 #include <vector>
+#include <fstream>
 #include <filesystem>
 #include "RequiredBmpValues.h"
+#include "DibHeader.h"
+#include "MappedFile.h"
+#include "BmpOutput.h"
 
 using std::vector;
 using std::filesystem::path;
 
-const int BytePerPx = 3;
+// Шаг между оставляемыми строками, начиная с которого упреждающее чтение отключается
+const int64_t RandomAccessThresholdBytes = 1 << 20;
 
 void DownscaleBmpWithPixelSkipping(
 	path inputFilePath,
 	path outputFilePath,
+	int n,
+	OutputBackend backend = OutputBackend::Auto);
+
+template<class Px>
+void DownscaleRowsWithPixelSkipping(
+	const MappedFile& source,
+	BmpRowWriter& writer,
+	const RequiredBmpValues& info,
+	int n);
+
+template<class Px>
+void DownscaleRowsWithPixelSkipping(
+	std::istream& input,
+	BmpRowWriter& writer,
+	const RequiredBmpValues& info,
 	int n);
 
 void DownscaleBmpWithAvgScailing(
 	path inputFilePath,
 	path outputFilePath,
+	int n,
+	OutputBackend backend = OutputBackend::Auto);
+
+template<class Px>
+void DownscaleRowsWithAvgScaling(
+	std::istream& input,
+	BmpRowWriter& writer,
+	const RequiredBmpValues& info,
 	int n);
 
+void SumRowsInBlock(
+	const vector<uint8_t>& inputRows,
+	vector<uint32_t>& colSumBuffer,
+	int64_t inputStride,
+	int rowsCount);
+
+template<class Px>
 void SumWindowsInRow(
-	const vector<unsigned char>& inputRow,
-	vector<float>& sumBuffer,
+	const vector<uint32_t>& colSums,
+	vector<uint32_t>& sumBuffer,
 	int32_t inputImageWidthInPixels,
 	int n);
 
-//void FindAvgValuesInSumBuffer(
-//	vector<float>& sumBuffer,
-//	int32_t srcW, int32_t srcH,
-//	bool isTopEdge,
-//	int n);
+template<class Px>
+void FindAvgValuesInSumBuffer(
+	const vector<uint32_t>& sumBuffer,
+	uint8_t* outputRow,
+	int32_t srcW,
+	int windowHeight,
+	int n);
+
+RequiredBmpValues ReadChangeHeaders(
+	std::istream& input,
+	vector<uint8_t>& outputHeaders,
+	int n);
 
-RequiredBmpValues ReadChangeWriteHeaders(
-	std::ifstream& input,
-	std::ofstream& output,
-	int n);
\ No newline at end of file
+bool IsGrayscalePalette(
+	const vector<uint8_t>& extraHeaderBytes,
+	const DibHeader& dibHeader);
\ No newline at end of file
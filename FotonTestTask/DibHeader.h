@@ -3,6 +3,20 @@
 #include <cstdint>
 #include "RequiredTiffData.h"
 
+const uint16_t BmpSignature = 0x4d42;
+const uint32_t BmpWithoutCompression = 0;
+const uint32_t BmpBitFields = 3;
+
+// Порядок хранения строк в выходном bmp
+enum class BmpRowOrder
+{
+	// Положительная высота, первой в файле идёт нижняя строка
+	BottomUp,
+
+	// Отрицательная высота, строки пишутся строго последовательно
+	TopDown
+};
+
 struct DibHeader 
 {
 	DibHeader();
@@ -1,29 +1,65 @@
 #include <iostream>
 #include <chrono>
+#include <string>
 
 #include "TiffDownscaling.h"
+#include "BmpDownscaling.h"
 
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
 
-int main()
+// Путь "-" - стандартный ввод или вывод, поэтому всё, кроме изображения, пишется в std::cerr
+const char Usage[] =
+	"Usage:\n"
+	"  FotonTestTask tiff <input.tiff> <output.bmp|-> <n> [minContrast maxContrast]\n"
+	"  FotonTestTask avg <input.bmp|-> <output.bmp|-> <n>\n"
+	"  FotonTestTask skip <input.bmp|-> <output.bmp|-> <n>\n";
+
+int main(int argc, char* argv[])
 {
+	if (argc < 5)
+	{
+		std::cerr << Usage;
+		return 1;
+	}
+
 	try
 	{
+		std::string mode = argv[1];
+		int n = std::stoi(argv[4]);
+
 		auto now = high_resolution_clock::now();
 
-		DownscaleTiffWithAvgScaling(
-			"H:\\ImageTest\\0041_0102_01567_1_01497_03_S.tiff",
-			"H:\\ImageTest\\filtrationTest.bmp",
-			0.01f, 0.99f,
-			1);
+		if (mode == "tiff")
+		{
+			DownscaleTiffWithAvgScaling(
+				argv[2],
+				argv[3],
+				argc > 6 ? std::stof(argv[5]) : 0.01f,
+				argc > 6 ? std::stof(argv[6]) : 0.99f,
+				n);
+		}
+		else if (mode == "avg")
+		{
+			DownscaleBmpWithAvgScailing(argv[2], argv[3], n);
+		}
+		else if (mode == "skip")
+		{
+			DownscaleBmpWithPixelSkipping(argv[2], argv[3], n);
+		}
+		else
+		{
+			std::cerr << Usage;
+			return 1;
+		}
 
 		auto resultTime = duration_cast<milliseconds>(high_resolution_clock::now() - now);
-		std::cout << "Downscaling has been completed in " << resultTime.count() << " ms.\n";
+		std::cerr << "Downscaling has been completed in " << resultTime.count() << " ms.\n";
 	}
-	catch (const std::invalid_argument& e)
+	catch (const std::exception& e)
 	{
-		std::cout << e.what() << '\n';
+		std::cerr << e.what() << '\n';
+		return 1;
 	}
 }
\ No newline at end of file
@@ -3,10 +3,15 @@
 
 struct RequiredBmpValues 
 {
+	int64_t inputImageOffset;
 	int32_t inputHeight;
 	int32_t inputWidth;
 	int64_t inputStride;
 	int32_t inputPaddingBytesCount;
 	int32_t outputWidth;
 	int64_t outputStride;
+	int32_t outputHeight;
+	uint16_t bitPerPixel;
+	bool isTopDown;
+	bool hasGrayscalePalette;
 };
\ No newline at end of file
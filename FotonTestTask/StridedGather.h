@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// pshufb есть не у всех процессоров x64, поэтому перестановка включается только
+// при сборке под SSSE3 или AVX (конфигурации x64 проекта собираются с AVX2, MSVC
+// определяет __AVX__). Предвыборке достаточно SSE2, который есть у любого x64
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <immintrin.h>
+#define STRIDED_GATHER_SSSE3
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define STRIDED_GATHER_PREFETCH
+#endif
+
+const int CacheLineBytes = 64;
+
+/// <summary>
+/// Копирование каждого n-го пикселя строки. Если в 16 байт помещается
+/// хотя бы два нужных пикселя, они собираются одной перестановкой pshufb,
+/// иначе пиксели копируются по одному.
+/// </summary>
+template<class Px>
+class StridedGather
+{
+private:
+	int n_;
+
+	// Количество нужных пикселей в одной 16-байтовой загрузке
+	int pixelsPerStep_ = 0;
+
+#ifdef STRIDED_GATHER_SSSE3
+	__m128i shuffleMask_{};
+#endif
+
+public:
+	explicit StridedGather(int n) : n_(n)
+	{
+#ifdef STRIDED_GATHER_SSSE3
+		pixelsPerStep_ = (16 - Px::BytePerPx) / (n * Px::BytePerPx) + 1;
+
+		if (pixelsPerStep_ < 2)
+		{
+			pixelsPerStep_ = 0;
+			return;
+		}
+
+		// Байты, не попадающие в выходные пиксели, обнуляются (индекс 0x80)
+		alignas(16) int8_t mask[16];
+		std::memset(mask, 0x80, sizeof(mask));
+
+		for (int k = 0; k < pixelsPerStep_; k++)
+		{
+			for (int b = 0; b < Px::BytePerPx; b++)
+			{
+				mask[k * Px::BytePerPx + b] = (int8_t)(k * n * Px::BytePerPx + b);
+			}
+		}
+
+		shuffleMask_ = _mm_load_si128((const __m128i*)mask);
+#endif
+	}
+
+	/// <summary>
+	/// Записывает в outputRow пиксели 0, n, 2n... строки inputRow.
+	/// Байты за концом выходной строки не затрагиваются.
+	/// </summary>
+	void operator()(const uint8_t* inputRow, uint8_t* outputRow, int32_t inputWidth) const
+	{
+		const int64_t inputRowBytes = (int64_t)inputWidth * Px::BytePerPx;
+		const int64_t inputStepBytes = (int64_t)n_ * Px::BytePerPx;
+
+		int64_t inputOffset = 0;
+		int64_t outputOffset = 0;
+
+#ifdef STRIDED_GATHER_SSSE3
+		if (pixelsPerStep_ != 0)
+		{
+			const int64_t outputRowBytes = ((int64_t)inputWidth + n_ - 1) / n_ * Px::BytePerPx;
+			const int64_t inputGroupBytes = inputStepBytes * pixelsPerStep_;
+			const int64_t outputGroupBytes = (int64_t)Px::BytePerPx * pixelsPerStep_;
+
+			// 16-байтовые загрузка и запись не должны выходить за пределы строк:
+			// выходная строка может лежать прямо в отображении выходного файла
+			for (; inputOffset + 16 <= inputRowBytes && outputOffset + 16 <= outputRowBytes;
+				inputOffset += inputGroupBytes, outputOffset += outputGroupBytes)
+			{
+				__m128i pixels = _mm_loadu_si128((const __m128i*)(inputRow + inputOffset));
+
+				_mm_storeu_si128(
+					(__m128i*)(outputRow + outputOffset),
+					_mm_shuffle_epi8(pixels, shuffleMask_));
+			}
+		}
+#endif
+
+		// Оставшиеся пиксели или все пиксели при большом n
+		for (; inputOffset < inputRowBytes;
+			inputOffset += inputStepBytes, outputOffset += Px::BytePerPx)
+		{
+			std::memcpy(outputRow + outputOffset, inputRow + inputOffset, Px::BytePerPx);
+		}
+	}
+
+	/// <summary>
+	/// Программная предвыборка кэш-линий строки, содержащих нужные пиксели.
+	/// </summary>
+	void Prefetch(const uint8_t* inputRow, int32_t inputWidth) const
+	{
+#ifdef STRIDED_GATHER_PREFETCH
+		const int64_t inputRowBytes = (int64_t)inputWidth * Px::BytePerPx;
+		const int64_t inputStepBytes = (int64_t)n_ * Px::BytePerPx;
+
+		// При шаге меньше кэш-линии нужна каждая линия строки
+		const int64_t prefetchStepBytes = inputStepBytes < CacheLineBytes
+			? CacheLineBytes
+			: inputStepBytes;
+
+		for (int64_t offset = 0; offset < inputRowBytes; offset += prefetchStepBytes)
+		{
+			_mm_prefetch((const char*)(inputRow + offset), _MM_HINT_T0);
+		}
+#endif
+	}
+};
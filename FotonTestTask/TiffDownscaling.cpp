@@ -1,26 +1,32 @@
 #include "TiffDownscaling.h"
 #include <algorithm>
 #include <numeric>
+#include <cstring>
+#include "FileStreams.h"
 
 void DownscaleTiffWithAvgScaling(
 	path inputFilePath,
 	path outputFilePath,
 	float minContrastBorder,
 	float maxContrastBorder,
-	int n)
+	int n,
+	BmpRowOrder rowOrder,
+	OutputBackend backend)
 {
+	// tiff        ,
+	//      
 	std::ifstream input(inputFilePath, std::ios::in | std::ios::binary);
-	std::ofstream output(outputFilePath, std::ios::out | std::ios::binary);
 
 	if (!input.is_open())
 	{
 		std::string errorMessage = "Can't find or open file with input path: ";
 		throw std::invalid_argument(errorMessage + inputFilePath.string());
 	}
-	if (!output.is_open())
+
+	//      
+	if (!IsSeekablePath(outputFilePath) || backend == OutputBackend::Stream)
 	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + outputFilePath.string());
+		rowOrder = BmpRowOrder::TopDown;
 	}
 
 	RequiredTiffData tiffData = ReadTiff(input);
@@ -29,11 +35,17 @@ void DownscaleTiffWithAvgScaling(
 	tiffData.destLengthPx = (tiffData.srcLengthPx + n - 1) / n;
 	tiffData.destStrideBytes = (tiffData.destWidthPx * BmpBytePerPx + 3) & ~3;
 
-	WriteBmpHeaders(tiffData, output);
+	BmpOutputFile output(
+		outputFilePath,
+		BuildBmpHeaders(tiffData, rowOrder),
+		(int64_t)tiffData.destWidthPx * BmpBytePerPx,
+		tiffData.destStrideBytes,
+		tiffData.destLengthPx,
+		backend);
+	BmpRowWriter writer(output);
 
 	// uint16_t ..     2 
 	vector<uint16_t> srcRowBuffer(tiffData.srcWidthPx * ChannelCount);
-	vector<uint8_t> destRowBuffer(tiffData.destStrideBytes);
 	vector<float> avgValuesBuffer(tiffData.destWidthPx * ChannelCount);
 
 	//  auto
@@ -47,14 +59,14 @@ void DownscaleTiffWithAvgScaling(
 
 	int rowInStripCounter = 0;
 	int stripCounter = 1;
-	int bmpRowCounter = tiffData.destLengthPx;
+
+	//  bmp      
+	int64_t bmpRow = rowOrder == BmpRowOrder::BottomUp ? tiffData.destLengthPx - 1 : 0;
+	const int64_t bmpRowStep = rowOrder == BmpRowOrder::BottomUp ? -1 : 1;
 
 	//    
 	input.seekg(tiffData.stripOffsets[0]);
 
-	//        
-	output.seekp(BmpImageOffsetBytes + (bmpRowCounter--) * tiffData.destStrideBytes);
-
 	for (size_t y = 0; y < tiffData.srcLengthPx - remainingLengthPx; y += n)
 	{
 		for (size_t j = 0; j < n; j++)
@@ -80,14 +92,9 @@ void DownscaleTiffWithAvgScaling(
 			false,
 			n);
 
-		CopyAvgValuesToDestRowBuffer(avgValuesBuffer, destRowBuffer, contrastingFuncs);
-
-		output.write((char*)destRowBuffer.data(), destRowBuffer.size());
-
-		if (bmpRowCounter >= 0)
-		{
-			output.seekp(BmpImageOffsetBytes + (bmpRowCounter--) * tiffData.destStrideBytes);
-		}
+		CopyAvgValuesToDestRow(avgValuesBuffer, writer.Rows(bmpRow, 1), contrastingFuncs);
+		writer.CommitRows();
+		bmpRow += bmpRowStep;
 
 		std::fill(begin(avgValuesBuffer), end(avgValuesBuffer), 0.f);
 	}
@@ -117,12 +124,15 @@ void DownscaleTiffWithAvgScaling(
 			true,
 			n);
 
-		CopyAvgValuesToDestRowBuffer(avgValuesBuffer, destRowBuffer, contrastingFuncs);
-
-		output.write((char*)destRowBuffer.data(), destRowBuffer.size());
+		CopyAvgValuesToDestRow(avgValuesBuffer, writer.Rows(bmpRow, 1), contrastingFuncs);
+		writer.CommitRows();
+		bmpRow += bmpRowStep;
 
 		std::fill(begin(avgValuesBuffer), end(avgValuesBuffer), 0.f);
 	}
+
+	writer.Flush();
+	output.Close();
 }
 
 
@@ -231,17 +241,26 @@ RequiredTiffData ReadTiff(std::ifstream& input)
 }
 
 
-void WriteBmpHeaders(
+vector<uint8_t> BuildBmpHeaders(
 	const RequiredTiffData& tiffData,
-	std::ofstream& output)
+	BmpRowOrder rowOrder)
 {
 	DibHeader dibHeader(tiffData);
 
+	//   -    
+	if (rowOrder == BmpRowOrder::TopDown)
+	{
+		dibHeader.imageHeight = -dibHeader.imageHeight;
+	}
+
 	BmpFileHeader fileHeader;
 	fileHeader.fileSize = dibHeader.imageSize + sizeof(BmpFileHeader) + sizeof(DibHeader);
 
-	output.write((char*)&fileHeader, sizeof(BmpFileHeader));
-	output.write((char*)&dibHeader, sizeof(DibHeader));
+	vector<uint8_t> headerBytes(sizeof(BmpFileHeader) + sizeof(DibHeader));
+	std::memcpy(headerBytes.data(), &fileHeader, sizeof(BmpFileHeader));
+	std::memcpy(headerBytes.data() + sizeof(BmpFileHeader), &dibHeader, sizeof(DibHeader));
+
+	return headerBytes;
 }
 
 
@@ -333,17 +352,17 @@ void CalculateAvgValuesInSumBuffer(
 	}
 }
 
-void CopyAvgValuesToDestRowBuffer(
-	const vector<float>& avgValues, 
-	vector<uint8_t>& destRowBuffer, 
+void CopyAvgValuesToDestRow(
+	const vector<float>& avgValues,
+	uint8_t* destRow,
 	const array<ContrastingFunc, ChannelCount>& contrastingFuncs)
 {
 	for (size_t i = 0; i < avgValues.size(); i += 3)
 	{
 		//    uint8_t  
-		destRowBuffer[i] = contrastingFuncs[2](avgValues[i]);
-		destRowBuffer[i + 1] = contrastingFuncs[1](avgValues[i + 1]);
-		destRowBuffer[i + 2] = contrastingFuncs[0](avgValues[i + 2]);
+		destRow[i] = contrastingFuncs[2](avgValues[i]);
+		destRow[i + 1] = contrastingFuncs[1](avgValues[i + 1]);
+		destRow[i + 2] = contrastingFuncs[0](avgValues[i + 2]);
 	}
 }
 
@@ -11,6 +11,7 @@
 #include "DibHeader.h"
 #include "BmpFileHeader.h"
 #include "ContrastingFunc.h"
+#include "BmpOutput.h"
 
 using std::array;
 using std::function;
@@ -28,11 +29,15 @@ void DownscaleTiffWithAvgScaling(
 	path outputFilePath,
 	float minContrastBorder,
 	float maxContrastBorder,
-	int n);
+	int n,
+	BmpRowOrder rowOrder = BmpRowOrder::BottomUp,
+	OutputBackend backend = OutputBackend::Auto);
 
 RequiredTiffData ReadTiff(std::ifstream& input);
 
-void WriteBmpHeaders(const RequiredTiffData& tiffData, std::ofstream& output);
+vector<uint8_t> BuildBmpHeaders(
+	const RequiredTiffData& tiffData,
+	BmpRowOrder rowOrder);
 
 void SumWindowsInRow(
 	const vector<uint16_t>& srcRow,
@@ -45,9 +50,9 @@ void CalculateAvgValuesInSumBuffer(
 	bool isBottomEdge,
 	int n);
 
-void CopyAvgValuesToDestRowBuffer(
-	const vector<float>& avgValues, 
-	vector<uint8_t>& destRowBuffer,
+void CopyAvgValuesToDestRow(
+	const vector<float>& avgValues,
+	uint8_t* destRow,
 	const array<ContrastingFunc, ChannelCount>& contrastingFuncs);
 
 
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <stdexcept>
+
+#include "BmpImageInfo.h"
+#include "FileStreams.h"
+#include "BmpOutput.h"
+#include "SourceFile.h"
+
+using std::vector;
+
+// Полосы короче этого числа строк не окупают ореол и запуск потока
+const int MinBandRowsCount = 64;
+
+/// <summary>
+/// Число потоков по умолчанию - по числу ядер.
+/// </summary>
+inline int DefaultThreadsCount()
+{
+	return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+/// <summary>
+/// Делит [0, itemsCount) на threadsCount непрерывных частей и вызывает fn(first, end)
+/// для каждой в своём потоке. Первое исключение потоков пробрасывается вызывающему.
+/// </summary>
+template<class Fn>
+void ParallelFor(int itemsCount, int threadsCount, Fn fn)
+{
+	int partsCount = std::max(1, std::min(threadsCount, itemsCount));
+
+	vector<std::exception_ptr> errors(partsCount);
+	vector<std::thread> threads;
+
+	auto runPart = [&](int i)
+		{
+			try
+			{
+				fn((int)((int64_t)itemsCount * i / partsCount),
+					(int)((int64_t)itemsCount * (i + 1) / partsCount));
+			}
+			catch (...)
+			{
+				errors[i] = std::current_exception();
+			}
+		};
+
+	for (int i = 1; i < partsCount; i++)
+	{
+		threads.emplace_back(runPart, i);
+	}
+
+	runPart(0);
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	for (const std::exception_ptr& error : errors)
+	{
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+}
+
+/// <summary>
+/// Сколько строк источника над и под своими выходными строками нужно полосе,
+/// чтобы отражение внутри ядра фильтра не затронуло выходные строки.
+/// Границы полос кратны alignmentRows (полосы БПФ должны совпадать с последовательным проходом).
+/// </summary>
+struct BandHalo
+{
+	int topRowsCount;
+	int bottomRowsCount;
+	int alignmentRows = 1;
+};
+
+/// <summary>
+/// Ореол фильтра с ядром высоты kernelHeight и вертикальным радиусом verticalRadius.
+/// </summary>
+inline BandHalo KernelBandHalo(int kernelHeight, int verticalRadius)
+{
+	return { verticalRadius, kernelHeight - 1 - verticalRadius };
+}
+
+/// <summary>
+/// Полоса изображения: выходные строки [firstRow, firstRow + rowsCount)
+/// вычисляются по строкам источника [firstSrcRow, firstSrcRow + srcRowsCount).
+/// </summary>
+struct ImageBand
+{
+	int firstRow;
+	int rowsCount;
+	int firstSrcRow;
+	int srcRowsCount;
+};
+
+inline vector<ImageBand> PlanImageBands(int imageHeightPx, int bandsCount, const BandHalo& halo)
+{
+	vector<ImageBand> bands;
+
+	int alignedRowsCount = (imageHeightPx + halo.alignmentRows - 1) / halo.alignmentRows;
+
+	for (int i = 0; i < bandsCount; i++)
+	{
+		int firstRow = std::min(imageHeightPx,
+			(int)((int64_t)alignedRowsCount * i / bandsCount) * halo.alignmentRows);
+		int endRow = std::min(imageHeightPx,
+			(int)((int64_t)alignedRowsCount * (i + 1) / bandsCount) * halo.alignmentRows);
+
+		if (firstRow >= endRow)
+		{
+			continue;
+		}
+
+		int firstSrcRow = std::max(0, firstRow - halo.topRowsCount);
+		int endSrcRow = std::min(imageHeightPx, endRow + halo.bottomRowsCount);
+
+		bands.push_back({ firstRow, endRow - firstRow, firstSrcRow, endSrcRow - firstSrcRow });
+	}
+
+	return bands;
+}
+
+/// <summary>
+/// Применяет потоковый фильтр filter(src, dests, info) с несколькими выходными изображениями
+/// параллельно к горизонтальным полосам. Каждая полоса читается своим потоком с ореолом halo,
+/// фильтр отражает только её края, поэтому строки ореола вычисляются заново и отбрасываются,
+/// а строки полосы совпадают с последовательным проходом. Строки пишутся позиционно,
+/// каждой полосой в каждый выход своим BmpRowWriter (dests[i] пишет в destFiles[i]).
+/// Если вход - канал или хотя бы один выход пишется потоком, фильтр выполняется последовательно.
+/// </summary>
+template<class Filter>
+void FilterInBands(
+	const SourceImage& srcPath,
+	std::istream& src,
+	const vector<BmpOutputFile*>& destFiles,
+	const BmpImageInfo& info,
+	const BandHalo& halo,
+	int threadsCount,
+	Filter filter)
+{
+	int maxBandsCount = info.imageHeightPx /
+		std::max(MinBandRowsCount, halo.topRowsCount + halo.bottomRowsCount + halo.alignmentRows);
+
+	int bandsCount = std::min(threadsCount, maxBandsCount);
+
+	bool isStreamOutput = std::any_of(destFiles.begin(), destFiles.end(),
+		[](const BmpOutputFile* destFile) { return destFile->Backend() == OutputBackend::Stream; });
+
+	// Писатели полосы: в весь файл или только в строки полосы
+	auto filterWithWriters = [&](std::istream& bandSrc, const BmpImageInfo& bandInfo, auto makeWriter)
+		{
+			vector<std::unique_ptr<BmpRowWriter>> writers;
+			vector<BmpRowWriter*> dests;
+
+			for (BmpOutputFile* destFile : destFiles)
+			{
+				writers.push_back(makeWriter(*destFile));
+				dests.push_back(writers.back().get());
+			}
+
+			filter(bandSrc, dests, bandInfo);
+
+			for (BmpRowWriter* dest : dests)
+			{
+				dest->Flush();
+			}
+		};
+
+	if (bandsCount <= 1 ||
+		!IsSeekablePath(srcPath) ||
+		isStreamOutput)
+	{
+		filterWithWriters(src, info, [](BmpOutputFile& destFile)
+			{
+				return std::make_unique<BmpRowWriter>(destFile);
+			});
+		return;
+	}
+
+	vector<ImageBand> bands = PlanImageBands(info.imageHeightPx, bandsCount, halo);
+	vector<std::exception_ptr> errors(bands.size());
+
+	auto filterBand = [&](size_t i, std::istream& bandSrc)
+		{
+			try
+			{
+				const ImageBand& band = bands[i];
+
+				BmpImageInfo bandInfo = info;
+				bandInfo.imageHeightPx = band.srcRowsCount;
+
+				filterWithWriters(bandSrc, bandInfo, [&](BmpOutputFile& destFile)
+					{
+						return std::make_unique<BmpRowWriter>(destFile, band.firstSrcRow, band.firstRow, band.rowsCount);
+					});
+			}
+			catch (...)
+			{
+				errors[i] = std::current_exception();
+			}
+		};
+
+	vector<std::thread> threads;
+
+	for (size_t i = 1; i < bands.size(); i++)
+	{
+		threads.emplace_back([&, i]()
+			{
+				std::optional<SourceFile> bandFile;
+
+				try
+				{
+					bandFile.emplace(srcPath);
+					bandFile->Stream().seekg(info.srcDataOffsetBytes + info.srcRowStrideBytes * bands[i].firstSrcRow);
+				}
+				catch (...)
+				{
+					errors[i] = std::current_exception();
+					return;
+				}
+
+				filterBand(i, bandFile->Stream());
+			});
+	}
+
+	// Первая полоса начинается с первой строки, её источник уже открыт
+	filterBand(0, src);
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	for (const std::exception_ptr& error : errors)
+	{
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+}
+
+/// <summary>
+/// FilterInBands для фильтра filter(src, dest, info) с одним выходным изображением.
+/// </summary>
+template<class Filter>
+void FilterInBands(
+	const SourceImage& srcPath,
+	std::istream& src,
+	BmpOutputFile& destFile,
+	const BmpImageInfo& info,
+	const BandHalo& halo,
+	int threadsCount,
+	Filter filter)
+{
+	FilterInBands(srcPath, src, vector<BmpOutputFile*>{ &destFile }, info, halo, threadsCount,
+		[&](std::istream& bandSrc, const vector<BmpRowWriter*>& bandDests, const BmpImageInfo& bandInfo)
+		{
+			filter(bandSrc, *bandDests[0], bandInfo);
+		});
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <istream>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "BmpHeader.h"
+#include "PixelFormats.h"
+#include "LumaConversion.h"
+
+const uint16_t BmpSignature = 0x4d42;
+const uint32_t BmpWithoutCompression = 0;
+const uint32_t BmpBitFields = 3;
+
+struct BmpImageInfo
+{
+	BmpHeader header;
+
+	// Расширенная часть DIB заголовка, маски каналов и палитра,
+	// лежащие между стандартным заголовком и данными изображения
+	std::vector<uint8_t> extraHeaderBytes;
+
+	int imageWidthPx;
+
+	// Высота всегда положительна, порядок строк хранится в isTopDown
+	int imageHeightPx;
+	bool isTopDown;
+
+	int bytePerPx;
+	int imageWidthBytes;
+
+	// Шаг строк выходного bmp
+	int rowStrideBytes;
+
+	// Начало данных и шаг строк во входном файле, paddingBytesCount - байты после строки в нём.
+	// У bmp совпадают с заголовком и rowStrideBytes, у сырого изображения задаются RawImageFormat
+	int64_t srcDataOffsetBytes;
+	int64_t srcRowStrideBytes;
+	int paddingBytesCount;
+};
+
+/// <summary>
+/// Сырое изображение без заголовка: heightPx строк пикселей формата bitPerPixel.
+/// </summary>
+struct RawImageFormat
+{
+	int widthPx;
+	int heightPx;
+	int bitPerPixel;
+
+	// Сырые строки обычно идут сверху вниз, выходной bmp сохраняет их порядок
+	bool isTopDown = true;
+
+	// 0 - строки без выравнивания
+	int64_t rowStrideBytes = 0;
+
+	// Пропускаемый заголовок чужого формата перед данными
+	int64_t dataOffsetBytes = 0;
+};
+
+/// <summary>
+/// Входное изображение фильтра: bmp или сырые строки в формате rawFormat.
+/// Неявно создаётся из пути и приводится к нему, поэтому передаётся везде, где ожидается путь bmp.
+/// luma - перевод цветного изображения в яркость при чтении (см. SourceFile).
+/// </summary>
+struct SourceImage
+{
+	std::filesystem::path path;
+	std::optional<RawImageFormat> rawFormat;
+	LumaStandard luma = LumaStandard::None;
+
+	SourceImage(std::filesystem::path path)
+		: path(std::move(path))
+	{
+	}
+
+	SourceImage(const char* path)
+		: path(path)
+	{
+	}
+
+	SourceImage(const std::string& path)
+		: path(path)
+	{
+	}
+
+	SourceImage(std::filesystem::path path, const RawImageFormat& rawFormat)
+		: path(std::move(path)),
+		rawFormat(rawFormat)
+	{
+	}
+
+	operator const std::filesystem::path& () const noexcept
+	{
+		return path;
+	}
+};
+
+inline bool IsGrayscalePalette(const BmpImageInfo& info)
+{
+	const size_t paletteEntryBytes = 4;
+
+	size_t paletteOffset = info.header.dibHeaderSizeBytes - 40;
+	size_t colorsCount = info.header.paletteColorsCount == 0 ? 256 : info.header.paletteColorsCount;
+
+	if (paletteOffset + colorsCount * paletteEntryBytes > info.extraHeaderBytes.size())
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < colorsCount; i++)
+	{
+		const uint8_t* entry = &info.extraHeaderBytes[paletteOffset + i * paletteEntryBytes];
+
+		if (entry[0] != i || entry[1] != i || entry[2] != i)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/// <summary>
+/// Размеры строк по ширине и формату пикселя. srcRowStrideBytes = 0 - строки источника
+/// выровнены как в bmp. Строки длиннее int не поддерживаются, смещения строк в файле 64-битные.
+/// </summary>
+inline void SetRowLayout(BmpImageInfo& info, int64_t srcRowStrideBytes)
+{
+	info.bytePerPx = info.header.bitPerPixel / 8;
+
+	int64_t imageWidthBytes = (int64_t)info.imageWidthPx * info.bytePerPx;
+
+	if (imageWidthBytes > INT32_MAX - 3)
+	{
+		throw std::invalid_argument("Строка изображения слишком длинная");
+	}
+
+	info.imageWidthBytes = (int)imageWidthBytes;
+	info.rowStrideBytes = (info.imageWidthBytes + 3) & ~3;
+	info.srcRowStrideBytes = srcRowStrideBytes == 0 ? info.rowStrideBytes : srcRowStrideBytes;
+
+	if (info.srcRowStrideBytes < info.imageWidthBytes ||
+		info.srcRowStrideBytes - info.imageWidthBytes > INT32_MAX)
+	{
+		throw std::invalid_argument("Неверный шаг строк изображения");
+	}
+
+	info.paddingBytesCount = (int)(info.srcRowStrideBytes - info.imageWidthBytes);
+}
+
+/// <summary>
+/// Читает заголовки, маски и палитру. После вызова поток стоит на начале данных изображения.
+/// </summary>
+inline BmpImageInfo ReadBmpImageInfo(std::istream& src)
+{
+	BmpImageInfo info{};
+	src.read((char*)&info.header, sizeof(info.header));
+
+	if (!src || info.header.bm != BmpSignature)
+	{
+		throw std::invalid_argument("Входной файл не является bmp изображением");
+	}
+	if (info.header.dibHeaderSizeBytes < 40)
+	{
+		throw std::invalid_argument("Заголовки OS/2 bmp не поддерживаются");
+	}
+	if (info.header.compressionMethod != BmpWithoutCompression &&
+		!(info.header.compressionMethod == BmpBitFields && info.header.bitPerPixel == 32))
+	{
+		throw std::invalid_argument("Сжатые bmp изображения не поддерживаются");
+	}
+	if (info.header.imageOffsetBytes < sizeof(BmpHeader))
+	{
+		throw std::invalid_argument("Неверное смещение данных изображения");
+	}
+
+	info.extraHeaderBytes.resize(info.header.imageOffsetBytes - sizeof(BmpHeader));
+	src.read((char*)info.extraHeaderBytes.data(), info.extraHeaderBytes.size());
+
+	// Проверка формата пикселя
+	DispatchPixelFormat(info.header.bitPerPixel, [](auto) {});
+
+	// Фильтры работают со значениями, а не с индексами палитры
+	if (info.header.bitPerPixel == Gray8::BitPerPixel && !IsGrayscalePalette(info))
+	{
+		throw std::invalid_argument("Палитра 8-битного изображения не является оттенками серого");
+	}
+
+	if (info.header.imageWidthPx <= 0 || info.header.imageHeightPx == 0)
+	{
+		throw std::invalid_argument("Неверные размеры изображения");
+	}
+
+	info.isTopDown = info.header.imageHeightPx < 0;
+	info.imageWidthPx = info.header.imageWidthPx;
+	info.imageHeightPx = info.isTopDown ? -info.header.imageHeightPx : info.header.imageHeightPx;
+
+	SetRowLayout(info, 0);
+	info.srcDataOffsetBytes = info.header.imageOffsetBytes;
+
+	return info;
+}
+
+/// <summary>
+/// Заголовки выходного изображения того же размера и формата, что и входное.
+/// Размеры файла и данных больше 4 ГБ не помещаются в 32-битные поля и записываются нулями.
+/// </summary>
+inline std::vector<uint8_t> BmpImageInfoBytes(const BmpImageInfo& info)
+{
+	std::vector<uint8_t> headerBytes(sizeof(info.header) + info.extraHeaderBytes.size());
+
+	BmpHeader header = info.header;
+	int64_t imageSizeBytes = (int64_t)info.rowStrideBytes * info.imageHeightPx;
+
+	if ((int64_t)headerBytes.size() + imageSizeBytes > UINT32_MAX)
+	{
+		header.fileSizeBytes = 0;
+		header.imageSizeBytes = 0;
+	}
+
+	std::memcpy(headerBytes.data(), &header, sizeof(header));
+	std::copy(
+		info.extraHeaderBytes.begin(),
+		info.extraHeaderBytes.end(),
+		headerBytes.begin() + sizeof(info.header));
+
+	return headerBytes;
+}
+
+/// <summary>
+/// Описание сырого изображения в виде bmp тех же размеров и формата:
+/// заголовки для выходного файла (у 8-битного - палитра оттенков серого) и строки источника.
+/// </summary>
+inline BmpImageInfo RawImageInfo(const RawImageFormat& format)
+{
+	const uint32_t paletteEntryBytes = 4;
+
+	BmpImageInfo info{};
+
+	if (format.widthPx <= 0 || format.heightPx <= 0 || format.dataOffsetBytes < 0 || format.rowStrideBytes < 0)
+	{
+		throw std::invalid_argument("Неверные размеры изображения");
+	}
+
+	// Проверка формата пикселя
+	DispatchPixelFormat(format.bitPerPixel, [](auto) {});
+
+	if (format.bitPerPixel == Gray8::BitPerPixel)
+	{
+		info.extraHeaderBytes.resize(256 * paletteEntryBytes);
+
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			std::memset(&info.extraHeaderBytes[i * paletteEntryBytes], (int)i, 3);
+		}
+
+		info.header.paletteColorsCount = 256;
+	}
+
+	info.header.bm = BmpSignature;
+	info.header.imageOffsetBytes = (uint32_t)(sizeof(BmpHeader) + info.extraHeaderBytes.size());
+	info.header.dibHeaderSizeBytes = 40;
+	info.header.imageWidthPx = format.widthPx;
+	info.header.imageHeightPx = format.isTopDown ? -format.heightPx : format.heightPx;
+	info.header.colorPlanesCount = 1;
+	info.header.bitPerPixel = (uint16_t)format.bitPerPixel;
+	info.header.compressionMethod = BmpWithoutCompression;
+
+	info.imageWidthPx = format.widthPx;
+	info.imageHeightPx = format.heightPx;
+	info.isTopDown = format.isTopDown;
+
+	SetRowLayout(info, format.rowStrideBytes != 0
+		? format.rowStrideBytes
+		: (int64_t)format.widthPx * (format.bitPerPixel / 8));
+	info.srcDataOffsetBytes = format.dataOffsetBytes;
+
+	int64_t imageSizeBytes = (int64_t)info.rowStrideBytes * info.imageHeightPx;
+
+	if (info.header.imageOffsetBytes + imageSizeBytes <= UINT32_MAX)
+	{
+		info.header.fileSizeBytes = (uint32_t)(info.header.imageOffsetBytes + imageSizeBytes);
+		info.header.imageSizeBytes = (uint32_t)imageSizeBytes;
+	}
+
+	return info;
+}
+
+/// <summary>
+/// Описание входного изображения. После вызова поток стоит на начале данных:
+/// у bmp читаются заголовки, у сырого изображения пропускается dataOffsetBytes.
+/// </summary>
+inline BmpImageInfo ReadImageInfo(std::istream& src, const SourceImage& source)
+{
+	if (!source.rawFormat)
+	{
+		return ReadBmpImageInfo(src);
+	}
+
+	BmpImageInfo info = RawImageInfo(*source.rawFormat);
+	src.ignore(info.srcDataOffsetBytes);
+
+	return info;
+}
@@ -5,67 +5,46 @@
 #include <vector>
 #include <numeric>
 #include <numbers>
+#include <algorithm>
+#include <cmath>
 
 #include "Kernel.h"
 #include "BmpHeader.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "RowRing.h"
+#include "SlidingMoments.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "BandFiltering.h"
 
 using std::vector;
 
-const int ChannelCount = 3;
-//const int BytePerPx = 3;
-const int BytePerFloatPx = 12;
-
-void MirrorEdgePixelsInRow(
-	vector<uint8_t>& expandedRow,
-	int imageWidthPx,
-	const Kernel& kernelX)
-{
-	// Левый край
-	for (int x = 0; x < kernelX.HorizontalRadius(); x++)
-	{
-		int mirrorX = kernelX.HorizontalRadius() * 2 - 1 - x;
-
-		expandedRow[x * BytePerPx] = expandedRow[mirrorX * BytePerPx];
-		expandedRow[x * BytePerPx + 1] = expandedRow[mirrorX * BytePerPx + 1];
-		expandedRow[x * BytePerPx + 2] = expandedRow[mirrorX * BytePerPx + 2];
-	}
-
-	// Правый край
-	for (int x = imageWidthPx + kernelX.HorizontalRadius();
-		x < imageWidthPx + kernelX.HorizontalRadius() * 2;
-		x++)
-	{
-		int mirrorX = 2 * (imageWidthPx + kernelX.HorizontalRadius()) - x - 1;
-
-		expandedRow[x * BytePerPx] = expandedRow[mirrorX * BytePerPx];
-		expandedRow[x * BytePerPx + 1] = expandedRow[mirrorX * BytePerPx + 1];
-		expandedRow[x * BytePerPx + 2] = expandedRow[mirrorX * BytePerPx + 2];
-	}
-}
-
+template<class Px>
 void ConvolutionX(
 	const vector<uint8_t>& expandedRow,
-	vector<uint32_t>& outputRowsBuffer,
-	int currentRowOffset,
+	uint32_t* outputRow,
 	const Kernel& kernelX,
 	int imageWidthPx)
 {
-	uint32_t sumB = 0;
-	uint32_t sumG = 0;
-	uint32_t sumR = 0;
+	uint32_t sums[Px::ChannelCount]{};
 
 	// Проход для накопления первоначальной суммы
 	// здесь будто бы x = kernelX.HorizontalRadius() 
 	for (int j = 0; j < kernelX.Width(); j++)
 	{
-		sumB += expandedRow[j * BytePerPx];
-		sumG += expandedRow[j * BytePerPx + 1];
-		sumR += expandedRow[j * BytePerPx + 2];
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			sums[c] += expandedRow[j * Px::BytePerPx + c];
+		}
 	}
 
-	outputRowsBuffer[currentRowOffset] = sumB;
-	outputRowsBuffer[currentRowOffset + 1] = sumG;
-	outputRowsBuffer[currentRowOffset + 2] = sumR;
+	for (int c = 0; c < Px::ChannelCount; c++)
+	{
+		outputRow[c] = sums[c];
+	}
 
 	// Текущее смещение скользящего окна
 	int xOffsetPx = 1;
@@ -75,466 +54,501 @@ void ConvolutionX(
 		x < imageWidthPx + kernelX.HorizontalRadius();
 		x++)
 	{
-		sumB -= expandedRow[(xOffsetPx - 1) * BytePerPx];
-		sumB += expandedRow[(xOffsetPx + kernelX.Width() - 1) * BytePerPx];
-
-		sumG -= expandedRow[(xOffsetPx - 1) * BytePerPx + 1];
-		sumG += expandedRow[(xOffsetPx + kernelX.Width() - 1) * BytePerPx + 1];
-
-		sumR -= expandedRow[(xOffsetPx - 1) * BytePerPx + 2];
-		sumR += expandedRow[(xOffsetPx + kernelX.Width() - 1) * BytePerPx + 2];
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			sums[c] -= expandedRow[(xOffsetPx - 1) * Px::BytePerPx + c];
+			sums[c] += expandedRow[(xOffsetPx + kernelX.Width() - 1) * Px::BytePerPx + c];
 
-		outputRowsBuffer[currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx] = sumB;
-		outputRowsBuffer[currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx + 1] = sumG;
-		outputRowsBuffer[currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx + 2] = sumR;
+			outputRow[(x - kernelX.HorizontalRadius()) * Px::ChannelCount + c] = sums[c];
+		}
 
 		xOffsetPx++;
 	}
 }
 
+/// <summary>
+/// Среднее по окну kernelX.Width() x kernelY.Height(): суммы строк окна по горизонтали
+/// лежат в кольце, сумма окна по вертикали обновляется прибавлением нижней строки
+/// и вычитанием верхней.
+/// </summary>
+template<class Px, class Border>
 void BoxBlur(
-	std::filesystem::path srcPath,
-	std::filesystem::path destPath,
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
 	const Kernel& kernelX,
 	const Kernel& kernelY)
 {
-	std::ifstream src(srcPath, std::ios::binary);
-	if (!src.is_open())
-	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + srcPath.string());
-	}
-	std::ofstream dest(destPath, std::ios::binary);
-	if (!dest.is_open())
-	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + destPath.string());
-	}
-
-	BmpHeader header{};
-	src.read((char*)&header, sizeof(header));
-
-	// Проверка на возможность отражения
-	if (kernelX.HorizontalRadius() > header.imageWidthPx ||
-		kernelY.VerticalRadius() > header.imageHeightPx)
-	{
-		throw std::invalid_argument("Изображение слишком мало");
-	}
-
-	dest.write((char*)&header, sizeof(header));
-
-	int imageWidthBytes = header.imageWidthPx * BytePerPx;
-	int rowWidth = header.imageWidthPx * ChannelCount;
-	int rowStrideBytes = (imageWidthBytes + 3) & ~3;
-	int paddingBytesCount = rowStrideBytes - imageWidthBytes;
-
-	// Длина расширенной отражёнными краевыми пикселями строки
-	int expandedWidthBytes = imageWidthBytes + kernelX.HorizontalRadius() * 2 * BytePerPx;
+	int imageWidthBytes = info.imageWidthBytes;
+	int rowWidth = info.imageWidthPx * Px::ChannelCount;
+	int paddingBytesCount = info.paddingBytesCount;
+	int horizontalRadius = kernelX.HorizontalRadius();
+	int kernelHeight = kernelY.Height();
 
-	// Буфер для загрузки 
-	vector<uint8_t> srcRowBuffer(expandedWidthBytes);
-	vector<uint32_t> convolutedXRows(rowWidth * kernelY.Height());
+	// Буфер для загрузки строки, расширенной краевыми пикселями
+	vector<uint8_t> srcRowBuffer(imageWidthBytes + horizontalRadius * 2 * Px::BytePerPx);
+	RowRing<uint32_t, Border> convolutedXRows(rowWidth, info.imageHeightPx, kernelHeight);
 
-	// Формирование первоначального буфера строк с отражением (1 0 0 1 2)
-	for (int bufferY = kernelY.VerticalRadius(); bufferY < kernelY.Height(); bufferY++)
-	{
-		int imageY = bufferY - kernelY.VerticalRadius();
-
-		src.read((char*)&srcRowBuffer[kernelX.HorizontalRadius() * BytePerPx],
-			imageWidthBytes);
-		src.seekg(paddingBytesCount, std::ios_base::cur);
-
-		MirrorEdgePixelsInRow(srcRowBuffer, header.imageWidthPx, kernelX);
-
-		ConvolutionX(
-			srcRowBuffer,
-			convolutedXRows,
-			bufferY * rowWidth,
-			kernelX,
-			header.imageWidthPx
-		);
-	}
-
-	// Отражение
-	for (int bufferY = 0; bufferY < kernelY.VerticalRadius(); bufferY++)
-	{
-		int y = 2 * kernelY.VerticalRadius() - 1 - bufferY;
-
-		std::copy(convolutedXRows.data() + y * rowWidth,
-			convolutedXRows.data() + (y + 1) * rowWidth,
-			convolutedXRows.data() + bufferY * rowWidth);
-	}
-
-	// Накопление начальной суммы
 	vector<uint32_t> sumBuffer(rowWidth);
-	for (int x = 0; x < header.imageWidthPx; x++)
-	{
-		int nx = x * ChannelCount;
-		for (int y = 0; y < kernelY.Height(); y++)
-		{
-			sumBuffer[nx] += convolutedXRows[y * rowWidth + nx];
-			sumBuffer[nx + 1] += convolutedXRows[y * rowWidth + nx + 1];
-			sumBuffer[nx + 2] += convolutedXRows[y * rowWidth + nx + 2];
-		}
-	}
+	float divCoef = kernelX.Width() * kernelHeight;
 
-	vector<uint8_t> destRowBuffer(rowStrideBytes);
-	float divCoef = kernelX.Width() * kernelY.Height();
-	int firstRowIndex = 0;
-	int oldFirstRowIndex = 0;
-	int bufIndexToCopy = 0;
-
-	for (int y = kernelY.VerticalRadius();
-		y < header.imageHeightPx + kernelY.VerticalRadius();
-		y++)
+	for (int y = 0; y < info.imageHeightPx; y++)
 	{
-		// Запись в выходной буфер и вычитание верхней строки
-		int offsetToTopRow = firstRowIndex * rowWidth;
-		for (int x = 0; x < header.imageWidthPx; x++)
+		int firstWindowRow = y - kernelY.VerticalRadius();
+
+		while (!convolutedXRows.HasWindow(firstWindowRow, kernelHeight))
 		{
-			int nx = x * ChannelCount;
+			src.read((char*)&srcRowBuffer[horizontalRadius * Px::BytePerPx], imageWidthBytes);
+			src.ignore(paddingBytesCount);
 
-			destRowBuffer[x * BytePerPx] = (uint8_t)(sumBuffer[nx] / divCoef + 0.5f);
-			destRowBuffer[x * BytePerPx + 1] = (uint8_t)(sumBuffer[nx + 1] / divCoef + 0.5f);
-			destRowBuffer[x * BytePerPx + 2] = (uint8_t)(sumBuffer[nx + 2] / divCoef + 0.5f);
+			ExpandRowEdges<Px, Border>(srcRowBuffer.data(), info.imageWidthPx, horizontalRadius);
 
-			sumBuffer[nx] -= convolutedXRows[offsetToTopRow + nx];
-			sumBuffer[nx + 1] -= convolutedXRows[offsetToTopRow + nx + 1];
-			sumBuffer[nx + 2] -= convolutedXRows[offsetToTopRow + nx + 2];
+			ConvolutionX<Px>(srcRowBuffer, convolutedXRows.AppendRow(), kernelX, info.imageWidthPx);
 		}
-		dest.write((char*)destRowBuffer.data(), rowStrideBytes);
-
-		// Чтобы при чётных размерах условие отражение не срабатывало 
-		// на 1 строку раньше и последняя строка тоже обрабатывалась 
-		int imageY = kernelY.Height() % 2 == 0 ? y - 1 : y;
 
-		// Отражение 
-		if (imageY >= header.imageHeightPx - 1)
+		// Накопление начальной суммы, затем прибавление нижней строки
+		if (y == 0)
 		{
-			if (imageY == header.imageHeightPx - 1)
+			for (int i = 0; i < kernelHeight; i++)
 			{
-				oldFirstRowIndex = firstRowIndex;
-				bufIndexToCopy = (firstRowIndex + kernelY.Height() - 1) % kernelY.Height();
-			}
-			if (bufIndexToCopy != firstRowIndex)
-			{
-				std::copy(convolutedXRows.data() + bufIndexToCopy * rowWidth,
-					convolutedXRows.data() + (bufIndexToCopy + 1) * rowWidth,
-					convolutedXRows.data() + firstRowIndex * rowWidth);
-			}
+				const uint32_t* row = convolutedXRows.Row(firstWindowRow + i);
 
-			bufIndexToCopy--;
-			if (bufIndexToCopy < 0)
-			{
-				bufIndexToCopy = kernelY.Height() - 1;
+				for (int nx = 0; nx < rowWidth; nx++)
+				{
+					sumBuffer[nx] += row[nx];
+				}
 			}
 		}
-		// Запись новой строки
 		else
 		{
-			src.read(
-				(char*)&srcRowBuffer[kernelX.HorizontalRadius() * BytePerPx],
-				imageWidthBytes);
-			src.seekg(paddingBytesCount, std::ios_base::cur);
-
-			MirrorEdgePixelsInRow(srcRowBuffer, header.imageWidthPx, kernelX);
+			const uint32_t* bottomRow = convolutedXRows.Row(firstWindowRow + kernelHeight - 1);
 
-			ConvolutionX(srcRowBuffer, convolutedXRows,
-				firstRowIndex * rowWidth,
-				kernelX,
-				header.imageWidthPx);
+			for (int nx = 0; nx < rowWidth; nx++)
+			{
+				sumBuffer[nx] += bottomRow[nx];
+			}
 		}
 
-		// тут
-		firstRowIndex = (firstRowIndex + 1) % kernelY.Height();
+		uint8_t* destRow = dest.Rows(y, 1);
+
+		// Запись в выходной буфер и вычитание верхней строки до того,
+		// как её место в кольце займёт следующая
+		const uint32_t* topRow = convolutedXRows.Row(firstWindowRow);
 
-		// Прибавление нижней строки
-		int offsetToBottomRow = ((firstRowIndex + kernelY.Height() - 1) % kernelY.Height()) * rowWidth;
-		for (int x = 0; x < header.imageWidthPx; x++)
+		for (int x = 0; x < info.imageWidthPx; x++)
 		{
-			int nx = x * ChannelCount;
-			sumBuffer[nx] += convolutedXRows[offsetToBottomRow + nx];
-			sumBuffer[nx + 1] += convolutedXRows[offsetToBottomRow + nx + 1];
-			sumBuffer[nx + 2] += convolutedXRows[offsetToBottomRow + nx + 2];
+			int nx = x * Px::ChannelCount;
+
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				destRow[x * Px::BytePerPx + c] = (uint8_t)(sumBuffer[nx + c] / divCoef + 0.5f);
+
+				sumBuffer[nx + c] -= topRow[nx + c];
+			}
 		}
+
+		dest.CommitRows();
 	}
 }
 
-void SumColsInRow(
-	const vector<uint8_t>& mirroredRow,
-	vector<uint32_t>& rowsOfSummedCols,
-	vector<uint32_t>& rowsOfSummedSquaredCols,
-	int currentRowOffset,
+void BoxBlur(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
 	const Kernel& kernelX,
-	int imageWidthPx)
+	const Kernel& kernelY,
+	BorderMode border = BorderMode::Mirror,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
 {
-	uint32_t sumB = 0;
-	uint32_t sumG = 0;
-	uint32_t sumR = 0;
-	
-	uint32_t sumOfSquaredB = 0;
-	uint32_t sumOfSquaredG = 0;
-	uint32_t sumOfSquaredR = 0;
-
-	// Проход для накопления первоначальной суммы
-	for (int j = 0; j < kernelX.Width(); j++)
+	// Суммы окна 32-битные
+	if ((int64_t)kernelX.Width() * kernelY.Height() * UINT8_MAX > UINT32_MAX)
 	{
-		sumB += mirroredRow[j * BytePerPx];
-		sumG += mirroredRow[j * BytePerPx + 1];
-		sumR += mirroredRow[j * BytePerPx + 2];
-
-		sumOfSquaredB += mirroredRow[j * BytePerPx] * mirroredRow[j * BytePerPx];
-		sumOfSquaredG += mirroredRow[j * BytePerPx + 1] * mirroredRow[j * BytePerPx + 1];
-		sumOfSquaredR += mirroredRow[j * BytePerPx + 2] * mirroredRow[j * BytePerPx + 2];
+		throw std::invalid_argument("Окно слишком велико");
 	}
 
-	rowsOfSummedCols[currentRowOffset] = sumB;
-	rowsOfSummedCols[currentRowOffset + 1] = sumG;
-	rowsOfSummedCols[currentRowOffset + 2] = sumR;
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
 
-	rowsOfSummedSquaredCols[currentRowOffset] = sumOfSquaredB;
-	rowsOfSummedSquaredCols[currentRowOffset + 1] = sumOfSquaredG;
-	rowsOfSummedSquaredCols[currentRowOffset + 2] = sumOfSquaredR;
+	BmpImageInfo info = srcFile.Info();
 
-	// Текущее смещение скользящего окна
-	int xOffsetPx = 1;
+	// Проверка на возможность отражения
+	if (kernelX.HorizontalRadius() > info.imageWidthPx ||
+		kernelY.VerticalRadius() > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
 
-	// Основная свёртка скользящим окном
-	for (int x = kernelX.HorizontalRadius() + 1;
-		x < imageWidthPx + kernelX.HorizontalRadius();
-		x++)
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	// Периодической границе нужен противоположный край изображения, полосы его не видят
+	if (border == BorderMode::Wrap)
 	{
-		int subtrahendBlueOffset = (xOffsetPx - 1) * BytePerPx;
-		int addendBlueOffset = (xOffsetPx + kernelX.Width() - 1) * BytePerPx;
+		threadsCount = 1;
+	}
 
-		sumB -= mirroredRow[subtrahendBlueOffset];
-		sumB += mirroredRow[addendBlueOffset];
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			DispatchBorderMode(border, [&](auto borderPolicy)
+				{
+					FilterInBands(srcPath, src, destFile, info, KernelBandHalo(kernelY.Height(), kernelY.VerticalRadius()), threadsCount,
+						[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+						{
+							BoxBlur<decltype(format), decltype(borderPolicy)>(bandSrc, bandDest, bandInfo, kernelX, kernelY);
+						});
+				});
+		});
+}
 
-		sumG -= mirroredRow[subtrahendBlueOffset + 1];
-		sumG += mirroredRow[addendBlueOffset + 1];
+/// <summary>
+/// СКО по окну kernelX.Width() x kernelY.Height() - статистика StdDev движка ComputeLocalMoments.
+/// </summary>
+void MovingRmse(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	const Kernel& kernelX,
+	const Kernel& kernelY,
+	BorderMode border = BorderMode::Mirror,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	ComputeLocalMoments(srcPath, { { LocalMoment::StdDev, destPath } },
+		kernelX.Width(), kernelY.Height(), border, backend, threadsCount);
+}
 
-		sumR -= mirroredRow[subtrahendBlueOffset + 2];
-		sumR += mirroredRow[addendBlueOffset + 2];
+// Дробные биты промежуточных значений каскада боксов
+const int BoxCascadeFractionBits = 8;
+const uint32_t BoxCascadeMaxValue = 255u << BoxCascadeFractionBits;
 
-		sumOfSquaredB -= mirroredRow[subtrahendBlueOffset] * mirroredRow[subtrahendBlueOffset];
-		sumOfSquaredB += mirroredRow[addendBlueOffset] * mirroredRow[addendBlueOffset];
+// Сумма окна не должна переполнить uint32_t
+const int BoxCascadeMaxWidth = (int)(UINT32_MAX / BoxCascadeMaxValue);
 
-		sumOfSquaredG -= mirroredRow[subtrahendBlueOffset + 1] * mirroredRow[subtrahendBlueOffset + 1];
-		sumOfSquaredG += mirroredRow[addendBlueOffset + 1] * mirroredRow[addendBlueOffset + 1];
+/// <summary>
+/// Нечётные ширины boxesCount боксов, последовательное применение которых
+/// приближает гауссиану с заданным sigma (дисперсии боксов складываются).
+/// Ширина 1 означает отсутствие размытия.
+/// </summary>
+inline vector<int> GaussianBoxWidths(double sigma, int boxesCount)
+{
+	double idealWidth = std::sqrt(12 * sigma * sigma / boxesCount + 1);
 
-		sumOfSquaredR -= mirroredRow[subtrahendBlueOffset + 2] * mirroredRow[subtrahendBlueOffset + 2];
-		sumOfSquaredR += mirroredRow[addendBlueOffset + 2] * mirroredRow[addendBlueOffset + 2];
+	int lowerWidth = (int)std::floor(idealWidth);
+	if (lowerWidth % 2 == 0)
+	{
+		lowerWidth--;
+	}
+	lowerWidth = std::max(lowerWidth, 1);
 
-		xOffsetPx++;
+	int upperWidth = lowerWidth + 2;
 
-		int currentOutputBlueOffset = currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx;
+	// Столько первых боксов берут меньшую ширину, чтобы дисперсия была ближе к sigma^2
+	double lowerCount = (12 * sigma * sigma
+		- boxesCount * lowerWidth * lowerWidth
+		- 4.0 * boxesCount * lowerWidth
+		- 3.0 * boxesCount) / (-4.0 * lowerWidth - 4);
 
-		rowsOfSummedCols[currentOutputBlueOffset] = sumB;
-		rowsOfSummedCols[currentOutputBlueOffset + 1] = sumG;
-		rowsOfSummedCols[currentOutputBlueOffset + 2] = sumR;
+	int lowerBoxesCount = std::clamp((int)std::lround(lowerCount), 0, boxesCount);
 
-		rowsOfSummedSquaredCols[currentOutputBlueOffset] = sumOfSquaredB;
-		rowsOfSummedSquaredCols[currentOutputBlueOffset + 1] = sumOfSquaredG;
-		rowsOfSummedSquaredCols[currentOutputBlueOffset + 2] = sumOfSquaredR;
+	vector<int> widths;
+	for (int i = 0; i < boxesCount; i++)
+	{
+		widths.push_back(i < lowerBoxesCount ? lowerWidth : upperWidth);
 	}
-}
 
-uint8_t Rmse(float sumOfSquares, float sum, float divCoef)
-{
-	float meanOfSquares = sumOfSquares / divCoef;
-	float mean = sum / divCoef;
-	float squaredResult = std::max(meanOfSquares - mean * mean, 0.f);
-
-	return (uint8_t)std::clamp(sqrt(squaredResult) + 0.5f, 0.f, 255.f);
+	return widths;
 }
 
-void MovingRmse(
-	std::filesystem::path srcPath,
-	std::filesystem::path destPath,
-	const Kernel& kernelX,
-	const Kernel& kernelY)
+/// <summary>
+/// Горизонтальный бокс радиуса radius по строке с отражёнными краями, с округлением.
+/// </summary>
+template<class Px>
+void BoxCascadeRowPass(const uint32_t* input, uint32_t* output, int widthPx, int radius)
 {
-	std::ifstream src(srcPath, std::ios::binary);
-	if (!src.is_open())
-	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + srcPath.string());
-	}
-	std::ofstream dest(destPath, std::ios::binary);
-	if (!dest.is_open())
+	uint32_t width = 2 * radius + 1;
+
+	for (int c = 0; c < Px::ChannelCount; c++)
 	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + destPath.string());
-	}
+		uint32_t sum = 0;
+		for (int x = -radius; x <= radius; x++)
+		{
+			sum += input[MirrorIndex(x, widthPx) * Px::ChannelCount + c];
+		}
 
-	BmpHeader header{};
-	src.read((char*)&header, sizeof(header));
+		for (int x = 0; x < widthPx; x++)
+		{
+			output[x * Px::ChannelCount + c] = (sum + width / 2) / width;
 
-	// Проверка на возможность отражения
-	if (kernelX.HorizontalRadius() > header.imageWidthPx ||
-		kernelY.VerticalRadius() > header.imageHeightPx)
-	{
-		throw std::invalid_argument("Изображение слишком мало");
+			// Вычитаемое может оказаться больше суммы только временно, в беззнаковой арифметике это безопасно
+			sum += input[MirrorIndex(x + radius + 1, widthPx) * Px::ChannelCount + c];
+			sum -= input[MirrorIndex(x - radius, widthPx) * Px::ChannelCount + c];
+		}
 	}
+}
 
-	dest.write((char*)&header, sizeof(header));
+/// <summary>
+/// Вертикальный бокс каскада. Строки поступают по одной сверху вниз и выходят в том же
+/// порядке с задержкой на радиус. Кольцо на 2 * radius + 2 строки хранит окно и
+/// уходящую из него строку, отражённые строки берутся из кольца.
+/// </summary>
+class BoxCascadeStage
+{
+private:
+	int radius_;
+	int ringRowsCount_;
+	int rowWidth_;
+	int imageHeightPx_;
 
-	int imageWidthBytes = header.imageWidthPx * BytePerPx;
-	int rowWidth = header.imageWidthPx * ChannelCount;
-	int rowStrideBytes = (imageWidthBytes + 3) & ~3;
-	int paddingBytesCount = rowStrideBytes - imageWidthBytes;
+	vector<uint32_t> ring_;
+	vector<uint32_t> columnSums_;
+	vector<uint32_t> outputRow_;
 
-	// Буфер длиной расширенной отражёнными краевыми пикселями строки
-	vector<uint8_t> srcRowBuffer(imageWidthBytes + kernelX.HorizontalRadius() * 2 * BytePerPx);
-	vector<uint32_t> rowsOfSummedCols(rowWidth * kernelY.Height());
-	vector<uint32_t> rowsOfSummedSquaredCols(rowWidth * kernelY.Height());
+	int pushedRowsCount_ = 0;
+	int emittedRowsCount_ = 0;
 
-	// Формирование первоначального буфера (- - 0 1 2)
-	for (int bufferY = kernelY.VerticalRadius(); bufferY < kernelY.Height(); bufferY++)
+	const uint32_t* RingRow(int y) const
 	{
-		int imageY = bufferY - kernelY.VerticalRadius();
-
-		src.read((char*)&srcRowBuffer[kernelX.HorizontalRadius() * BytePerPx],
-			imageWidthBytes);
-		src.seekg(paddingBytesCount, std::ios_base::cur);
-
-		MirrorEdgePixelsInRow(srcRowBuffer, header.imageWidthPx, kernelX);
-
-		SumColsInRow(
-			srcRowBuffer,
-			rowsOfSummedCols,
-			rowsOfSummedSquaredCols,
-			bufferY * rowWidth,
-			kernelX,
-			header.imageWidthPx
-		);
+		return &ring_[(size_t)(MirrorIndex(y, imageHeightPx_) % ringRowsCount_) * rowWidth_];
 	}
 
-	// Отражение (1 0 0 1 2)
-	for (int bufferY = 0; bufferY < kernelY.VerticalRadius(); bufferY++)
+public:
+	BoxCascadeStage(int radius, int rowWidth, int imageHeightPx)
+		: radius_(radius),
+		ringRowsCount_(2 * radius + 2),
+		rowWidth_(rowWidth),
+		imageHeightPx_(imageHeightPx),
+		ring_((size_t)(2 * radius + 2) * rowWidth),
+		columnSums_(rowWidth),
+		outputRow_(rowWidth)
 	{
-		int y = 2 * kernelY.VerticalRadius() - 1 - bufferY;
-
-		std::copy(rowsOfSummedCols.data() + y * rowWidth,
-			rowsOfSummedCols.data() + (y + 1) * rowWidth,
-			rowsOfSummedCols.data() + bufferY * rowWidth);
+	}
 
-		std::copy(rowsOfSummedSquaredCols.data() + y * rowWidth,
-			rowsOfSummedSquaredCols.data() + (y + 1) * rowWidth,
-			rowsOfSummedSquaredCols.data() + bufferY * rowWidth);
+	void Push(const uint32_t* row)
+	{
+		std::copy(row, row + rowWidth_,
+			ring_.begin() + (size_t)(pushedRowsCount_ % ringRowsCount_) * rowWidth_);
+		pushedRowsCount_++;
 	}
 
-	// Накопление начальной суммы
-	vector<uint32_t> sumBuffer(rowWidth);
-	vector<uint32_t> sumOfSquaresBuffer(rowWidth);
-	for (int x = 0; x < header.imageWidthPx; x++)
+	/// <summary>
+	/// Следующая выходная строка, если для неё уже хватает входных, иначе nullptr.
+	/// </summary>
+	const uint32_t* TryEmit()
 	{
-		int nx = x * ChannelCount;
-		for (int y = 0; y < kernelY.Height(); y++)
+		int y = emittedRowsCount_;
+
+		if (y >= imageHeightPx_ ||
+			(pushedRowsCount_ < imageHeightPx_ && pushedRowsCount_ <= y + radius_))
 		{
-			sumBuffer[nx] += rowsOfSummedCols[y * rowWidth + nx];
-			sumBuffer[nx + 1] += rowsOfSummedCols[y * rowWidth + nx + 1];
-			sumBuffer[nx + 2] += rowsOfSummedCols[y * rowWidth + nx + 2];
+			return nullptr;
+		}
+
+		if (y == 0)
+		{
+			std::fill(columnSums_.begin(), columnSums_.end(), 0);
+
+			for (int i = -radius_; i <= radius_; i++)
+			{
+				const uint32_t* row = RingRow(i);
 
-			sumOfSquaresBuffer[nx] += rowsOfSummedSquaredCols[y * rowWidth + nx];
-			sumOfSquaresBuffer[nx + 1] += rowsOfSummedSquaredCols[y * rowWidth + nx + 1];
-			sumOfSquaresBuffer[nx + 2] += rowsOfSummedSquaredCols[y * rowWidth + nx + 2];
+				for (int nx = 0; nx < rowWidth_; nx++)
+				{
+					columnSums_[nx] += row[nx];
+				}
+			}
 		}
-	}
+		else
+		{
+			const uint32_t* addedRow = RingRow(y + radius_);
+			const uint32_t* removedRow = RingRow(y - 1 - radius_);
 
-	vector<uint8_t> destRowBuffer(rowStrideBytes);
-	float divCoef = kernelX.Width() * kernelY.Height();
-	int firstRowIndex = 0;
-	int oldFirstRowIndex = 0;
-	int bufIndexToCopy = 0;
+			for (int nx = 0; nx < rowWidth_; nx++)
+			{
+				columnSums_[nx] += addedRow[nx];
+				columnSums_[nx] -= removedRow[nx];
+			}
+		}
 
-	for (int y = kernelY.VerticalRadius();
-		y < header.imageHeightPx + kernelY.VerticalRadius();
-		y++)
-	{
-		// Запись в выходной буфер и вычитание верхней строки
-		int offsetToTopRow = firstRowIndex * rowWidth;
-		for (int x = 0; x < header.imageWidthPx; x++)
+		uint32_t width = 2 * radius_ + 1;
+		for (int nx = 0; nx < rowWidth_; nx++)
 		{
-			int nx = x * ChannelCount;
+			outputRow_[nx] = (columnSums_[nx] + width / 2) / width;
+		}
 
-			destRowBuffer[x * BytePerPx] = Rmse(sumOfSquaresBuffer[nx], sumBuffer[nx], divCoef);
-			destRowBuffer[x * BytePerPx + 1] = Rmse(sumOfSquaresBuffer[nx + 1], sumBuffer[nx + 1], divCoef);
-			destRowBuffer[x * BytePerPx + 2] = Rmse(sumOfSquaresBuffer[nx + 2], sumBuffer[nx + 2], divCoef);
+		emittedRowsCount_++;
+		return outputRow_.data();
+	}
+};
+
+/// <summary>
+/// Приближение гауссова размытия каскадом боксов за один потоковый проход.
+/// Горизонтальные боксы применяются к каждой прочитанной строке, вертикальные
+/// образуют конвейер из BoxCascadeStage: строка, вышедшая из одного, сразу подаётся
+/// в следующий. Промежуточные значения - целые с BoxCascadeFractionBits дробными битами.
+/// </summary>
+template<class Px>
+void FastGaussianBlur(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const vector<int>& radiusesX,
+	const vector<int>& radiusesY)
+{
+	int rowWidth = info.imageWidthPx * Px::ChannelCount;
 
-			sumBuffer[nx] -= rowsOfSummedCols[offsetToTopRow + nx];
-			sumBuffer[nx + 1] -= rowsOfSummedCols[offsetToTopRow + nx + 1];
-			sumBuffer[nx + 2] -= rowsOfSummedCols[offsetToTopRow + nx + 2];
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+	vector<uint32_t> rowValues(rowWidth);
+	vector<uint32_t> passBuffer(rowWidth);
 
-			sumOfSquaresBuffer[nx] -= rowsOfSummedSquaredCols[offsetToTopRow + nx];// *squaredConvolutedXRows[offsetToTopRow + nx];
-			sumOfSquaresBuffer[nx + 1] -= rowsOfSummedSquaredCols[offsetToTopRow + nx + 1];// *squaredConvolutedXRows[offsetToTopRow + nx + 1];
-			sumOfSquaresBuffer[nx + 2] -= rowsOfSummedSquaredCols[offsetToTopRow + nx + 2];// *squaredConvolutedXRows[offsetToTopRow + nx + 2];
-		}
-		dest.write((char*)destRowBuffer.data(), rowStrideBytes);
+	vector<BoxCascadeStage> stages;
+	for (int radius : radiusesY)
+	{
+		stages.emplace_back(radius, rowWidth, info.imageHeightPx);
+	}
 
-		// Чтобы при чётных размерах условие отражение не срабатывало 
-		// на 1 строку раньше и последняя строка тоже обрабатывалась 
-		int imageY = kernelY.Height() % 2 == 0 ? y - 1 : y;
+	int writtenRowsCount = 0;
 
-		// Отражение 
-		if (imageY >= header.imageHeightPx - 1)
+	// Проталкивает строку через вертикальные боксы начиная с stageIndex,
+	// вышедшие из последнего строки записываются
+	auto pushRow = [&](auto& self, size_t stageIndex, const uint32_t* row) -> void
 		{
-			if (imageY == header.imageHeightPx - 1)
+			if (stageIndex == stages.size())
 			{
-				oldFirstRowIndex = firstRowIndex;
-				bufIndexToCopy = (firstRowIndex + kernelY.Height() - 1) % kernelY.Height();
+				uint8_t* destRow = dest.Rows(writtenRowsCount++, 1);
+
+				for (int x = 0; x < info.imageWidthPx; x++)
+				{
+					for (int c = 0; c < Px::ChannelCount; c++)
+					{
+						uint32_t value = row[x * Px::ChannelCount + c];
+
+						destRow[x * Px::BytePerPx + c] = (uint8_t)std::min<uint32_t>(
+							(value + (1u << (BoxCascadeFractionBits - 1))) >> BoxCascadeFractionBits, 255);
+					}
+				}
+
+				dest.CommitRows();
+				return;
 			}
-			if (bufIndexToCopy != firstRowIndex)
+
+			BoxCascadeStage& stage = stages[stageIndex];
+
+			if (row != nullptr)
 			{
-				std::copy(rowsOfSummedCols.data() + bufIndexToCopy * rowWidth,
-					rowsOfSummedCols.data() + (bufIndexToCopy + 1) * rowWidth,
-					rowsOfSummedCols.data() + firstRowIndex * rowWidth);
+				stage.Push(row);
+			}
 
-				std::copy(rowsOfSummedSquaredCols.data() + bufIndexToCopy * rowWidth,
-					rowsOfSummedSquaredCols.data() + (bufIndexToCopy + 1) * rowWidth,
-					rowsOfSummedSquaredCols.data() + firstRowIndex * rowWidth);
+			while (const uint32_t* outputRow = stage.TryEmit())
+			{
+				self(self, stageIndex + 1, outputRow);
 			}
+		};
 
-			bufIndexToCopy--;
-			if (bufIndexToCopy < 0)
+	for (int y = 0; y < info.imageHeightPx; y++)
+	{
+		src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+		src.ignore(info.paddingBytesCount);
+
+		for (int x = 0; x < info.imageWidthPx; x++)
+		{
+			for (int c = 0; c < Px::ChannelCount; c++)
 			{
-				bufIndexToCopy = kernelY.Height() - 1;
+				rowValues[x * Px::ChannelCount + c] =
+					(uint32_t)srcRowBuffer[x * Px::BytePerPx + c] << BoxCascadeFractionBits;
 			}
 		}
-		// Запись новой строки
-		else
+
+		for (int radius : radiusesX)
 		{
-			src.read(
-				(char*)&srcRowBuffer[kernelX.HorizontalRadius() * BytePerPx],
-				imageWidthBytes);
-			src.seekg(paddingBytesCount, std::ios_base::cur);
-
-			MirrorEdgePixelsInRow(srcRowBuffer, header.imageWidthPx, kernelX);
-
-			SumColsInRow(
-				srcRowBuffer, 
-				rowsOfSummedCols, 
-				rowsOfSummedSquaredCols,
-				firstRowIndex * rowWidth,
-				kernelX,
-				header.imageWidthPx);
+			BoxCascadeRowPass<Px>(rowValues.data(), passBuffer.data(), info.imageWidthPx, radius);
+			rowValues.swap(passBuffer);
 		}
 
-		firstRowIndex = (firstRowIndex + 1) % kernelY.Height();
+		pushRow(pushRow, 0, rowValues.data());
+	}
+}
+
+/// <summary>
+/// Быстрое гауссово размытие boxesCount (3 - 5) последовательными боксами,
+/// время на пиксель не зависит от sigma. Нулевое sigma отключает размытие по своей оси.
+/// </summary>
+void FastGaussianBlur(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	double sigmaX,
+	double sigmaY,
+	int boxesCount = 3,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	if (boxesCount < 3 || boxesCount > 5)
+	{
+		throw std::invalid_argument("Число боксов должно быть от 3 до 5");
+	}
+	if (sigmaX < 0 || sigmaY < 0)
+	{
+		throw std::invalid_argument("Sigma не может быть отрицательным");
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
 
+	// Боксы ширины 1 ничего не меняют и пропускаются
+	vector<int> radiusesX;
+	vector<int> radiusesY;
 
-		// Прибавление нижней строки
-		int offsetToBottomRow = ((firstRowIndex + kernelY.Height() - 1) % kernelY.Height()) * rowWidth;
-		for (int x = 0; x < header.imageWidthPx; x++)
+	for (int width : GaussianBoxWidths(sigmaX, boxesCount))
+	{
+		if (width > 1)
 		{
-			int nx = x * ChannelCount;
-			sumBuffer[nx] += rowsOfSummedCols[offsetToBottomRow + nx];
-			sumBuffer[nx + 1] += rowsOfSummedCols[offsetToBottomRow + nx + 1];
-			sumBuffer[nx + 2] += rowsOfSummedCols[offsetToBottomRow + nx + 2];
-
-			sumOfSquaresBuffer[nx] += rowsOfSummedSquaredCols[offsetToBottomRow + nx];
-			sumOfSquaresBuffer[nx + 1] += rowsOfSummedSquaredCols[offsetToBottomRow + nx + 1];
-			sumOfSquaresBuffer[nx + 2] += rowsOfSummedSquaredCols[offsetToBottomRow + nx + 2];
+			radiusesX.push_back(width / 2);
 		}
 	}
-}
\ No newline at end of file
+	for (int width : GaussianBoxWidths(sigmaY, boxesCount))
+	{
+		if (width > 1)
+		{
+			radiusesY.push_back(width / 2);
+		}
+	}
+
+	int maxRadiusX = radiusesX.empty() ? 0 : *std::max_element(radiusesX.begin(), radiusesX.end());
+	int maxRadiusY = radiusesY.empty() ? 0 : *std::max_element(radiusesY.begin(), radiusesY.end());
+
+	// Проверка на возможность отражения и запас разрядности сумм
+	if (maxRadiusX > info.imageWidthPx || maxRadiusY > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
+	if (2 * std::max(maxRadiusX, maxRadiusY) + 1 > BoxCascadeMaxWidth)
+	{
+		throw std::invalid_argument("Слишком большое sigma");
+	}
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	// Ошибка отражения у края полосы накапливается по всем вертикальным боксам
+	int cascadeRadiusY = std::accumulate(radiusesY.begin(), radiusesY.end(), 0);
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			FilterInBands(srcPath, src, destFile, info,
+				BandHalo{ cascadeRadiusY, cascadeRadiusY }, threadsCount,
+				[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+				{
+					FastGaussianBlur<decltype(format)>(bandSrc, bandDest, bandInfo, radiusesX, radiusesY);
+				});
+		});
+}
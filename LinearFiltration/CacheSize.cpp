@@ -0,0 +1,48 @@
+#include "CacheSize.h"
+
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+static size_t QueryL2CacheBytes()
+{
+#ifdef _WIN32
+	DWORD length = 0;
+	GetLogicalProcessorInformation(nullptr, &length);
+
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> entries(
+		length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+
+	if (!entries.empty() && GetLogicalProcessorInformation(entries.data(), &length))
+	{
+		for (const auto& entry : entries)
+		{
+			if (entry.Relationship == RelationCache && entry.Cache.Level == 2)
+			{
+				return entry.Cache.Size;
+			}
+		}
+	}
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+	long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+	if (size > 0)
+	{
+		return (size_t)size;
+	}
+#endif
+
+	return DefaultL2CacheBytes;
+}
+
+size_t L2CacheBytes()
+{
+	static const size_t cacheBytes = QueryL2CacheBytes();
+	return cacheBytes;
+}
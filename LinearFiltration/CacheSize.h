@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+
+// Размер L2, если его не удалось узнать у системы
+const size_t DefaultL2CacheBytes = 256 << 10;
+
+/// <summary>
+/// Размер кэша L2 одного ядра процессора в байтах. Узнаётся у системы один раз.
+/// </summary>
+size_t L2CacheBytes();
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "GaussianBlurKernel.h"
+#include "FixedKernel.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "RowRing.h"
+#include "SimdConvolution.h"
+#include "FileStreams.h"
+#include "BmpOutput.h"
+#include "SourceFile.h"
+#include "FilterFunctions.h"
+
+using std::vector;
+
+constexpr FixedKernel<3, 3> SobelKernelX = OuterProduct(SobelSmoothingColumn, CentralDifferenceRow);
+
+// Строка над пикселем минус строка под ним
+constexpr FixedKernel<3, 3> SobelKernelY = OuterProduct(CentralDifferenceColumn, SobelSmoothingRow);
+
+// Границы секторов направления градиента: tg 22.5 и tg 67.5 градусов
+const float TanPiOver8 = 0.41421356f;
+const float Tan3PiOver8 = 2.41421356f;
+
+// Сколько строк назад слабые пиксели ещё узнают о сильных под ними
+const int DefaultHysteresisRowsCount = 32;
+
+/// <summary>
+/// Направление градиента, округлённое до 45 градусов в координатах (x, номер строки).
+/// </summary>
+enum class GradientDirection : uint8_t
+{
+	// Градиент вдоль строки, сравниваются соседи слева и справа
+	Horizontal,
+
+	// Вдоль (1, 1): соседи (x - 1, y - 1) и (x + 1, y + 1)
+	MainDiagonal,
+
+	// Вдоль столбца, соседи сверху и снизу
+	Vertical,
+
+	// Вдоль (1, -1): соседи (x + 1, y - 1) и (x - 1, y + 1)
+	AntiDiagonal
+};
+
+/// <summary>
+/// Класс пикселя после подавления немаксимумов.
+/// </summary>
+enum class EdgeClass : uint8_t
+{
+	None,
+	Weak,
+	Strong
+};
+
+/// <summary>
+/// Сектор направления градиента (gradientX, gradientY) без atan2: |gy| / |gx| сравнивается
+/// с тангенсами границ секторов умножением. gradientY - как у SobelKernelY, строка над
+/// пикселем минус строка под ним, поэтому по номеру строки градиент направлен вдоль -gradientY.
+/// </summary>
+inline GradientDirection QuantizeGradientDirection(float gradientX, float gradientY)
+{
+	float absX = std::abs(gradientX);
+	float absY = std::abs(gradientY);
+
+	if (absY <= TanPiOver8 * absX)
+	{
+		return GradientDirection::Horizontal;
+	}
+	if (absY >= Tan3PiOver8 * absX)
+	{
+		return GradientDirection::Vertical;
+	}
+
+	return (gradientX < 0) != (gradientY < 0)
+		? GradientDirection::MainDiagonal
+		: GradientDirection::AntiDiagonal;
+}
+
+/// <summary>
+/// Отражает края плоскости float, расширенной на radius значений с каждой стороны.
+/// </summary>
+inline void MirrorEdgesInPlane(float* expandedPlane, int widthPx, int radius)
+{
+	for (int x = 0; x < radius; x++)
+	{
+		expandedPlane[x] = expandedPlane[radius + MirrorIndex(x - radius, widthPx)];
+		expandedPlane[radius + widthPx + x] = expandedPlane[radius + MirrorIndex(widthPx + x, widthPx)];
+	}
+}
+
+/// <summary>
+/// Гистерезис порогов Канни в потоке строк. Слабые и сильные пиксели соседних строк
+/// объединяются в компоненты 8-связности системой непересекающихся множеств, корень
+/// компоненты помнит, есть ли в ней сильный пиксель. Метки пикселей живут в кольце
+/// из rowsCount строк, корень - всегда самый новый пиксель компоненты, поэтому ссылки
+/// идут от старых строк к новым и вытесняемая строка не нужна оставшимся.
+/// Строка выдаётся, когда её место в кольце нужно новой: слабый пиксель становится краем,
+/// если его компонента связана с сильным пикселем в любой строке выше или не более чем
+/// rowsCount - 1 строками ниже. При rowsCount не меньше высоты изображения - точный гистерезис.
+/// </summary>
+class EdgeHysteresis
+{
+private:
+	int widthPx_;
+	int slotsCount_;
+
+	vector<EdgeClass> classes_;
+	vector<int32_t> parents_;
+	vector<uint8_t> hasStrong_;
+
+	// Номер строки изображения в каждом слоте кольца
+	vector<int> slotRows_;
+
+	int pushedRowsCount_ = 0;
+	int emittedRowsCount_ = 0;
+
+	int64_t Age(int32_t label) const
+	{
+		return (int64_t)slotRows_[label / widthPx_] * widthPx_ + label % widthPx_;
+	}
+
+	int32_t Find(int32_t label)
+	{
+		int32_t root = label;
+
+		while (parents_[root] != root)
+		{
+			root = parents_[root];
+		}
+
+		while (parents_[label] != root)
+		{
+			int32_t next = parents_[label];
+
+			parents_[label] = root;
+			label = next;
+		}
+
+		return root;
+	}
+
+	void Unite(int32_t first, int32_t second)
+	{
+		int32_t firstRoot = Find(first);
+		int32_t secondRoot = Find(second);
+
+		if (firstRoot == secondRoot)
+		{
+			return;
+		}
+
+		if (Age(firstRoot) > Age(secondRoot))
+		{
+			std::swap(firstRoot, secondRoot);
+		}
+
+		parents_[firstRoot] = secondRoot;
+		hasStrong_[secondRoot] |= hasStrong_[firstRoot];
+	}
+
+public:
+	EdgeHysteresis(int widthPx, int heightPx, int rowsCount)
+		: widthPx_(widthPx),
+		slotsCount_(std::min(rowsCount, heightPx)),
+		classes_((size_t)slotsCount_ * widthPx),
+		parents_((size_t)slotsCount_ * widthPx),
+		hasStrong_((size_t)slotsCount_ * widthPx),
+		slotRows_(slotsCount_)
+	{
+		if ((int64_t)slotsCount_ * widthPx > INT32_MAX)
+		{
+			throw std::invalid_argument("Слишком много строк гистерезиса для такой ширины");
+		}
+	}
+
+	/// <summary>
+	/// Нужно ли выдать строку, прежде чем добавить следующую.
+	/// </summary>
+	bool IsFull() const noexcept
+	{
+		return pushedRowsCount_ - emittedRowsCount_ == slotsCount_;
+	}
+
+	bool HasPendingRows() const noexcept
+	{
+		return emittedRowsCount_ < pushedRowsCount_;
+	}
+
+	int EmittedRowsCount() const noexcept
+	{
+		return emittedRowsCount_;
+	}
+
+	/// <summary>
+	/// Место под классы пикселей следующей строки, после заполнения - PushRow.
+	/// </summary>
+	EdgeClass* NextRow()
+	{
+		return &classes_[(size_t)(pushedRowsCount_ % slotsCount_) * widthPx_];
+	}
+
+	void PushRow()
+	{
+		int slot = pushedRowsCount_ % slotsCount_;
+		int32_t firstLabel = slot * widthPx_;
+
+		int previousSlot = (pushedRowsCount_ + slotsCount_ - 1) % slotsCount_;
+		int32_t previousFirstLabel = previousSlot * widthPx_;
+		bool hasPreviousRow = pushedRowsCount_ > emittedRowsCount_;
+
+		slotRows_[slot] = pushedRowsCount_;
+
+		for (int x = 0; x < widthPx_; x++)
+		{
+			int32_t label = firstLabel + x;
+
+			parents_[label] = label;
+			hasStrong_[label] = classes_[label] == EdgeClass::Strong;
+
+			if (classes_[label] == EdgeClass::None)
+			{
+				continue;
+			}
+
+			if (x > 0 && classes_[label - 1] != EdgeClass::None)
+			{
+				Unite(label - 1, label);
+			}
+
+			if (!hasPreviousRow)
+			{
+				continue;
+			}
+
+			for (int neighborX = std::max(0, x - 1); neighborX <= std::min(widthPx_ - 1, x + 1); neighborX++)
+			{
+				if (classes_[previousFirstLabel + neighborX] != EdgeClass::None)
+				{
+					Unite(previousFirstLabel + neighborX, label);
+				}
+			}
+		}
+
+		pushedRowsCount_++;
+	}
+
+	/// <summary>
+	/// Выдаёт самую старую строку: 255 - край, 0 - нет.
+	/// </summary>
+	void EmitRow(uint8_t* destRow)
+	{
+		int32_t firstLabel = (emittedRowsCount_ % slotsCount_) * widthPx_;
+
+		for (int x = 0; x < widthPx_; x++)
+		{
+			int32_t label = firstLabel + x;
+			bool isEdge = classes_[label] == EdgeClass::Strong ||
+				(classes_[label] == EdgeClass::Weak && hasStrong_[Find(label)]);
+
+			destRow[x] = isEdge ? 255 : 0;
+		}
+
+		emittedRowsCount_++;
+	}
+};
+
+/// <summary>
+/// Детектор границ Канни за один проход по 8-битным строкам яркости: гауссово размытие
+/// smoothingSize x smoothingSize (разделимое), градиент Собеля с направлением,
+/// подавление немаксимумов в окне из трёх строк и гистерезис порогов. Каждый этап
+/// держит кольцо строк по высоте своего окна, края отражаются. Модуль градиента
+/// сравнивается в квадрате, поэтому корни не извлекаются.
+/// </summary>
+inline void DetectCannyEdges(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	float lowThreshold,
+	float highThreshold,
+	int smoothingSize,
+	int hysteresisRowsCount)
+{
+	const int widthPx = info.imageWidthPx;
+	const int heightPx = info.imageHeightPx;
+
+	GaussianBlurKernel kernelX(1, smoothingSize);
+	GaussianBlurKernel kernelY(smoothingSize, 1);
+
+	const int smoothingRadius = kernelX.HorizontalRadius();
+	const float lowSquare = lowThreshold * lowThreshold;
+	const float highSquare = highThreshold * highThreshold;
+
+	vector<uint8_t> srcRow(info.imageWidthBytes);
+	vector<float> expandedLuma(widthPx + 2 * smoothingRadius);
+	vector<const float*> smoothingWindow(smoothingSize);
+
+	// Строки, размытые по X; размытые строки и квадраты модуля градиента
+	// расширены на пиксель для соседей по X
+	RowRing<float, MirrorBorder> blurredXRows(widthPx, heightPx, smoothingSize);
+	RowRing<float, MirrorBorder> smoothedRows(widthPx + 2, heightPx, 3);
+	RowRing<float, MirrorBorder> magnitudeRows(widthPx + 2, heightPx, 3);
+	RowRing<GradientDirection, MirrorBorder> directionRows(widthPx, heightPx, 3);
+
+	EdgeHysteresis hysteresis(widthPx, heightPx, hysteresisRowsCount);
+
+	auto readRow = [&]()
+		{
+			src.read((char*)srcRow.data(), info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+
+			std::copy(srcRow.begin(), srcRow.begin() + widthPx, expandedLuma.begin() + smoothingRadius);
+			MirrorEdgesInPlane(expandedLuma.data(), widthPx, smoothingRadius);
+
+			ConvolvePlaneX(expandedLuma.data(), blurredXRows.AppendRow(),
+				kernelX.Data(), kernelX.Width(), widthPx);
+		};
+
+	auto smoothRow = [&]()
+		{
+			int y = smoothedRows.PushedRowsCount();
+
+			while (!blurredXRows.HasWindow(y - smoothingRadius, smoothingSize))
+			{
+				readRow();
+			}
+
+			blurredXRows.Window(y - smoothingRadius, smoothingSize, smoothingWindow.data());
+
+			float* smoothed = smoothedRows.AppendRow();
+
+			std::fill(smoothed + 1, smoothed + 1 + widthPx, 0.f);
+			AccumulatePlaneY(smoothingWindow.data(), kernelY.Data(), smoothingSize, smoothed + 1, widthPx);
+			MirrorEdgesInPlane(smoothed, widthPx, 1);
+		};
+
+	auto gradientRow = [&]()
+		{
+			int y = magnitudeRows.PushedRowsCount();
+
+			while (!smoothedRows.HasWindow(y - 1, 3))
+			{
+				smoothRow();
+			}
+
+			const float* window[3];
+			smoothedRows.Window(y - 1, 3, window);
+
+			float* magnitude = magnitudeRows.AppendRow();
+			GradientDirection* direction = directionRows.AppendRow();
+
+			for (int x = 0; x < widthPx; x++)
+			{
+				auto load = [&](int i, int j) { return window[i][x + j]; };
+
+				float gradientX = CorrelateFixed<SobelKernelX>(load);
+				float gradientY = CorrelateFixed<SobelKernelY>(load);
+
+				magnitude[x + 1] = gradientX * gradientX + gradientY * gradientY;
+				direction[x] = QuantizeGradientDirection(gradientX, gradientY);
+			}
+
+			MirrorEdgesInPlane(magnitude, widthPx, 1);
+		};
+
+	for (int y = 0; y < heightPx; y++)
+	{
+		while (!magnitudeRows.HasWindow(y - 1, 3))
+		{
+			gradientRow();
+		}
+
+		const float* above = magnitudeRows.Row(y - 1);
+		const float* center = magnitudeRows.Row(y);
+		const float* below = magnitudeRows.Row(y + 1);
+		const GradientDirection* direction = directionRows.Row(y);
+
+		if (hysteresis.IsFull())
+		{
+			hysteresis.EmitRow(dest.Rows(hysteresis.EmittedRowsCount(), 1));
+			dest.CommitRows();
+		}
+
+		EdgeClass* classes = hysteresis.NextRow();
+
+		// Индексы расширенных строк: пиксель x - элемент x + 1
+		for (int x = 0; x < widthPx; x++)
+		{
+			float value = center[x + 1];
+			float before;
+			float after;
+
+			switch (direction[x])
+			{
+			case GradientDirection::Horizontal:
+				before = center[x];
+				after = center[x + 2];
+				break;
+
+			case GradientDirection::MainDiagonal:
+				before = above[x];
+				after = below[x + 2];
+				break;
+
+			case GradientDirection::Vertical:
+				before = above[x + 1];
+				after = below[x + 1];
+				break;
+
+			default:
+				before = above[x + 2];
+				after = below[x];
+				break;
+			}
+
+			// Строгое неравенство с одной стороны оставляет плато шириной в пиксель
+			bool isMaximum = value > before && value >= after;
+
+			classes[x] = !isMaximum || value <= lowSquare ? EdgeClass::None
+				: value > highSquare ? EdgeClass::Strong
+				: EdgeClass::Weak;
+		}
+
+		hysteresis.PushRow();
+	}
+
+	while (hysteresis.HasPendingRows())
+	{
+		hysteresis.EmitRow(dest.Rows(hysteresis.EmittedRowsCount(), 1));
+		dest.CommitRows();
+	}
+}
+
+/// <summary>
+/// Границы Канни в 8-битное изображение с палитрой оттенков серого: 255 - граница, 0 - нет.
+/// Цветное изображение читается как яркость srcPath.luma, по умолчанию BT.601. Пороги - модуль градиента Собеля после
+/// гауссова размытия smoothingSize x smoothingSize: пиксели выше highThreshold - границы,
+/// выше lowThreshold - границы, если связаны с ними (см. EdgeHysteresis).
+/// Гистерезис связывает всё изображение, поэтому проход один и последовательный.
+/// </summary>
+void DetectCannyEdges(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	double lowThreshold,
+	double highThreshold,
+	int smoothingSize = 5,
+	int hysteresisRowsCount = DefaultHysteresisRowsCount,
+	OutputBackend backend = OutputBackend::Auto)
+{
+	if (!(lowThreshold >= 0 && lowThreshold <= highThreshold))
+	{
+		throw std::invalid_argument("Пороги должны удовлетворять 0 <= lowThreshold <= highThreshold");
+	}
+	if (smoothingSize < 1 || smoothingSize % 2 == 0)
+	{
+		throw std::invalid_argument("Размер размытия должен быть положительным и нечётным");
+	}
+	// Строке нужна предыдущая, чтобы связать пиксели по вертикали
+	if (hysteresisRowsCount < 2)
+	{
+		throw std::invalid_argument("Число строк гистерезиса должно быть не меньше 2");
+	}
+
+	SourceImage lumaSrcPath = srcPath;
+
+	if (lumaSrcPath.luma == LumaStandard::None)
+	{
+		lumaSrcPath.luma = LumaStandard::Bt601;
+	}
+
+	SourceFile srcFile(lumaSrcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	if (smoothingSize / 2 > info.imageWidthPx ||
+		smoothingSize / 2 > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+	BmpRowWriter dest(destFile);
+
+	DetectCannyEdges(src, dest, info,
+		(float)lowThreshold, (float)highThreshold, smoothingSize, hysteresisRowsCount);
+
+	dest.Flush();
+}
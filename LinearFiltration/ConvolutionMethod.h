@@ -0,0 +1,30 @@
+#pragma once
+
+/// <summary>
+/// Способ двумерной свёртки.
+/// </summary>
+enum class ConvolutionMethod
+{
+	// Способ с наименьшей оценкой числа умножений на пиксель
+	Auto,
+
+	// Прямое суммирование H * W произведений
+	Direct,
+
+	// Сумма разделимых проходов по сингулярному разложению ядра
+	Separable,
+
+	// Перекрытие с сохранением через двумерное БПФ полос строк
+	Fft,
+
+	// Прямое суммирование в целых числах с коэффициентами int16, для ядер,
+	// которые квантуются без потери точности (QuantizeKernel)
+	FixedPoint,
+
+	// Скользящая сумма BoxBlur, для ядер с равными коэффициентами 1 / (H * W)
+	Box,
+
+	// Самый быстрый на этой машине по замеру способ (TuneConvolutionMethod),
+	// решения хранятся на диске
+	Tuned
+};
@@ -0,0 +1,166 @@
+#include "ConvolutionTuning.h"
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+bool IsTunedMethodApplicable(const ConvolutionTuningKey& key, ConvolutionMethod method)
+{
+	switch (method)
+	{
+	case ConvolutionMethod::Direct:
+		return true;
+
+	case ConvolutionMethod::Separable:
+		return key.termsCount > 0;
+
+	case ConvolutionMethod::Fft:
+		return key.border == (int)BorderMode::Mirror;
+
+	case ConvolutionMethod::FixedPoint:
+		return key.isFixedPointAccurate;
+
+	case ConvolutionMethod::Box:
+		return key.isBox;
+
+	// Способы, которые сами требуют выбора, в файле не бывают
+	default:
+		return false;
+	}
+}
+
+static std::mutex tunedMethodsMutex;
+
+// Прочитан ли файл решений текущего формата - иначе он переписывается целиком при записи
+static bool isTuningCacheValid = false;
+
+// Строка файла после заголовка: поля ключа по порядку объявления и номер способа
+static std::map<ConvolutionTuningKey, ConvolutionMethod> LoadTunedMethods()
+{
+	std::map<ConvolutionTuningKey, ConvolutionMethod> methods;
+	std::optional<std::filesystem::path> path = TuningCachePath();
+
+	if (!path)
+	{
+		return methods;
+	}
+
+	std::ifstream file(*path);
+	std::string header;
+
+	if (!std::getline(file, header) || header != TuningCacheHeader)
+	{
+		return methods;
+	}
+
+	isTuningCacheValid = true;
+
+	ConvolutionTuningKey key{};
+	int method;
+
+	while (file >> key.kernelHeight >> key.kernelWidth >> key.termsCount
+		>> key.isFixedPointAccurate >> key.isBox >> key.border
+		>> key.bitPerPixel >> key.widthClass >> method)
+	{
+		// Испорченная или чужая строка не должна подменить способ неприменимым
+		if (IsTunedMethodApplicable(key, (ConvolutionMethod)method))
+		{
+			methods[key] = (ConvolutionMethod)method;
+		}
+	}
+
+	return methods;
+}
+
+static std::map<ConvolutionTuningKey, ConvolutionMethod>& TunedMethods()
+{
+	static std::map<ConvolutionTuningKey, ConvolutionMethod> methods = LoadTunedMethods();
+	return methods;
+}
+
+static void WriteTunedMethod(std::ostream& file, const ConvolutionTuningKey& key, ConvolutionMethod method)
+{
+	file << key.kernelHeight << ' ' << key.kernelWidth << ' ' << key.termsCount << ' '
+		<< key.isFixedPointAccurate << ' ' << key.isBox << ' ' << key.border << ' '
+		<< key.bitPerPixel << ' ' << key.widthClass << ' ' << (int)method << '\n';
+}
+
+std::optional<std::filesystem::path> TuningCachePath()
+{
+	std::error_code error;
+	std::filesystem::path directory = std::filesystem::temp_directory_path(error);
+
+	if (error)
+	{
+		return std::nullopt;
+	}
+
+	return directory / "LinearFiltration.tuning";
+}
+
+std::filesystem::path TuningBenchmarkPath()
+{
+	std::filesystem::path directory = std::filesystem::temp_directory_path();
+
+	std::random_device device;
+	uint64_t suffix = ((uint64_t)device() << 32) | device();
+
+	std::ostringstream name;
+	name << "LinearFiltration.tuning." << std::hex << suffix << ".bmp";
+
+	return directory / name.str();
+}
+
+std::optional<ConvolutionMethod> FindTunedMethod(const ConvolutionTuningKey& key)
+{
+	std::lock_guard<std::mutex> lock(tunedMethodsMutex);
+
+	auto& methods = TunedMethods();
+	auto found = methods.find(key);
+
+	if (found == methods.end())
+	{
+		return std::nullopt;
+	}
+
+	return found->second;
+}
+
+void StoreTunedMethod(const ConvolutionTuningKey& key, ConvolutionMethod method)
+{
+	std::lock_guard<std::mutex> lock(tunedMethodsMutex);
+
+	auto& methods = TunedMethods();
+	methods[key] = method;
+
+	std::optional<std::filesystem::path> path = TuningCachePath();
+
+	if (!path)
+	{
+		return;
+	}
+
+	if (isTuningCacheValid)
+	{
+		std::ofstream file(*path, std::ios::app);
+		WriteTunedMethod(file, key, method);
+		return;
+	}
+
+	// Файла нет или он другого формата - записывается заново с заголовком
+	std::ofstream file(*path, std::ios::trunc);
+	file << TuningCacheHeader << '\n';
+
+	for (const auto& [storedKey, storedMethod] : methods)
+	{
+		WriteTunedMethod(file, storedKey, storedMethod);
+	}
+
+	isTuningCacheValid = (bool)file;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <compare>
+#include <filesystem>
+#include <optional>
+
+#include "ConvolutionMethod.h"
+#include "RowRing.h"
+
+/// <summary>
+/// Всё, от чего зависит самый быстрый способ свёртки: размеры и ранг ядра, применимость
+/// целочисленной свёртки и скользящей суммы, граница, формат пикселя и класс ширины
+/// изображения (std::bit_width ширины - ширины одного класса отличаются не больше чем вдвое).
+/// </summary>
+struct ConvolutionTuningKey
+{
+	int kernelHeight;
+	int kernelWidth;
+	int termsCount;
+	bool isFixedPointAccurate;
+	bool isBox;
+	int border;
+	int bitPerPixel;
+	int widthClass;
+
+	auto operator<=>(const ConvolutionTuningKey&) const = default;
+};
+
+// Первая строка файла решений. Файл другого формата не читается и переписывается
+const char TuningCacheHeader[] = "LinearFiltration.tuning 1";
+
+/// <summary>
+/// Применим ли method к ядру и изображению key: Box - только к равномерному окну,
+/// FixedPoint - к ядру, которое квантуется без потери точности, Separable - к ядру
+/// с разложением, Fft - только при отражении краёв.
+/// </summary>
+bool IsTunedMethodApplicable(const ConvolutionTuningKey& key, ConvolutionMethod method);
+
+/// <summary>
+/// Файл решений замеров во временном каталоге пользователя, общий для всех запусков на машине.
+/// Без временного каталога файла нет и решения живут до конца процесса.
+/// </summary>
+std::optional<std::filesystem::path> TuningCachePath();
+
+/// <summary>
+/// Новое имя во временном каталоге для изображения одного замера: процессы и потоки,
+/// замеряющие одновременно, не пишут в один файл. Без временного каталога бросает исключение.
+/// </summary>
+std::filesystem::path TuningBenchmarkPath();
+
+/// <summary>
+/// Ранее замеренный способ для key. Файл решений читается при первом обращении,
+/// строки со способом, не применимым к своему ключу, отбрасываются.
+/// </summary>
+std::optional<ConvolutionMethod> FindTunedMethod(const ConvolutionTuningKey& key);
+
+/// <summary>
+/// Запоминает способ для key и дописывает решение в файл. Если файл недоступен для записи,
+/// решение живёт до конца процесса.
+/// </summary>
+void StoreTunedMethod(const ConvolutionTuningKey& key, ConvolutionMethod method);
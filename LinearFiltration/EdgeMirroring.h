@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/// <summary>
+/// Индекс строки или столбца после зеркального отражения за краем (1 0 | 0 1 2 | 2 1).
+/// </summary>
+inline int MirrorIndex(int index, int size)
+{
+	if (index < 0)
+	{
+		return -1 - index;
+	}
+	if (index >= size)
+	{
+		return 2 * size - 1 - index;
+	}
+
+	return index;
+}
+
+/// <summary>
+/// Отражает крайние пиксели строки, расширенной на horizontalRadius пикселей с каждой стороны.
+/// </summary>
+template<class Px>
+void MirrorEdgePixelsInRow(
+	uint8_t* expandedRow,
+	int imageWidthPx,
+	int horizontalRadius)
+{
+	// Ось отражения - нулевой пиксель, у расширенной строки
+	// его индекс = horizontalRadius
+	// Левый край
+	for (int x = 0; x < horizontalRadius; x++)
+	{
+		int mirrorX = horizontalRadius * 2 - 1 - x;
+
+		std::memcpy(
+			expandedRow + x * Px::BytePerPx,
+			expandedRow + mirrorX * Px::BytePerPx,
+			Px::BytePerPx);
+	}
+
+	// Правый край
+	for (int x = imageWidthPx + horizontalRadius;
+		x < imageWidthPx + horizontalRadius * 2;
+		x++)
+	{
+		int mirrorX = 2 * (imageWidthPx + horizontalRadius) - x - 1;
+
+		std::memcpy(
+			expandedRow + x * Px::BytePerPx,
+			expandedRow + mirrorX * Px::BytePerPx,
+			Px::BytePerPx);
+	}
+}
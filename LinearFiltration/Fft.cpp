@@ -0,0 +1,176 @@
+#include "Fft.h"
+
+#include <cmath>
+#include <numbers>
+#include <stdexcept>
+#include <utility>
+
+int NextPowerOfTwo(int value) noexcept
+{
+	int result = 1;
+	while (result < value)
+	{
+		result <<= 1;
+	}
+
+	return result;
+}
+
+Fft::Fft(int n)
+	: n_(n), twiddles_(n / 2), bitReversed_(n)
+{
+	if (n < 1 || (n & (n - 1)) != 0)
+	{
+		throw std::invalid_argument("Длина БПФ должна быть степенью двойки");
+	}
+
+	// Множители считаются в double, чтобы ошибка не копилась с ростом n
+	for (int k = 0; k < n / 2; k++)
+	{
+		double angle = -2 * std::numbers::pi * k / n;
+		twiddles_[k] = Complex((float)std::cos(angle), (float)std::sin(angle));
+	}
+
+	int bitsCount = 0;
+	while ((1 << bitsCount) < n)
+	{
+		bitsCount++;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t reversed = 0;
+		for (int b = 0; b < bitsCount; b++)
+		{
+			reversed |= ((i >> b) & 1u) << (bitsCount - 1 - b);
+		}
+		bitReversed_[i] = reversed;
+	}
+}
+
+int Fft::Size() const noexcept
+{
+	return n_;
+}
+
+void Fft::Transform(Complex* data, bool isInverse) const
+{
+	for (int i = 0; i < n_; i++)
+	{
+		if ((uint32_t)i < bitReversed_[i])
+		{
+			std::swap(data[i], data[bitReversed_[i]]);
+		}
+	}
+
+	for (int length = 2; length <= n_; length <<= 1)
+	{
+		int halfLength = length / 2;
+		int twiddleStep = n_ / length;
+
+		for (int start = 0; start < n_; start += length)
+		{
+			for (int k = 0; k < halfLength; k++)
+			{
+				Complex w = twiddles_[(size_t)k * twiddleStep];
+				if (isInverse)
+				{
+					w = std::conj(w);
+				}
+
+				Complex even = data[start + k];
+				Complex odd = data[start + k + halfLength] * w;
+
+				data[start + k] = even + odd;
+				data[start + k + halfLength] = even - odd;
+			}
+		}
+	}
+}
+
+void Fft::Forward(Complex* data) const
+{
+	Transform(data, false);
+}
+
+void Fft::Inverse(Complex* data) const
+{
+	Transform(data, true);
+}
+
+RealFft::RealFft(int n)
+	: n_(n), halfFft_(n / 2), twiddles_(n / 2 + 1), buffer_(n / 2)
+{
+	if (n < 2)
+	{
+		throw std::invalid_argument("Длина БПФ должна быть степенью двойки");
+	}
+
+	for (int k = 0; k <= n / 2; k++)
+	{
+		double angle = -2 * std::numbers::pi * k / n;
+		twiddles_[k] = Complex((float)std::cos(angle), (float)std::sin(angle));
+	}
+}
+
+int RealFft::Size() const noexcept
+{
+	return n_;
+}
+
+int RealFft::SpectrumSize() const noexcept
+{
+	return n_ / 2 + 1;
+}
+
+void RealFft::Forward(const float* input, Complex* spectrum) const
+{
+	const int half = n_ / 2;
+
+	// Чётные отсчёты - вещественная часть, нечётные - мнимая
+	for (int k = 0; k < half; k++)
+	{
+		buffer_[k] = Complex(input[2 * k], input[2 * k + 1]);
+	}
+
+	halfFft_.Forward(buffer_.data());
+
+	// Разделение спектров чётных и нечётных отсчётов:
+	// X[k] = E[k] + W^k * O[k]
+	for (int k = 0; k <= half; k++)
+	{
+		Complex z = buffer_[k % half];
+		Complex zMirrored = std::conj(buffer_[(half - k) % half]);
+
+		Complex even = 0.5f * (z + zMirrored);
+		Complex odd = Complex(0, -0.5f) * (z - zMirrored);
+
+		spectrum[k] = even + twiddles_[k] * odd;
+	}
+}
+
+void RealFft::Inverse(const Complex* spectrum, float* output) const
+{
+	const int half = n_ / 2;
+
+	// Обратное к Forward: E[k] = X[k] + conj(X[n/2 - k]), O[k] = (X[k] - conj(X[n/2 - k])) / W^k,
+	// без множителя 1/2, чтобы масштаб совпал с полным обратным БПФ
+	for (int k = 0; k < half; k++)
+	{
+		Complex x = spectrum[k];
+		Complex xMirrored = std::conj(spectrum[half - k]);
+
+		Complex even = x + xMirrored;
+		Complex odd = (x - xMirrored) * std::conj(twiddles_[k]);
+
+		buffer_[k] = even + Complex(0, 1) * odd;
+	}
+
+	halfFft_.Inverse(buffer_.data());
+
+	for (int k = 0; k < half; k++)
+	{
+		output[2 * k] = buffer_[k].real();
+		output[2 * k + 1] = buffer_[k].imag();
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+using Complex = std::complex<float>;
+
+/// <summary>
+/// Комплексное БПФ по основанию 2 длины n (степень двойки), без нормировки:
+/// Inverse(Forward(x)) = n * x.
+/// </summary>
+class Fft
+{
+private:
+	int n_;
+
+	// Поворачивающие множители e^(-2 pi i k / n), k < n / 2
+	std::vector<Complex> twiddles_;
+	std::vector<uint32_t> bitReversed_;
+
+	void Transform(Complex* data, bool isInverse) const;
+
+public:
+	explicit Fft(int n);
+
+	int Size() const noexcept;
+
+	void Forward(Complex* data) const;
+
+	void Inverse(Complex* data) const;
+};
+
+/// <summary>
+/// БПФ вещественной последовательности длины n через комплексное БПФ длины n / 2.
+/// Спектр хранит n / 2 + 1 первых коэффициентов, остальные сопряжены им.
+/// </summary>
+class RealFft
+{
+private:
+	int n_;
+	Fft halfFft_;
+
+	// e^(-2 pi i k / n), k <= n / 2
+	std::vector<Complex> twiddles_;
+
+	mutable std::vector<Complex> buffer_;
+
+public:
+	explicit RealFft(int n);
+
+	int Size() const noexcept;
+
+	int SpectrumSize() const noexcept;
+
+	void Forward(const float* input, Complex* spectrum) const;
+
+	/// <summary>
+	/// Обратное преобразование, без нормировки: Inverse(Forward(x)) = n * x.
+	/// </summary>
+	void Inverse(const Complex* spectrum, float* output) const;
+};
+
+int NextPowerOfTwo(int value) noexcept;
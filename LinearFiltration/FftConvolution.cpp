@@ -0,0 +1,151 @@
+#include "FftConvolution.h"
+
+#include <algorithm>
+#include <cmath>
+
+FftBandPlan PlanFftBands(const Kernel& kernel, int imageWidthPx, int imageHeightPx)
+{
+	FftBandPlan plan{};
+
+	plan.fftWidth = NextPowerOfTwo(std::max(imageWidthPx + kernel.HorizontalRadius() * 2, 2));
+	plan.fftHeight = NextPowerOfTwo(std::max(kernel.Height() * 2, 2));
+
+	const int64_t spectrumRowBytes = (int64_t)(plan.fftWidth / 2 + 1) * sizeof(Complex);
+
+	// Полосу не имеет смысла делать выше изображения
+	while (plan.fftHeight - kernel.Height() + 1 < imageHeightPx &&
+		spectrumRowBytes * plan.fftHeight * 2 <= FftBandBytes)
+	{
+		plan.fftHeight *= 2;
+	}
+
+	plan.bandRowsCount = plan.fftHeight - kernel.Height() + 1;
+
+	return plan;
+}
+
+double FftOperationsPerPixel(const FftBandPlan& plan, int imageWidthPx)
+{
+	double points = (double)plan.fftWidth * plan.fftHeight;
+
+	// Прямое и обратное вещественные БПФ - около 1.5 * N * log2(N) умножений,
+	// делённые на число полезных выходных пикселей полосы
+	return 1.5 * points * std::log2(points) / ((double)imageWidthPx * plan.bandRowsCount);
+}
+
+FftConvolver::FftConvolver(const Kernel& kernel, const FftBandPlan& plan)
+	: plan_(plan),
+	rowFft_(plan.fftWidth),
+	columnFft_(plan.fftHeight),
+	spectrum_((size_t)plan.fftHeight * (plan.fftWidth / 2 + 1)),
+	columns_((size_t)plan.fftHeight * FftColumnsPerBlock)
+{
+	const int spectrumWidth = rowFft_.SpectrumSize();
+
+	std::vector<float> kernelRows((size_t)plan_.fftHeight * plan_.fftWidth);
+	for (int i = 0; i < kernel.Height(); i++)
+	{
+		for (int j = 0; j < kernel.Width(); j++)
+		{
+			kernelRows[(size_t)i * plan_.fftWidth + j] = kernel(i, j);
+		}
+	}
+
+	ForwardRows(kernelRows.data());
+
+	const float scale = 1.f / ((float)plan_.fftWidth * plan_.fftHeight);
+	kernelSpectrum_.resize((size_t)spectrumWidth * plan_.fftHeight);
+
+	for (int j = 0; j < spectrumWidth; j++)
+	{
+		Complex* column = &kernelSpectrum_[(size_t)j * plan_.fftHeight];
+
+		for (int r = 0; r < plan_.fftHeight; r++)
+		{
+			column[r] = spectrum_[(size_t)r * spectrumWidth + j];
+		}
+
+		columnFft_.Forward(column);
+
+		// Корреляция - умножение на сопряжённый спектр ядра
+		for (int r = 0; r < plan_.fftHeight; r++)
+		{
+			column[r] = std::conj(column[r]) * scale;
+		}
+	}
+}
+
+const FftBandPlan& FftConvolver::Plan() const noexcept
+{
+	return plan_;
+}
+
+void FftConvolver::ForwardRows(const float* rows)
+{
+	const int spectrumWidth = rowFft_.SpectrumSize();
+
+	for (int r = 0; r < plan_.fftHeight; r++)
+	{
+		rowFft_.Forward(
+			rows + (size_t)r * plan_.fftWidth,
+			&spectrum_[(size_t)r * spectrumWidth]);
+	}
+}
+
+void FftConvolver::Correlate(const float* input, float* output)
+{
+	const int spectrumWidth = rowFft_.SpectrumSize();
+	const int fftHeight = plan_.fftHeight;
+
+	ForwardRows(input);
+
+	// Прямое БПФ по столбцу, умножение на спектр ядра и обратное БПФ
+	// выполняются подряд, пока столбец в кэше
+	for (int firstColumn = 0; firstColumn < spectrumWidth; firstColumn += FftColumnsPerBlock)
+	{
+		int columnsCount = std::min(FftColumnsPerBlock, spectrumWidth - firstColumn);
+
+		for (int r = 0; r < fftHeight; r++)
+		{
+			const Complex* spectrumRow = &spectrum_[(size_t)r * spectrumWidth + firstColumn];
+
+			for (int k = 0; k < columnsCount; k++)
+			{
+				columns_[(size_t)k * fftHeight + r] = spectrumRow[k];
+			}
+		}
+
+		for (int k = 0; k < columnsCount; k++)
+		{
+			Complex* column = &columns_[(size_t)k * fftHeight];
+			const Complex* kernelColumn = &kernelSpectrum_[(size_t)(firstColumn + k) * fftHeight];
+
+			columnFft_.Forward(column);
+
+			for (int r = 0; r < fftHeight; r++)
+			{
+				column[r] *= kernelColumn[r];
+			}
+
+			columnFft_.Inverse(column);
+		}
+
+		// Нижние строки результата задеты циклическим переносом и не нужны
+		for (int r = 0; r < plan_.bandRowsCount; r++)
+		{
+			Complex* spectrumRow = &spectrum_[(size_t)r * spectrumWidth + firstColumn];
+
+			for (int k = 0; k < columnsCount; k++)
+			{
+				spectrumRow[k] = columns_[(size_t)k * fftHeight + r];
+			}
+		}
+	}
+
+	for (int r = 0; r < plan_.bandRowsCount; r++)
+	{
+		rowFft_.Inverse(
+			&spectrum_[(size_t)r * spectrumWidth],
+			output + (size_t)r * plan_.fftWidth);
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+
+#include "Fft.h"
+#include "Kernel.h"
+
+// Размер спектра полосы одного канала, под который подбирается высота полосы
+const int64_t FftBandBytes = 2 << 20;
+
+// Столбцы спектра обрабатываются группами по кэш-линии
+const int FftColumnsPerBlock = 8;
+
+/// <summary>
+/// Размеры двумерного БПФ полосы строк для свёртки методом перекрытия с сохранением.
+/// Из fftHeight строк входа получается bandRowsCount = fftHeight - H + 1 строк выхода.
+/// </summary>
+struct FftBandPlan
+{
+	int fftWidth;
+	int fftHeight;
+	int bandRowsCount;
+};
+
+/// <summary>
+/// Ширина БПФ вмещает расширенную отражением строку, высота - не меньше 2H,
+/// чтобы перекрытие полос было не больше половины, и растёт, пока спектр помещается в FftBandBytes.
+/// </summary>
+FftBandPlan PlanFftBands(const Kernel& kernel, int imageWidthPx, int imageHeightPx);
+
+/// <summary>
+/// Примерное число умножений на выходной пиксель канала при свёртке через БПФ,
+/// сравнимое с H * W прямой свёртки.
+/// </summary>
+double FftOperationsPerPixel(const FftBandPlan& plan, int imageWidthPx);
+
+/// <summary>
+/// Корреляция полосы fftHeight x fftWidth с ядром через БПФ.
+/// Спектр ядра считается один раз на размер полосы.
+/// </summary>
+class FftConvolver
+{
+private:
+	FftBandPlan plan_;
+
+	RealFft rowFft_;
+	Fft columnFft_;
+
+	// Сопряжённый спектр ядра с нормировкой 1 / (fftWidth * fftHeight),
+	// хранится по столбцам: [столбец][строка]
+	std::vector<Complex> kernelSpectrum_;
+
+	std::vector<Complex> spectrum_;
+	std::vector<Complex> columns_;
+
+	void ForwardRows(const float* rows);
+
+public:
+	FftConvolver(const Kernel& kernel, const FftBandPlan& plan);
+
+	const FftBandPlan& Plan() const noexcept;
+
+	/// <summary>
+	/// output[r][x] = сумма kernel(i, j) * input[r + i][x + j].
+	/// Заполняются только строки r < bandRowsCount, значения верны для x <= fftWidth - W.
+	/// </summary>
+	void Correlate(const float* input, float* output);
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <istream>
+#include <vector>
+#include <algorithm>
+
+#include "Kernel.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "FftConvolution.h"
+#include "BmpOutput.h"
+
+using std::vector;
+
+/// <summary>
+/// Двумерная свёртка методом перекрытия с сохранением. Изображение обрабатывается
+/// полосами строк: каждая полоса входа перекрывается с предыдущей на H - 1 строк,
+/// каналы хранятся отдельными плоскостями, расширенными отражением как в MirrorEdgePixelsInRow.
+/// План передаётся снаружи, чтобы полосы изображения, обрабатываемые разными потоками,
+/// делились на блоки БПФ так же, как всё изображение.
+/// </summary>
+template<class Px>
+void FilterImageWithFft(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const Kernel& kernel,
+	const FftBandPlan& plan)
+{
+	const int imageWidthPx = info.imageWidthPx;
+	const int imageHeightPx = info.imageHeightPx;
+	const int verticalRadius = kernel.VerticalRadius();
+	const int horizontalRadius = kernel.HorizontalRadius();
+	const int overlapRowsCount = kernel.Height() - 1;
+
+	FftConvolver convolver(kernel, plan);
+
+	const int fftWidth = convolver.Plan().fftWidth;
+	const int fftHeight = convolver.Plan().fftHeight;
+	const int bandRowsCount = convolver.Plan().bandRowsCount;
+	const size_t planeSize = (size_t)fftWidth * fftHeight;
+
+	// Последняя строка изображения, ещё нужная нижним отражённым строкам окна
+	const int lastNeededRow = imageHeightPx - 1 + kernel.Height() - 1 - verticalRadius;
+
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+	vector<float> inputPlanes(planeSize * Px::ChannelCount);
+	vector<float> outputPlane(planeSize);
+
+	for (int firstOutputRow = 0; firstOutputRow < imageHeightPx; firstOutputRow += bandRowsCount)
+	{
+		// Строка входа r полосы соответствует строке изображения firstInputRow + r
+		int firstInputRow = firstOutputRow - verticalRadius;
+		int firstNewRow = 0;
+
+		// Перекрытие с предыдущей полосой
+		if (firstOutputRow != 0)
+		{
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				float* plane = &inputPlanes[planeSize * c];
+
+				std::copy(
+					plane + (size_t)bandRowsCount * fftWidth,
+					plane + (size_t)(bandRowsCount + overlapRowsCount) * fftWidth,
+					plane);
+			}
+
+			firstNewRow = overlapRowsCount;
+		}
+
+		for (int r = firstNewRow; r < fftHeight; r++)
+		{
+			int imageY = firstInputRow + r;
+
+			// Верхние отражённые строки заполняются после чтения своих оригиналов
+			if (imageY < 0)
+			{
+				continue;
+			}
+
+			if (imageY < imageHeightPx)
+			{
+				src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+				src.ignore(info.paddingBytesCount);
+
+				for (int c = 0; c < Px::ChannelCount; c++)
+				{
+					float* row = &inputPlanes[planeSize * c + (size_t)r * fftWidth];
+
+					for (int x = 0; x < imageWidthPx + horizontalRadius * 2; x++)
+					{
+						row[x] = srcRowBuffer[
+							(size_t)MirrorIndex(x - horizontalRadius, imageWidthPx) * Px::BytePerPx + c];
+					}
+				}
+			}
+			else
+			{
+				// Нижнее отражение - копия уже прочитанной строки этой же полосы
+				int sourceR = imageY <= lastNeededRow
+					? MirrorIndex(imageY, imageHeightPx) - firstInputRow
+					: -1;
+
+				for (int c = 0; c < Px::ChannelCount; c++)
+				{
+					float* plane = &inputPlanes[planeSize * c];
+
+					if (sourceR >= 0)
+					{
+						std::copy(
+							plane + (size_t)sourceR * fftWidth,
+							plane + (size_t)(sourceR + 1) * fftWidth,
+							plane + (size_t)r * fftWidth);
+					}
+					else
+					{
+						std::fill(
+							plane + (size_t)r * fftWidth,
+							plane + (size_t)(r + 1) * fftWidth,
+							0.f);
+					}
+				}
+			}
+		}
+
+		// Верхнее отражение есть только в первой полосе
+		for (int r = 0; r < verticalRadius && firstInputRow + r < 0; r++)
+		{
+			int sourceR = MirrorIndex(firstInputRow + r, imageHeightPx) - firstInputRow;
+
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				float* plane = &inputPlanes[planeSize * c];
+
+				std::copy(
+					plane + (size_t)sourceR * fftWidth,
+					plane + (size_t)(sourceR + 1) * fftWidth,
+					plane + (size_t)r * fftWidth);
+			}
+		}
+
+		int outputRowsCount = std::min(bandRowsCount, imageHeightPx - firstOutputRow);
+		uint8_t* destRows = dest.Rows(firstOutputRow, outputRowsCount);
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			convolver.Correlate(&inputPlanes[planeSize * c], outputPlane.data());
+
+			for (int r = 0; r < outputRowsCount; r++)
+			{
+				uint8_t* destRow = destRows + (size_t)info.rowStrideBytes * r;
+				const float* row = &outputPlane[(size_t)fftWidth * r];
+
+				for (int x = 0; x < imageWidthPx; x++)
+				{
+					destRow[x * Px::BytePerPx + c] = (uint8_t)std::clamp(row[x] + 0.5f, 0.f, 255.f);
+				}
+			}
+		}
+
+		dest.CommitRows();
+	}
+}
@@ -0,0 +1,487 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Kernel.h"
+#include "KernelDecomposition.h"
+#include "KernelQuantization.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "RowRing.h"
+#include "SimdConvolution.h"
+#include "FilterFunctions.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "BandFiltering.h"
+#include "CacheSize.h"
+
+using std::vector;
+
+/// <summary>
+/// Что записывает банк фильтров.
+/// </summary>
+enum class FilterBankOutput
+{
+	// Отклик каждого ядра в своё изображение
+	Responses,
+
+	// Два изображения: наибольший из откликов ядер (после округления и ограничения [0, 255])
+	// и номер первого ядра, давшего его, по каждому каналу
+	MaxResponse
+};
+
+// Номер ядра в карте номеров занимает байт
+const int MaxFilterBankResponseKernels = 256;
+
+// Горизонтальные ядра, совпадающие с точностью до множителя с этой долей
+// наибольшего по модулю коэффициента, считаются одним проходом
+const float SharedPassTolerance = 1e-5f;
+
+/// <summary>
+/// Слагаемое разделимого члена банка: горизонтальная свёртка общим проходом passIndex,
+/// затем вертикальная kernelY.
+/// </summary>
+struct FilterBankTerm
+{
+	int passIndex;
+	Kernel kernelY;
+};
+
+/// <summary>
+/// Ядро банка и способ его свёртки: Direct, FixedPoint или Separable.
+/// </summary>
+struct FilterBankMember
+{
+	Kernel kernel;
+	ConvolutionMethod method;
+
+	// FixedPoint: пары коэффициентов для ConvolveRowsFixedPoint
+	vector<int32_t> coefficientPairs;
+	int shift = 0;
+
+	// Separable
+	vector<FilterBankTerm> terms;
+};
+
+/// <summary>
+/// Банк фильтров: члены, общие горизонтальные проходы разделимых членов и объединённое окно.
+/// Окно выходной строки y - строки [y - verticalRadius, y - verticalRadius + windowHeight),
+/// строки источника расширены на horizontalRadius пикселей с каждой стороны. Ядра выровнены
+/// по центрам: окно члена с радиусом VerticalRadius() начинается на verticalRadius - VerticalRadius()
+/// строк ниже, его строки - на horizontalRadius - HorizontalRadius() пикселей правее.
+/// </summary>
+struct FilterBankPlan
+{
+	vector<FilterBankMember> members;
+	vector<Kernel> horizontalPasses;
+
+	int verticalRadius = 0;
+	int horizontalRadius = 0;
+	int windowHeight = 1;
+};
+
+/// <summary>
+/// Номер прохода, равного kernelX с точностью до множителя, или -1.
+/// scale - множитель: kernelX ~ scale * проход.
+/// </summary>
+inline int FindSharedPass(const vector<Kernel>& passes, const Kernel& kernelX, float& scale)
+{
+	const float* coefficients = kernelX.Data();
+	int peak = (int)(std::max_element(coefficients, coefficients + kernelX.Width(),
+		[](float a, float b) { return std::abs(a) < std::abs(b); }) - coefficients);
+
+	float tolerance = SharedPassTolerance * std::abs(coefficients[peak]);
+
+	for (int p = 0; p < (int)passes.size(); p++)
+	{
+		const float* pass = passes[p].Data();
+
+		if (passes[p].Width() != kernelX.Width() || pass[peak] == 0)
+		{
+			continue;
+		}
+
+		// Знак слагаемого разложения произволен, множитель может быть отрицательным
+		scale = coefficients[peak] / pass[peak];
+
+		bool isEqual = true;
+
+		for (int j = 0; j < kernelX.Width() && isEqual; j++)
+		{
+			isEqual = std::abs(coefficients[j] - scale * pass[j]) <= tolerance;
+		}
+
+		if (isEqual)
+		{
+			return p;
+		}
+	}
+
+	return -1;
+}
+
+/// <summary>
+/// Способы свёртки членов банка по той же оценке умножений на пиксель, что у одиночного
+/// FilterImage, без БПФ: все члены считаются по одному кольцу строк. Горизонтальные ядра
+/// разделимых членов, равные с точностью до множителя, сводятся к одному проходу - множитель
+/// переносится в вертикальное ядро, и производные одного сглаживания (Gx, Gy, Gxx, ...)
+/// делят свёртки строк.
+/// </summary>
+inline FilterBankPlan PlanFilterBank(const vector<Kernel>& kernels, int imageWidthPx, int imageHeightPx)
+{
+	FilterBankPlan plan;
+	int rowsBelowCount = 0;
+
+	for (const Kernel& kernel : kernels)
+	{
+		plan.verticalRadius = std::max(plan.verticalRadius, kernel.VerticalRadius());
+		plan.horizontalRadius = std::max(plan.horizontalRadius, kernel.HorizontalRadius());
+		rowsBelowCount = std::max(rowsBelowCount, kernel.Height() - kernel.VerticalRadius());
+
+		vector<SeparableTerm> terms = DecomposeKernel(kernel);
+		std::optional<QuantizedKernel> quantized = QuantizeKernel(kernel);
+
+		ConvolutionMethod method = ChooseConvolutionMethod(kernel, terms.size(),
+			PlanFftBands(kernel, imageWidthPx, imageHeightPx), imageWidthPx, quantized.has_value(), false);
+
+		FilterBankMember member{ kernel, method, {}, 0, {} };
+
+		if (member.method == ConvolutionMethod::FixedPoint)
+		{
+			member.coefficientPairs = PackCoefficientPairs(
+				quantized->coefficients.data(), kernel.Height(), kernel.Width());
+			member.shift = quantized->shift;
+		}
+		else if (member.method == ConvolutionMethod::Separable)
+		{
+			for (const SeparableTerm& term : terms)
+			{
+				float scale;
+				int passIndex = FindSharedPass(plan.horizontalPasses, term.kernelX, scale);
+
+				// Первое ядро прохода записывается как есть
+				if (passIndex < 0)
+				{
+					scale = 1;
+					passIndex = (int)plan.horizontalPasses.size();
+					plan.horizontalPasses.push_back(term.kernelX);
+				}
+
+				vector<float> kernelY(term.kernelY.Data(), term.kernelY.Data() + term.kernelY.Height());
+
+				for (float& coefficient : kernelY)
+				{
+					coefficient *= scale;
+				}
+
+				member.terms.push_back({ passIndex, Kernel(term.kernelY.Height(), 1, std::move(kernelY)) });
+			}
+		}
+
+		plan.members.push_back(std::move(member));
+	}
+
+	plan.windowHeight = plan.verticalRadius + rowsBelowCount;
+
+	return plan;
+}
+
+/// <summary>
+/// Все ядра банка за одно чтение источника. Расширенные строки источника лежат в одном кольце,
+/// их горизонтальные свёртки общими проходами - в кольце float той же высоты: проходу p
+/// отведены значения [p * rowWidth, (p + 1) * rowWidth) строки, каналы - отдельными плоскостями.
+/// Выходные строки считаются блоками по полосам столбцов (PlanConvolutionTiles по объединённому
+/// окну), и полоса проходит через все ядра, пока её строки в кэше.
+/// </summary>
+template<class Px, class Border>
+void ApplyFilterBank(
+	std::istream& src,
+	const vector<BmpRowWriter*>& dests,
+	const BmpImageInfo& info,
+	const FilterBankPlan& plan,
+	FilterBankOutput output)
+{
+	const int imageWidthPx = info.imageWidthPx;
+	const int rowWidth = imageWidthPx * Px::ChannelCount;
+	const int horizontalRadius = plan.horizontalRadius;
+	const int windowHeight = plan.windowHeight;
+	const int membersCount = (int)plan.members.size();
+	const int passesCount = (int)plan.horizontalPasses.size();
+
+	// Длина расширенной краевыми пикселями строки
+	int expandedWidthPx = imageWidthPx + horizontalRadius * 2;
+	int expandedWidthBytes = expandedWidthPx * Px::BytePerPx;
+
+	// Столбец полосы занимает в кэше байты строки источника и float всех проходов
+	ConvolutionTilePlan tiles = PlanConvolutionTiles(windowHeight, horizontalRadius * 2 + 1, imageWidthPx,
+		info.imageHeightPx, Px::BytePerPx + passesCount * Px::ChannelCount * (int)sizeof(float), L2CacheBytes());
+
+	int blockRowsCount = tiles.blockRowsCount;
+
+	RowRing<uint8_t, Border> rows(expandedWidthBytes, info.imageHeightPx, windowHeight, blockRowsCount - 1);
+	std::optional<RowRing<float, Border>> passRows;
+
+	if (passesCount > 0)
+	{
+		passRows.emplace(rowWidth * passesCount, info.imageHeightPx, windowHeight, blockRowsCount - 1);
+	}
+
+	vector<float> expandedPlanes((size_t)expandedWidthPx * Px::ChannelCount);
+	vector<float> outputPlanes(rowWidth);
+
+	// Окна членов по строкам блока: строки источника, сдвинутые к ядру члена, и строки проходов
+	vector<const uint8_t*> windows((size_t)windowHeight);
+	vector<const uint8_t*> memberWindows((size_t)blockRowsCount * membersCount * windowHeight);
+	vector<const float*> passWindows((size_t)blockRowsCount * windowHeight);
+	vector<const float*> windowPlanes(windowHeight);
+	vector<const uint8_t*> tileWindow(windowHeight);
+
+	// Отклик члена перед сравнением с наибольшим
+	vector<uint8_t> responseRow(output == FilterBankOutput::MaxResponse ? info.imageWidthBytes : 0);
+	vector<uint8_t*> destRows(dests.size());
+
+	for (int firstY = 0; firstY < info.imageHeightPx; firstY += blockRowsCount)
+	{
+		int rowsCount = std::min(blockRowsCount, info.imageHeightPx - firstY);
+		int firstWindowRow = firstY - plan.verticalRadius;
+
+		while (!rows.HasWindow(firstWindowRow, windowHeight + rowsCount - 1))
+		{
+			uint8_t* expandedRow = rows.AppendRow();
+
+			src.read((char*)expandedRow + horizontalRadius * Px::BytePerPx, info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+
+			ExpandRowEdges<Px, Border>(expandedRow, imageWidthPx, horizontalRadius);
+
+			if (passesCount == 0)
+			{
+				continue;
+			}
+
+			// Строка раскладывается по плоскостям один раз на все проходы
+			float* passRow = passRows->AppendRow();
+
+			DeinterleaveRow<Px>(expandedRow, expandedPlanes.data(), expandedWidthPx, expandedWidthPx);
+
+			for (int p = 0; p < passesCount; p++)
+			{
+				const Kernel& pass = plan.horizontalPasses[p];
+
+				for (int c = 0; c < Px::ChannelCount; c++)
+				{
+					ConvolvePlaneX(
+						expandedPlanes.data() + (size_t)c * expandedWidthPx + (horizontalRadius - pass.HorizontalRadius()),
+						passRow + (size_t)p * rowWidth + (size_t)c * imageWidthPx,
+						pass.Data(),
+						pass.Width(),
+						imageWidthPx);
+				}
+			}
+		}
+
+		for (int b = 0; b < rowsCount; b++)
+		{
+			rows.Window(firstWindowRow + b, windowHeight, windows.data());
+
+			for (int k = 0; k < membersCount; k++)
+			{
+				const Kernel& kernel = plan.members[k].kernel;
+				const uint8_t** memberWindow = &memberWindows[((size_t)b * membersCount + k) * windowHeight];
+
+				for (int i = 0; i < kernel.Height(); i++)
+				{
+					memberWindow[i] = windows[plan.verticalRadius - kernel.VerticalRadius() + i] +
+						(horizontalRadius - kernel.HorizontalRadius()) * Px::BytePerPx;
+				}
+			}
+
+			if (passesCount > 0)
+			{
+				passRows->Window(firstWindowRow + b, windowHeight, &passWindows[(size_t)b * windowHeight]);
+			}
+		}
+
+		for (size_t d = 0; d < dests.size(); d++)
+		{
+			destRows[d] = dests[d]->Rows(firstY, rowsCount);
+		}
+
+		for (int firstX = 0; firstX < imageWidthPx; firstX += tiles.tileWidthPx)
+		{
+			int endX = std::min(firstX + tiles.tileWidthPx, imageWidthPx);
+			size_t firstByte = (size_t)firstX * Px::BytePerPx;
+			size_t endByte = (size_t)endX * Px::BytePerPx;
+
+			for (int b = 0; b < rowsCount; b++)
+			{
+				for (int k = 0; k < membersCount; k++)
+				{
+					const FilterBankMember& member = plan.members[k];
+					const uint8_t* const* memberWindow = &memberWindows[((size_t)b * membersCount + k) * windowHeight];
+
+					uint8_t* destRow = output == FilterBankOutput::Responses
+						? destRows[k] + (size_t)b * info.rowStrideBytes
+						: responseRow.data();
+
+					switch (member.method)
+					{
+					case ConvolutionMethod::Separable:
+					{
+						int kernelHeight = member.kernel.Height();
+						const float* const* passWindow =
+							&passWindows[(size_t)b * windowHeight + plan.verticalRadius - member.kernel.VerticalRadius()];
+
+						for (int c = 0; c < Px::ChannelCount; c++)
+						{
+							std::fill_n(outputPlanes.data() + (size_t)c * imageWidthPx + firstX, endX - firstX, 0.f);
+						}
+
+						// Свёртка по вертикали каждого слагаемого
+						for (const FilterBankTerm& term : member.terms)
+						{
+							for (int c = 0; c < Px::ChannelCount; c++)
+							{
+								size_t planeOffset = (size_t)term.passIndex * rowWidth + (size_t)c * imageWidthPx + firstX;
+
+								for (int i = 0; i < kernelHeight; i++)
+								{
+									windowPlanes[i] = passWindow[i] + planeOffset;
+								}
+
+								AccumulatePlaneY(
+									windowPlanes.data(),
+									term.kernelY.Data(),
+									kernelHeight,
+									outputPlanes.data() + (size_t)c * imageWidthPx + firstX,
+									endX - firstX);
+							}
+						}
+
+						InterleaveRow<Px>(outputPlanes.data() + firstX, imageWidthPx, destRow + firstByte, endX - firstX);
+						break;
+					}
+
+					case ConvolutionMethod::FixedPoint:
+						ConvolveSpanFixedPoint<Px>(memberWindow, member.coefficientPairs.data(),
+							member.kernel.Height(), member.kernel.Width(), member.shift,
+							firstX, endX, destRow, tileWindow.data());
+						break;
+
+					default:
+						ConvolveSpan<Px>(memberWindow, member.kernel, firstX, endX, destRow);
+						break;
+					}
+
+					if (output == FilterBankOutput::MaxResponse)
+					{
+						uint8_t* maxRow = destRows[0] + (size_t)b * info.rowStrideBytes;
+						uint8_t* argmaxRow = destRows[1] + (size_t)b * info.rowStrideBytes;
+
+						for (size_t n = firstByte; n < endByte; n++)
+						{
+							if (k == 0 || responseRow[n] > maxRow[n])
+							{
+								maxRow[n] = responseRow[n];
+								argmaxRow[n] = (uint8_t)k;
+							}
+						}
+					}
+				}
+			}
+		}
+
+		for (BmpRowWriter* dest : dests)
+		{
+			dest->CommitRows();
+		}
+	}
+}
+
+/// <summary>
+/// Свёртка источника всеми kernels за одно чтение. Responses: destPaths[k] - отклик kernels[k],
+/// MaxResponse: destPaths = { наибольший отклик, номер ядра }. Отклик каждого ядра совпадает
+/// с FilterImage с тем же ядром с точностью до уровня яркости (способы свёртки могут отличаться).
+/// </summary>
+void ApplyFilterBank(
+	const SourceImage& srcPath,
+	const vector<std::filesystem::path>& destPaths,
+	const vector<Kernel>& kernels,
+	FilterBankOutput output = FilterBankOutput::Responses,
+	BorderMode border = BorderMode::Mirror,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	if (kernels.empty())
+	{
+		throw std::invalid_argument("Банк фильтров не содержит ядер");
+	}
+	if (destPaths.size() != (output == FilterBankOutput::Responses ? kernels.size() : 2))
+	{
+		throw std::invalid_argument("Число выходных изображений не соответствует банку фильтров");
+	}
+	if (output == FilterBankOutput::MaxResponse && (int)kernels.size() > MaxFilterBankResponseKernels)
+	{
+		throw std::invalid_argument("Номер ядра не помещается в карту номеров");
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	for (const Kernel& kernel : kernels)
+	{
+		if (kernel.HorizontalRadius() > info.imageWidthPx ||
+			kernel.VerticalRadius() > info.imageHeightPx)
+		{
+			throw std::invalid_argument("Изображение слишком мало");
+		}
+	}
+
+	FilterBankPlan plan = PlanFilterBank(kernels, info.imageWidthPx, info.imageHeightPx);
+
+	vector<std::unique_ptr<BmpOutputFile>> destFiles;
+	vector<BmpOutputFile*> destFilePointers;
+
+	for (const std::filesystem::path& destPath : destPaths)
+	{
+		destFiles.push_back(std::make_unique<BmpOutputFile>(
+			destPath,
+			BmpImageInfoBytes(info),
+			info.imageWidthBytes,
+			info.rowStrideBytes,
+			info.imageHeightPx,
+			backend));
+		destFilePointers.push_back(destFiles.back().get());
+	}
+
+	// Периодической границе нужен противоположный край изображения, полосы его не видят
+	if (border == BorderMode::Wrap)
+	{
+		threadsCount = 1;
+	}
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			DispatchBorderMode(border, [&](auto borderPolicy)
+				{
+					FilterInBands(srcPath, src, destFilePointers, info,
+						KernelBandHalo(plan.windowHeight, plan.verticalRadius), threadsCount,
+						[&](std::istream& bandSrc, const vector<BmpRowWriter*>& bandDests, const BmpImageInfo& bandInfo)
+						{
+							ApplyFilterBank<decltype(format), decltype(borderPolicy)>(
+								bandSrc, bandDests, bandInfo, plan, output);
+						});
+				});
+		});
+}
@@ -5,401 +5,859 @@
 #include <vector>
 #include <numeric>
 #include <numbers>
+#include <algorithm>
+#include <cmath>
+#include <array>
+#include <type_traits>
+#include <optional>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <system_error>
 
 #include "Kernel.h"
+#include "FixedKernel.h"
+#include "KernelDecomposition.h"
+#include "KernelQuantization.h"
 #include "BmpHeader.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "RowRing.h"
+#include "SimdConvolution.h"
+#include "LinearlySeparableFiltering.h"
+#include "BoxBlurringFunctions.h"
+#include "FftFiltering.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "BandFiltering.h"
+#include "CacheSize.h"
+#include "ConvolutionMethod.h"
+#include "ConvolutionTuning.h"
 
 using std::vector;
 
-const int BytePerPx = 3;
+// Доля L2 под строки плитки: остальное занимают ядро, выходные строки и соседи по ядру процессора
+const double TileCacheShare = 0.5;
 
-void MirrorEdgePixelsInRow(
-	vector<uint8_t>& expandedRows,
-	int rowIndex,
+// Более узкие плитки теряют больше на перекрытии ореолов, чем выигрывают на кэше
+const int MinTileWidthPx = 64;
+
+// Ширина плитки кратна 16 пикселям, чтобы векторные проходы не дробились на хвосты
+const int TileWidthAlignmentPx = 16;
+
+// Больше выходных строк на блок почти не уменьшает чтение строк окна из памяти
+const int MaxTileBlockRowsCount = 32;
+
+/// <summary>
+/// Разбиение прямой свёртки на плитки: блок из blockRowsCount выходных строк
+/// считается полосами столбцов шириной tileWidthPx.
+/// </summary>
+struct ConvolutionTilePlan
+{
+	int blockRowsCount;
+	int tileWidthPx;
+};
+
+/// <summary>
+/// Подбирает плитки прямой свёртки ядром kernelHeight x kernelWidth под кэш cacheBytes.
+/// Пока kernelHeight расширенных строк помещаются в кэш, строки окна переиспользуются
+/// следующей выходной строкой и плитки не нужны. Иначе блок из K выходных строк считается
+/// полосами столбцов: строки полосы с ореолом ядра, (kernelHeight + K - 1) x (tileWidthPx + kernelWidth - 1)
+/// пикселей, остаются в кэше на все K строк блока, и каждая строка источника читается
+/// из памяти примерно (kernelHeight + K - 1) / K раз вместо kernelHeight.
+/// </summary>
+inline ConvolutionTilePlan PlanConvolutionTiles(
+	int kernelHeight,
+	int kernelWidth,
 	int imageWidthPx,
-	const Kernel& kernel)
+	int imageHeightPx,
+	int bytePerPx,
+	size_t cacheBytes)
 {
-	int expandedWidthBytes = expandedRows.size() / kernel.Height();
-	int currentRowIndexBytes = expandedWidthBytes * rowIndex;
+	const double budgetBytes = cacheBytes * TileCacheShare;
+	const int haloWidthPx = kernelWidth - 1;
 
-	// Ось отражения - нулевой пиксель, у расширенной строки
-	// его индекс = kernel.HorizontalRadius
-	// Левый край
-	for (int x = 0; x < kernel.HorizontalRadius(); x++)
+	if ((double)kernelHeight * (imageWidthPx + haloWidthPx) * bytePerPx <= budgetBytes)
 	{
-		int mirrorX = kernel.HorizontalRadius() * 2 - 1 - x;
+		return { 1, imageWidthPx };
+	}
 
-		expandedRows[currentRowIndexBytes + x * BytePerPx] =
-			expandedRows[currentRowIndexBytes + mirrorX * BytePerPx];
+	auto tileWidthFor = [&](int blockRowsCount)
+		{
+			double rowsCount = kernelHeight + blockRowsCount - 1;
+			return (int)std::min<double>(budgetBytes / (rowsCount * bytePerPx) - haloWidthPx, imageWidthPx);
+		};
 
-		expandedRows[currentRowIndexBytes + x * BytePerPx + 1] =
-			expandedRows[currentRowIndexBytes + mirrorX * BytePerPx + 1];
+	int blockRowsCount = std::clamp(std::min(kernelHeight, imageHeightPx), 1, MaxTileBlockRowsCount);
 
-		expandedRows[currentRowIndexBytes + x * BytePerPx + 2] =
-			expandedRows[currentRowIndexBytes + mirrorX * BytePerPx + 2];
+	// Кэша не хватает на широкие полосы высокого блока - блок укорачивается
+	while (blockRowsCount > 1 && tileWidthFor(blockRowsCount) < MinTileWidthPx)
+	{
+		blockRowsCount /= 2;
 	}
 
-	// Правый край
-	for (int x = imageWidthPx + kernel.HorizontalRadius();
-		x < imageWidthPx + kernel.HorizontalRadius() * 2;
-		x++)
+	int tileWidthPx = std::max(tileWidthFor(blockRowsCount), MinTileWidthPx);
+
+	if (tileWidthPx < imageWidthPx)
 	{
-		int mirrorX = 2 * (imageWidthPx + kernel.HorizontalRadius()) - x - 1;
+		tileWidthPx -= tileWidthPx % TileWidthAlignmentPx;
+	}
+
+	return { blockRowsCount, std::min(tileWidthPx, imageWidthPx) };
+}
+
+/// <summary>
+/// Проход прямой двумерной свёртки. Расширенные по краям строки источника лежат в кольце,
+/// окно строк выходной строки y - виртуальные строки [y - VerticalRadius, y - VerticalRadius + Height).
+/// Выходные строки считаются блоками по плану PlanConvolutionTiles: convolveRow(window, firstX, endX, destRow)
+/// считает пиксели [firstX, endX) строки, блок собирается в строках приёмника по полосам столбцов
+/// и записывается целиком.
+/// </summary>
+template<class Px, class Border, class ConvolveRow>
+void ConvolveRowWindows(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const Kernel& kernel,
+	ConvolveRow&& convolveRow)
+{
+	int imageWidthBytes = info.imageWidthBytes;
+	int paddingBytesCount = info.paddingBytesCount;
+	int horizontalRadius = kernel.HorizontalRadius();
+
+	// Длина расширенной краевыми пикселями строки
+	int expandedWidthBytes = imageWidthBytes + horizontalRadius * 2 * Px::BytePerPx;
+
+	ConvolutionTilePlan plan = PlanConvolutionTiles(
+		kernel.Height(), kernel.Width(), info.imageWidthPx, info.imageHeightPx, Px::BytePerPx, L2CacheBytes());
+
+	// Кольцо держит окна всех строк блока
+	RowRing<uint8_t, Border> rows(expandedWidthBytes, info.imageHeightPx, kernel.Height(), plan.blockRowsCount - 1);
+	vector<const uint8_t*> windows((size_t)plan.blockRowsCount * kernel.Height());
+
+	for (int firstY = 0; firstY < info.imageHeightPx; firstY += plan.blockRowsCount)
+	{
+		int blockRowsCount = std::min(plan.blockRowsCount, info.imageHeightPx - firstY);
+		int firstWindowRow = firstY - kernel.VerticalRadius();
+
+		while (!rows.HasWindow(firstWindowRow, kernel.Height() + blockRowsCount - 1))
+		{
+			uint8_t* expandedRow = rows.AppendRow();
+
+			src.read((char*)expandedRow + horizontalRadius * Px::BytePerPx, imageWidthBytes);
+			src.ignore(paddingBytesCount);
+
+			ExpandRowEdges<Px, Border>(expandedRow, info.imageWidthPx, horizontalRadius);
+		}
+
+		for (int b = 0; b < blockRowsCount; b++)
+		{
+			rows.Window(firstWindowRow + b, kernel.Height(), &windows[(size_t)b * kernel.Height()]);
+		}
 
-		expandedRows[currentRowIndexBytes + x * BytePerPx] =
-			expandedRows[currentRowIndexBytes + mirrorX * BytePerPx];
+		uint8_t* destRows = dest.Rows(firstY, blockRowsCount);
+
+		for (int firstX = 0; firstX < info.imageWidthPx; firstX += plan.tileWidthPx)
+		{
+			int endX = std::min(firstX + plan.tileWidthPx, info.imageWidthPx);
 
-		expandedRows[currentRowIndexBytes + x * BytePerPx + 1] =
-			expandedRows[currentRowIndexBytes + mirrorX * BytePerPx + 1];
+			for (int b = 0; b < blockRowsCount; b++)
+			{
+				convolveRow(&windows[(size_t)b * kernel.Height()], firstX, endX,
+					destRows + (size_t)b * info.rowStrideBytes);
+			}
+		}
 
-		expandedRows[currentRowIndexBytes + x * BytePerPx + 2] =
-			expandedRows[currentRowIndexBytes + mirrorX * BytePerPx + 2];
+		dest.CommitRows();
 	}
 }
 
-void FilterImage(
-	std::filesystem::path srcPath,
-	std::filesystem::path destPath,
-	const Kernel& kernel)
+/// <summary>
+/// Пиксели [firstX, endX) выходной строки прямой свёрткой во float. window - строки окна,
+/// расширенные на HorizontalRadius() пикселей слева.
+/// </summary>
+template<class Px>
+void ConvolveSpan(
+	const uint8_t* const* window,
+	const Kernel& kernel,
+	int firstX,
+	int endX,
+	uint8_t* destRow)
 {
-	std::ifstream src(srcPath, std::ios::binary);
-	if (!src.is_open())
+	for (int x = firstX; x < endX; x++)
 	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + srcPath.string());
+		float sums[Px::ChannelCount]{};
+
+		// Свёртка
+		for (int i = 0; i < kernel.Height(); i++)
+		{
+			for (int j = 0; j < kernel.Width(); j++)
+			{
+				const uint8_t* srcPx = window[i] + (x + j) * Px::BytePerPx;
+
+				for (int c = 0; c < Px::ChannelCount; c++)
+				{
+					sums[c] += kernel(i, j) * srcPx[c];
+				}
+			}
+		}
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			destRow[x * Px::BytePerPx + c] = (uint8_t)std::clamp(sums[c] + 0.5f, 0.f, 255.f);
+		}
 	}
-	std::ofstream dest(destPath, std::ios::binary);
-	if (!dest.is_open())
+}
+
+/// <summary>
+/// Пиксели [firstX, endX) выходной строки прямой свёрткой в целых числах. Каналы пикселей
+/// одного размера чередуются, поэтому строка свёртывается как массив байтов с шагом
+/// отводов BytePerPx. tileWindow - место под kernelHeight указателей окна, сдвинутого к firstX.
+/// </summary>
+template<class Px>
+void ConvolveSpanFixedPoint(
+	const uint8_t* const* window,
+	const int32_t* coefficientPairs,
+	int kernelHeight,
+	int kernelWidth,
+	int shift,
+	int firstX,
+	int endX,
+	uint8_t* destRow,
+	const uint8_t** tileWindow)
+{
+	for (int i = 0; i < kernelHeight; i++)
 	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + destPath.string());
+		tileWindow[i] = window[i] + firstX * Px::BytePerPx;
 	}
 
-	BmpHeader header{};
-	src.read((char*)&header, sizeof(header));
+	ConvolveRowsFixedPoint(tileWindow, coefficientPairs, kernelHeight, kernelWidth,
+		Px::BytePerPx, shift, destRow + firstX * Px::BytePerPx, (endX - firstX) * Px::ChannelCount);
+}
 
-	// Проверка на возможность отражения
-	if (kernel.HorizontalRadius() > header.imageWidthPx ||
-		kernel.VerticalRadius() > header.imageHeightPx)
+/// <summary>
+/// Прямая двумерная свёртка во float.
+/// </summary>
+template<class Px, class Border>
+void FilterImage(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const Kernel& kernel)
+{
+	ConvolveRowWindows<Px, Border>(src, dest, info, kernel,
+		[&](const uint8_t* const* window, int firstX, int endX, uint8_t* destRow)
+		{
+			ConvolveSpan<Px>(window, kernel, firstX, endX, destRow);
+		});
+}
+
+/// <summary>
+/// Прямая двумерная свёртка в целых числах.
+/// </summary>
+template<class Px, class Border>
+void FilterImageFixedPoint(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const Kernel& kernel,
+	const QuantizedKernel& quantized)
+{
+	vector<int32_t> coefficientPairs = PackCoefficientPairs(
+		quantized.coefficients.data(), kernel.Height(), kernel.Width());
+
+	// Окно, сдвинутое к началу полосы столбцов
+	vector<const uint8_t*> tileWindow(kernel.Height());
+
+	ConvolveRowWindows<Px, Border>(src, dest, info, kernel,
+		[&](const uint8_t* const* window, int firstX, int endX, uint8_t* destRow)
+		{
+			ConvolveSpanFixedPoint<Px>(window, coefficientPairs.data(), kernel.Height(), kernel.Width(),
+				quantized.shift, firstX, endX, destRow, tileWindow.data());
+		});
+}
+
+// pmaddwd умножает 16 значений int16 там, где FMA - 8 float
+const double FixedPointCostFactor = 0.5;
+
+/// <summary>
+/// Способ с наименьшей оценкой числа умножений на пиксель. Прямая свёртка считается
+/// в целых числах, если ядро квантуется без потери точности.
+/// </summary>
+inline ConvolutionMethod ChooseConvolutionMethod(
+	const Kernel& kernel,
+	size_t termsCount,
+	const FftBandPlan& fftPlan,
+	int imageWidthPx,
+	bool isFixedPointAccurate,
+	bool isFftAllowed)
+{
+	double directCost = (double)kernel.Height() * kernel.Width();
+	double separableCost = (double)termsCount * (kernel.Height() + kernel.Width());
+	double fftCost = FftOperationsPerPixel(fftPlan, imageWidthPx);
+
+	if (isFixedPointAccurate)
 	{
-		throw std::invalid_argument("Изображение слишком мало");
+		directCost *= FixedPointCostFactor;
 	}
 
-	dest.write((char*)&header, sizeof(header));
+	if (isFftAllowed && fftCost < directCost && fftCost < separableCost)
+	{
+		return ConvolutionMethod::Fft;
+	}
+	if (separableCost < directCost)
+	{
+		return ConvolutionMethod::Separable;
+	}
 
-	int imageWidthBytes = header.imageWidthPx * BytePerPx;
-	int rowStrideBytes = (imageWidthBytes + 3) & ~3;
-	int paddingBytesCount = rowStrideBytes - imageWidthBytes;
+	return isFixedPointAccurate ? ConvolutionMethod::FixedPoint : ConvolutionMethod::Direct;
+}
 
-	// Длина расширенной отражёнными краевыми пикселями строки
-	int expandedWidthBytes = imageWidthBytes + kernel.HorizontalRadius() * 2 * BytePerPx;
+// Допустимое отклонение коэффициентов равномерного окна от 1 / (H * W)
+const float BoxKernelTolerance = 1e-6f;
 
-	vector<uint8_t> srcRowsBufferEx(expandedWidthBytes * kernel.Height());
-	vector<uint8_t> destRowBuffer(rowStrideBytes);
+/// <summary>
+/// Ядро - среднее по окну: все коэффициенты равны 1 / (H * W), и сумма окна
+/// помещается в 32-битные суммы BoxBlur.
+/// </summary>
+inline bool IsBoxKernel(const Kernel& kernel)
+{
+	int64_t area = (int64_t)kernel.Height() * kernel.Width();
 
-	src.seekg(header.imageOffsetBytes);
-	// Формирование первоначального буфера строк с отражением
-	// 1 0 0 1 2
-	for (int bufferY = kernel.VerticalRadius(); bufferY < kernel.Height(); bufferY++)
+	if (area * UINT8_MAX > UINT32_MAX)
 	{
-		int imageY = bufferY - kernel.VerticalRadius();
+		return false;
+	}
 
-		src.read((char*)&srcRowsBufferEx[
-			kernel.HorizontalRadius() * BytePerPx + expandedWidthBytes * bufferY],
-			imageWidthBytes);
-		src.seekg(paddingBytesCount, std::ios_base::cur);
+	float mean = 1.f / area;
 
-		MirrorEdgePixelsInRow(srcRowsBufferEx, bufferY, header.imageWidthPx, kernel);
-	}
+	return std::all_of(kernel.Data(), kernel.Data() + area,
+		[&](float coefficient) { return std::abs(coefficient - mean) <= BoxKernelTolerance * mean; });
+}
 
-	// Отражение
-	for (int bufferY = 0; bufferY < kernel.VerticalRadius(); bufferY++)
+/// <summary>
+/// Свёртка полосы выбранным способом (кроме Auto и Tuned). terms нужны для Separable,
+/// quantized - для FixedPoint, fftPlan - для Fft.
+/// </summary>
+template<class Px, class Border>
+void FilterImage(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const Kernel& kernel,
+	ConvolutionMethod method,
+	const vector<SeparableTerm>& terms,
+	const std::optional<QuantizedKernel>& quantized,
+	const FftBandPlan& fftPlan)
+{
+	switch (method)
 	{
-		int y = 2 * kernel.VerticalRadius() - 1 - bufferY;
+	case ConvolutionMethod::Separable:
+		FilterImage<Px, Border>(src, dest, info, terms);
+		break;
+
+	case ConvolutionMethod::Fft:
+		FilterImageWithFft<Px>(src, dest, info, kernel, fftPlan);
+		break;
+
+	case ConvolutionMethod::FixedPoint:
+		FilterImageFixedPoint<Px, Border>(src, dest, info, kernel, *quantized);
+		break;
+
+	case ConvolutionMethod::Box:
+		BoxBlur<Px, Border>(src, dest, info,
+			Kernel(1, kernel.Width(), vector<float>(kernel.Width(), 1.f / kernel.Width())),
+			Kernel(kernel.Height(), 1, vector<float>(kernel.Height(), 1.f / kernel.Height())));
+		break;
+
+	default:
+		FilterImage<Px, Border>(src, dest, info, kernel);
+		break;
+	}
+}
 
-		std::copy(srcRowsBufferEx.data() + y * expandedWidthBytes,
-			srcRowsBufferEx.data() + (y + 1) * expandedWidthBytes,
-			srcRowsBufferEx.data() + bufferY * expandedWidthBytes);
+/// <summary>
+/// Бросает исключение, если способ method не применим к ядру kernel при границе border.
+/// terms и quantized - разложение и квантование ядра, если способ их требует.
+/// </summary>
+inline void CheckConvolutionMethod(
+	const Kernel& kernel,
+	ConvolutionMethod method,
+	const vector<SeparableTerm>& terms,
+	const std::optional<QuantizedKernel>& quantized,
+	BorderMode border)
+{
+	if (method == ConvolutionMethod::Fft && border != BorderMode::Mirror)
+	{
+		throw std::invalid_argument("Свёртка через БПФ поддерживает только отражение краёв");
+	}
+	if (method == ConvolutionMethod::Box && !IsBoxKernel(kernel))
+	{
+		throw std::invalid_argument("Скользящей суммой применяется только равномерное окно");
+	}
+	if (method == ConvolutionMethod::FixedPoint && !quantized)
+	{
+		throw std::invalid_argument("Ядро нельзя применить в целых числах без потери точности");
+	}
+	if (method == ConvolutionMethod::Separable && terms.empty())
+	{
+		throw std::invalid_argument("Ядро не раскладывается на разделимые слагаемые");
 	}
+}
+
+// Замер идёт на изображении не шире MaxTuningWidthPx и не ниже TuningRowsCount строк
+const int MaxTuningWidthPx = 4096;
+const int TuningRowsCount = 64;
+
+// Время способа - наименьшее из TuningRepeatsCount запусков
+const int TuningRepeatsCount = 3;
+
+// Замеряются только способы, оценка которых не больше TuningCostMargin лучших:
+// оценка ошибается в разы, но не на порядок, а медленный способ замерялся бы дольше всех
+const double TuningCostMargin = 4;
+
+// Скользящая сумма стоит несколько сложений на пиксель при любом окне
+const double BoxCostPerPixel = 4;
+
+/// <summary>
+/// Самый быстрый из candidates на шумовом изображении ширины imageWidthPx (не больше MaxTuningWidthPx).
+/// Строки источника лежат в памяти, результат пишется в отображённый временный файл,
+/// как у выходного файла на диске. У каждого замера свой файл, он удаляется и при ошибке.
+/// </summary>
+template<class Px, class Border>
+ConvolutionMethod MeasureFastestMethod(
+	const Kernel& kernel,
+	const vector<SeparableTerm>& terms,
+	const std::optional<QuantizedKernel>& quantized,
+	const vector<ConvolutionMethod>& candidates,
+	int imageWidthPx)
+{
+	BmpImageInfo info = RawImageInfo({
+		std::min(imageWidthPx, MaxTuningWidthPx),
+		std::max(TuningRowsCount, kernel.Height() * 2),
+		Px::BitPerPixel });
 
-	// Индекс первой строки в буфере
-	int firstRowIndex = 0;
-	int oldFirstRowIndex = 0;
-	int bufIndexToCopy = 0;
+	FftBandPlan fftPlan = PlanFftBands(kernel, info.imageWidthPx, info.imageHeightPx);
 
-	for (int y = kernel.VerticalRadius();
-		y < header.imageHeightPx + kernel.VerticalRadius();
-		y++)
+	std::string rows((size_t)info.srcRowStrideBytes * info.imageHeightPx, '\0');
+	std::minstd_rand random(1);
+
+	for (char& value : rows)
 	{
-		int xOffsetPx = 0;
+		value = (char)random();
+	}
 
-		for (int x = kernel.HorizontalRadius();
-			x < header.imageWidthPx + kernel.HorizontalRadius();
-			x++)
-		{
-			float sumB = 0;
-			float sumG = 0;
-			float sumR = 0;
+	std::filesystem::path destPath = TuningBenchmarkPath();
 
-			// Свёртка
-			for (int i = 0; i < kernel.Height(); i++)
+	ConvolutionMethod fastest = candidates[0];
+	double fastestSeconds = std::numeric_limits<double>::infinity();
+	std::error_code error;
+
+	try
+	{
+		for (ConvolutionMethod method : candidates)
+		{
+			for (int r = 0; r < TuningRepeatsCount; r++)
 			{
-				int currentRowIndex = (i + firstRowIndex) % kernel.Height();
+				std::istringstream src(rows);
 
-				for (int j = xOffsetPx; j < xOffsetPx + kernel.Width(); j++)
-				{
-					// kernel(currentRowIndex, j - xOffsetPx)
-					sumB += kernel(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx];
+				BmpOutputFile destFile(
+					destPath,
+					BmpImageInfoBytes(info),
+					info.imageWidthBytes,
+					info.rowStrideBytes,
+					info.imageHeightPx,
+					OutputBackend::MemoryMapped);
+
+				BmpRowWriter dest(destFile);
+
+				auto start = std::chrono::steady_clock::now();
+
+				FilterImage<Px, Border>(src, dest, info, kernel, method, terms, quantized, fftPlan);
+				dest.Flush();
 
-					sumG += kernel(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx + 1];
+				double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-					sumR += kernel(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx + 2];
+				if (seconds < fastestSeconds)
+				{
+					fastest = method;
+					fastestSeconds = seconds;
 				}
 			}
+		}
+	}
+	catch (...)
+	{
+		std::filesystem::remove(destPath, error);
+		throw;
+	}
 
-			destRowBuffer[(x - kernel.HorizontalRadius()) * BytePerPx]
-				= (uint8_t)std::clamp(sumB + 0.5f, 0.f, 255.f);
+	std::filesystem::remove(destPath, error);
 
-			destRowBuffer[(x - kernel.HorizontalRadius()) * BytePerPx + 1]
-				= (uint8_t)std::clamp(sumG + 0.5f, 0.f, 255.f);
+	return fastest;
+}
 
-			destRowBuffer[(x - kernel.HorizontalRadius()) * BytePerPx + 2]
-				= (uint8_t)std::clamp(sumR + 0.5f, 0.f, 255.f);
+/// <summary>
+/// Самый быстрый на этой машине способ свёртки изображения info ядром kernel. Кандидаты -
+/// способы с гарантированной точностью FilterImage (полуразряд плюс ошибки разложения
+/// и квантования): прямая во float и в целых числах, разделимая, БПФ при отражении краёв
+/// и BoxBlur для равномерного окна. Приближённые гауссовы размытия (FastGaussianBlur,
+/// RecursiveGaussianBlur) такой точности не дают и не рассматриваются. Решение замеряется
+/// один раз на ключ ConvolutionTuningKey и берётся из файла решений в следующих запусках.
+/// </summary>
+inline ConvolutionMethod TuneConvolutionMethod(
+	const Kernel& kernel,
+	const vector<SeparableTerm>& terms,
+	const std::optional<QuantizedKernel>& quantized,
+	const FftBandPlan& fftPlan,
+	const BmpImageInfo& info,
+	BorderMode border)
+{
+	bool isBox = IsBoxKernel(kernel);
+
+	ConvolutionTuningKey key{
+		kernel.Height(),
+		kernel.Width(),
+		(int)terms.size(),
+		quantized.has_value(),
+		isBox,
+		(int)border,
+		info.header.bitPerPixel,
+		(int)std::bit_width((unsigned)info.imageWidthPx) };
+
+	if (std::optional<ConvolutionMethod> method = FindTunedMethod(key))
+	{
+		return *method;
+	}
 
-			xOffsetPx++;
-		}
+	// Оценки умножений на пиксель, как у ChooseConvolutionMethod
+	vector<std::pair<ConvolutionMethod, double>> costs{
+		{ ConvolutionMethod::Direct, (double)kernel.Height() * kernel.Width() } };
+
+	if (quantized)
+	{
+		costs.push_back({ ConvolutionMethod::FixedPoint, costs[0].second * FixedPointCostFactor });
+	}
+	if (!terms.empty())
+	{
+		costs.push_back({ ConvolutionMethod::Separable, (double)terms.size() * (kernel.Height() + kernel.Width()) });
+	}
+	if (border == BorderMode::Mirror)
+	{
+		costs.push_back({ ConvolutionMethod::Fft, FftOperationsPerPixel(fftPlan, info.imageWidthPx) });
+	}
+	if (isBox)
+	{
+		costs.push_back({ ConvolutionMethod::Box, BoxCostPerPixel });
+	}
+
+	double bestCost = std::min_element(costs.begin(), costs.end(),
+		[](const auto& a, const auto& b) { return a.second < b.second; })->second;
+
+	vector<ConvolutionMethod> candidates;
 
-		// Чтобы при чётных размерах условие отражение не срабатывало 
-		// на 1 строку раньше и последняя строка тоже обрабатывалась 
-		int imageY = y;
-		if (kernel.Height() % 2 == 0)
+	for (const auto& [method, cost] : costs)
+	{
+		if (cost <= bestCost * TuningCostMargin)
 		{
-			imageY = y - 1;
+			candidates.push_back(method);
 		}
+	}
 
-		// Отражение 
-		if (imageY >= header.imageHeightPx - 1)
-		{
-			if (imageY == header.imageHeightPx - 1)
-			{
-				oldFirstRowIndex = firstRowIndex;
-				bufIndexToCopy = (firstRowIndex + kernel.Height() - 1) % kernel.Height();
-			}
-			if (bufIndexToCopy != firstRowIndex)
-			{
-				std::copy(srcRowsBufferEx.data() + bufIndexToCopy * expandedWidthBytes,
-					srcRowsBufferEx.data() + (bufIndexToCopy + 1) * expandedWidthBytes,
-					srcRowsBufferEx.data() + firstRowIndex * expandedWidthBytes);
-			}
+	ConvolutionMethod method = candidates[0];
 
-			bufIndexToCopy--;
-			if (bufIndexToCopy < 0)
-			{
-				bufIndexToCopy = kernel.Height() - 1;
-			}
+	if (candidates.size() > 1)
+	{
+		try
+		{
+			DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+				{
+					DispatchBorderMode(border, [&](auto borderPolicy)
+						{
+							method = MeasureFastestMethod<decltype(format), decltype(borderPolicy)>(
+								kernel, terms, quantized, candidates, info.imageWidthPx);
+						});
+				});
 		}
-		else
+		catch (const std::exception&)
 		{
-			src.read(
-				(char*)&srcRowsBufferEx[kernel.HorizontalRadius() * BytePerPx
-				+ expandedWidthBytes * firstRowIndex],
-				imageWidthBytes);
-			src.seekg(paddingBytesCount, std::ios_base::cur);
+			// Замер не удался (нет временного каталога или места в нём) - способ выбирается
+			// по оценке, как при Auto, и не запоминается
+			return ChooseConvolutionMethod(kernel, terms.size(), fftPlan, info.imageWidthPx,
+				quantized.has_value(), border == BorderMode::Mirror);
 		}
-		MirrorEdgePixelsInRow(srcRowsBufferEx, firstRowIndex, header.imageWidthPx, kernel);
+	}
 
-		// Вторая становится первой и т.д.
-		firstRowIndex = (firstRowIndex + 1) % kernel.Height();
+	StoreTunedMethod(key, method);
 
-		dest.write((char*)destRowBuffer.data(), rowStrideBytes);
-	}
+	return method;
 }
 
-void ApplySobelOperator(
-	std::filesystem::path srcPath,
-	std::filesystem::path destPath)
+void FilterImage(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	const Kernel& kernel,
+	ConvolutionMethod method = ConvolutionMethod::Auto,
+	BorderMode border = BorderMode::Mirror,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
 {
-	std::ifstream src(srcPath, std::ios::binary);
-	if (!src.is_open())
-	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + srcPath.string());
-	}
-	std::ofstream dest(destPath, std::ios::binary);
-	if (!dest.is_open())
-	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + destPath.string());
-	}
-
-	BmpHeader header{};
-	src.read((char*)&header, sizeof(header));
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
 
-	Kernel gx(3, 3, {
-		-1, 0, 1,
-		-2, 0, 2,
-		-1, 0, 1
-		});
-
-	Kernel gy(3, 3, {
-		 1,  2,  1,
-		 0,  0,  0,
-		-1, -2, -1
-		});
+	BmpImageInfo info = srcFile.Info();
 
 	// Проверка на возможность отражения
-	if (gx.HorizontalRadius() > header.imageWidthPx ||
-		gx.VerticalRadius() > header.imageHeightPx)
+	if (kernel.HorizontalRadius() > info.imageWidthPx ||
+		kernel.VerticalRadius() > info.imageHeightPx)
 	{
 		throw std::invalid_argument("Изображение слишком мало");
 	}
 
-	dest.write((char*)&header, sizeof(header));
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
 
-	int imageWidthBytes = header.imageWidthPx * BytePerPx;
-	int rowStrideBytes = (imageWidthBytes + 3) & ~3;
-	int paddingBytesCount = rowStrideBytes - imageWidthBytes;
+	vector<SeparableTerm> terms;
 
-	// Длина расширенной отражёнными краевыми пикселями строки
-	int expandedWidthBytes = imageWidthBytes + gx.HorizontalRadius() * 2 * BytePerPx;
+	// Ядро малого ранга дешевле применить как сумму разделимых свёрток,
+	// большое ядро полного ранга - через БПФ
+	if (method == ConvolutionMethod::Auto || method == ConvolutionMethod::Tuned ||
+		method == ConvolutionMethod::Separable)
+	{
+		terms = DecomposeKernel(kernel);
+	}
 
-	vector<uint8_t> srcRowsBufferEx(expandedWidthBytes * gx.Height());
-	vector<uint8_t> destRowBuffer(rowStrideBytes);
+	std::optional<QuantizedKernel> quantized;
 
-	src.seekg(header.imageOffsetBytes);
-	// Формирование первоначального буфера строк с отражением
-	// 1 0 0 1 2
-	for (int bufferY = gx.VerticalRadius(); bufferY < gx.Height(); bufferY++)
+	// Ядру, которому не хватает точности int16, остаётся свёртка во float
+	if (method == ConvolutionMethod::Auto || method == ConvolutionMethod::Tuned ||
+		method == ConvolutionMethod::FixedPoint)
 	{
-		int imageY = bufferY - gx.VerticalRadius();
+		quantized = QuantizeKernel(kernel);
+	}
 
-		src.read((char*)&srcRowsBufferEx[
-			gx.HorizontalRadius() * BytePerPx + expandedWidthBytes * bufferY],
-			imageWidthBytes);
-		src.seekg(paddingBytesCount, std::ios_base::cur);
+	FftBandPlan fftPlan = PlanFftBands(kernel, info.imageWidthPx, info.imageHeightPx);
 
-		MirrorEdgePixelsInRow(srcRowsBufferEx, bufferY, header.imageWidthPx, gx);
+	if (method == ConvolutionMethod::Auto)
+	{
+		method = ChooseConvolutionMethod(kernel, terms.size(), fftPlan, info.imageWidthPx,
+			quantized.has_value(), border == BorderMode::Mirror);
 	}
-
-	// Отражение
-	for (int bufferY = 0; bufferY < gx.VerticalRadius(); bufferY++)
+	if (method == ConvolutionMethod::Tuned)
 	{
-		int y = 2 * gx.VerticalRadius() - 1 - bufferY;
+		method = TuneConvolutionMethod(kernel, terms, quantized, fftPlan, info, border);
+	}
+
+	// Решение из файла замеров проверяется так же, как заданный способ
+	CheckConvolutionMethod(kernel, method, terms, quantized, border);
 
-		std::copy(srcRowsBufferEx.data() + y * expandedWidthBytes,
-			srcRowsBufferEx.data() + (y + 1) * expandedWidthBytes,
-			srcRowsBufferEx.data() + bufferY * expandedWidthBytes);
+	// Периодической границе нужен противоположный край изображения, полосы его не видят
+	if (border == BorderMode::Wrap)
+	{
+		threadsCount = 1;
 	}
 
-	// Индекс первой строки в буфере
-	int firstRowIndex = 0;
-	int oldFirstRowIndex = 0;
-	int bufIndexToCopy = 0;
+	BandHalo halo = KernelBandHalo(kernel.Height(), kernel.VerticalRadius());
 
-	for (int y = gx.VerticalRadius();
-		y < header.imageHeightPx + gx.VerticalRadius();
-		y++)
+	// Полосы потоков начинаются с полосы БПФ, первая полоса БПФ потока служит ореолом
+	if (method == ConvolutionMethod::Fft)
 	{
-		int xOffsetPx = 0;
+		halo.topRowsCount = fftPlan.bandRowsCount;
+		halo.alignmentRows = fftPlan.bandRowsCount;
+	}
 
-		for (int x = gx.HorizontalRadius();
-			x < header.imageWidthPx + gx.HorizontalRadius();
-			x++)
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
 		{
-			float xSumB = 0;
-			float xSumG = 0;
-			float xSumR = 0;
+			DispatchBorderMode(border, [&](auto borderPolicy)
+				{
+					FilterInBands(srcPath, src, destFile, info, halo, threadsCount,
+						[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+						{
+							FilterImage<decltype(format), decltype(borderPolicy)>(bandSrc, bandDest, bandInfo,
+								kernel, method, terms, quantized, fftPlan);
+						});
+				});
+		});
+}
 
-			float ySumB = 0;
-			float ySumG = 0;
-			float ySumR = 0;
+/// <summary>
+/// Операторы градиента 3x3, известные как произведение сглаживающего столбца
+/// на строку центральной разности (и транспонированное для производной по y).
+/// </summary>
+enum class GradientOperator
+{
+	Sobel,
+	Scharr
+};
+
+constexpr FixedKernel<1, 3> CentralDifferenceRow{ -1, 0, 1 };
+constexpr FixedKernel<3, 1> CentralDifferenceColumn{ 1, 0, -1 };
+
+constexpr FixedKernel<1, 3> SobelSmoothingRow{ 1, 2, 1 };
+constexpr FixedKernel<3, 1> SobelSmoothingColumn{ 1, 2, 1 };
+
+constexpr FixedKernel<1, 3> ScharrSmoothingRow{ 3, 10, 3 };
+constexpr FixedKernel<3, 1> ScharrSmoothingColumn{ 3, 10, 3 };
+
+static_assert(OuterProduct(SobelSmoothingColumn, CentralDifferenceRow).coefficients ==
+	std::array<float, 9>{ -1, 0, 1, -2, 0, 2, -1, 0, 1 });
+static_assert(OuterProduct(CentralDifferenceColumn, SobelSmoothingRow).coefficients ==
+	std::array<float, 9>{ 1, 2, 1, 0, 0, 0, -1, -2, -1 });
+
+/// <summary>
+/// Модуль градиента с разделимыми ядрами gx = columnX * rowX и gy = columnY * rowY.
+/// Каждая прочитанная строка один раз сворачивается с rowX и rowY, результаты лежат
+/// в кольцах по высоте ядра, вертикальная свёртка берёт строки по отражённым индексам.
+/// Свёртки развёрнуты на этапе компиляции, нулевые коэффициенты пропускаются.
+/// </summary>
+template<class Px, const auto& rowX, const auto& columnX, const auto& rowY, const auto& columnY>
+void ApplyGradientOperator(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info)
+{
+	using RowKernel = std::remove_cvref_t<decltype(rowX)>;
+	using ColumnKernel = std::remove_cvref_t<decltype(columnX)>;
 
-			// Свёртка
-			for (int i = 0; i < gx.Height(); i++)
-			{
-				int currentRowIndex = (i + firstRowIndex) % gx.Height();
+	constexpr int horizontalRadius = RowKernel::HorizontalRadius;
+	constexpr int kernelHeight = ColumnKernel::Height;
+	constexpr int verticalRadius = ColumnKernel::VerticalRadius;
 
-				for (int j = xOffsetPx; j < xOffsetPx + gx.Width(); j++)
-				{
-					xSumB += gx(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx];
+	// У всех форматов канал занимает байт, поэтому соседний пиксель
+	// того же канала отстоит на ChannelCount значений
+	int rowWidth = info.imageWidthPx * Px::ChannelCount;
 
-					xSumG += gx(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx + 1];
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes + horizontalRadius * 2 * Px::BytePerPx);
+	vector<float> rowsX((size_t)kernelHeight * rowWidth);
+	vector<float> rowsY((size_t)kernelHeight * rowWidth);
 
-					xSumR += gx(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx + 2];
+	int readRowsCount = 0;
 
-					ySumB += gy(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx];
+	auto readRow = [&]()
+		{
+			src.read((char*)&srcRowBuffer[horizontalRadius * Px::BytePerPx], info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
 
-					ySumG += gy(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx + 1];
+			MirrorEdgePixelsInRow<Px>(srcRowBuffer.data(), info.imageWidthPx, horizontalRadius);
 
-					ySumR += gy(i, j - xOffsetPx) *
-						srcRowsBufferEx[currentRowIndex * expandedWidthBytes + j * BytePerPx + 2];
-				}
-			}
+			const uint8_t* row = srcRowBuffer.data() + horizontalRadius * Px::BytePerPx;
+			float* convolutedX = &rowsX[(size_t)(readRowsCount % kernelHeight) * rowWidth];
+			float* convolutedY = &rowsY[(size_t)(readRowsCount % kernelHeight) * rowWidth];
 
-			destRowBuffer[(x - gx.HorizontalRadius()) * BytePerPx]
-				= (uint8_t)std::clamp(sqrt(xSumB*xSumB + ySumB*ySumB) + 0.5f, 0.f, 255.f);
+			for (int n = 0; n < rowWidth; n++)
+			{
+				auto load = [&](int, int j) -> float
+					{
+						return row[n + (j - horizontalRadius) * Px::ChannelCount];
+					};
 
-			destRowBuffer[(x - gx.HorizontalRadius()) * BytePerPx + 1]
-				= (uint8_t)std::clamp(sqrt(xSumG * xSumG + ySumG * ySumG) + 0.5f, 0.f, 255.f);
+				convolutedX[n] = CorrelateFixed<rowX>(load);
+				convolutedY[n] = CorrelateFixed<rowY>(load);
+			}
 
-			destRowBuffer[(x - gx.HorizontalRadius()) * BytePerPx + 2]
-				= (uint8_t)std::clamp(sqrt(xSumR * xSumR + ySumR * ySumR) + 0.5f, 0.f, 255.f);
+			readRowsCount++;
+		};
 
-			xOffsetPx++;
+	for (int y = 0; y < info.imageHeightPx; y++)
+	{
+		while (readRowsCount < info.imageHeightPx && readRowsCount <= y + verticalRadius)
+		{
+			readRow();
 		}
 
-		// Чтобы при чётных размерах условие отражение не срабатывало 
-		// на 1 строку раньше и последняя строка тоже обрабатывалась 
-		int imageY = y;
-		if (gx.Height() % 2 == 0)
+		// Кольцо хранит строки [y - verticalRadius, y + verticalRadius],
+		// отражённые индексы у краёв попадают в него же
+		const float* windowX[kernelHeight];
+		const float* windowY[kernelHeight];
+
+		for (int i = 0; i < kernelHeight; i++)
 		{
-			imageY = y - 1;
+			int imageRow = MirrorIndex(y + i - verticalRadius, info.imageHeightPx);
+
+			windowX[i] = &rowsX[(size_t)(imageRow % kernelHeight) * rowWidth];
+			windowY[i] = &rowsY[(size_t)(imageRow % kernelHeight) * rowWidth];
 		}
 
-		// Отражение 
-		if (imageY >= header.imageHeightPx - 1)
+		uint8_t* destRow = dest.Rows(y, 1);
+
+		for (int n = 0; n < rowWidth; n++)
 		{
-			if (imageY == header.imageHeightPx - 1)
-			{
-				oldFirstRowIndex = firstRowIndex;
-				bufIndexToCopy = (firstRowIndex + gx.Height() - 1) % gx.Height();
-			}
-			if (bufIndexToCopy != firstRowIndex)
-			{
-				std::copy(srcRowsBufferEx.data() + bufIndexToCopy * expandedWidthBytes,
-					srcRowsBufferEx.data() + (bufIndexToCopy + 1) * expandedWidthBytes,
-					srcRowsBufferEx.data() + firstRowIndex * expandedWidthBytes);
-			}
+			float gradientX = CorrelateFixed<columnX>([&](int i, int) { return windowX[i][n]; });
+			float gradientY = CorrelateFixed<columnY>([&](int i, int) { return windowY[i][n]; });
 
-			bufIndexToCopy--;
-			if (bufIndexToCopy < 0)
-			{
-				bufIndexToCopy = gx.Height() - 1;
-			}
+			destRow[n] = (uint8_t)std::clamp(
+				std::sqrt(gradientX * gradientX + gradientY * gradientY) + 0.5f, 0.f, 255.f);
 		}
-		else
+
+		dest.CommitRows();
+	}
+}
+
+/// <summary>
+/// Модуль градиента оператором gradientOperator по каждому каналу. У 32-битного изображения четвёртый байт
+/// тоже считается каналом (см. Bgra32): постоянная непрозрачная альфа даёт нулевой градиент.
+/// </summary>
+void ApplyGradientOperator(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	GradientOperator gradientOperator = GradientOperator::Sobel,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
 		{
-			src.read(
-				(char*)&srcRowsBufferEx[gx.HorizontalRadius() * BytePerPx
-				+ expandedWidthBytes * firstRowIndex],
-				imageWidthBytes);
-			src.seekg(paddingBytesCount, std::ios_base::cur);
-		}
-		MirrorEdgePixelsInRow(srcRowsBufferEx, firstRowIndex, header.imageWidthPx, gx);
+			using Px = decltype(format);
 
-		// Вторая становится первой и т.д.
-		firstRowIndex = (firstRowIndex + 1) % gx.Height();
+			FilterInBands(srcPath, src, destFile, info,
+				KernelBandHalo(SobelSmoothingColumn.Height, SobelSmoothingColumn.VerticalRadius), threadsCount,
+				[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+				{
+					if (gradientOperator == GradientOperator::Scharr)
+					{
+						ApplyGradientOperator<Px,
+							CentralDifferenceRow, ScharrSmoothingColumn,
+							ScharrSmoothingRow, CentralDifferenceColumn>(bandSrc, bandDest, bandInfo);
+					}
+					else
+					{
+						ApplyGradientOperator<Px,
+							CentralDifferenceRow, SobelSmoothingColumn,
+							SobelSmoothingRow, CentralDifferenceColumn>(bandSrc, bandDest, bandInfo);
+					}
+				});
+		});
+}
 
-		dest.write((char*)destRowBuffer.data(), rowStrideBytes);
-	}
+void ApplySobelOperator(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	ApplyGradientOperator(srcPath, destPath, GradientOperator::Sobel, backend, threadsCount);
 }
 
 /*
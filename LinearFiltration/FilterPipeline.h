@@ -0,0 +1,672 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "Kernel.h"
+#include "FixedKernel.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "SimdConvolution.h"
+#include "BandFiltering.h"
+#include "FilterFunctions.h"
+#include "SummedAreaTable.h"
+
+using std::vector;
+
+/// <summary>
+/// Расширяет плоскости каналов строки отражёнными краями: плоскость c входа начинается
+/// с c * widthPx, выхода - с c * (widthPx + 2 * horizontalRadius).
+/// </summary>
+inline void MirrorEdgesInPlanes(
+	const float* row,
+	float* expandedRow,
+	int widthPx,
+	int channelCount,
+	int horizontalRadius)
+{
+	int expandedWidth = widthPx + 2 * horizontalRadius;
+
+	for (int c = 0; c < channelCount; c++)
+	{
+		const float* plane = row + (size_t)c * widthPx;
+		float* expandedPlane = expandedRow + (size_t)c * expandedWidth;
+
+		for (int x = 0; x < expandedWidth; x++)
+		{
+			expandedPlane[x] = plane[MirrorIndex(x - horizontalRadius, widthPx)];
+		}
+	}
+}
+
+/// <summary>
+/// Построчный оператор конвейера фильтров. Строки входа и выхода - плоскости каналов
+/// float шириной widthPx без округления между операторами. Оператор хранит кольцо
+/// из windowHeight подготовленных строк и выдаёт строку y, как только получил строку
+/// y + windowHeight - 1 - verticalRadius (или последнюю), края отражаются, как у Kernel.
+/// </summary>
+class PipelineStage
+{
+private:
+	int windowHeight_;
+	int verticalRadius_;
+	int horizontalRadius_;
+
+	vector<float> rows_;
+	vector<float> outputRow_;
+	vector<const float*> window_;
+
+	int pushedRowsCount_ = 0;
+	int emittedRowsCount_ = 0;
+
+protected:
+	int widthPx_ = 0;
+	int heightPx_ = 0;
+	int channelCount_ = 0;
+
+	PipelineStage(int windowHeight, int verticalRadius, int horizontalRadius)
+		: windowHeight_(windowHeight),
+		verticalRadius_(verticalRadius),
+		horizontalRadius_(horizontalRadius)
+	{
+	}
+
+	/// <summary>
+	/// Длина плоскости канала в строке кольца.
+	/// </summary>
+	virtual int SlotPlaneWidth() const
+	{
+		return widthPx_;
+	}
+
+	/// <summary>
+	/// Подготавливает входную строку к хранению в кольце (плоскость c слота с c * SlotPlaneWidth()).
+	/// </summary>
+	virtual void StoreRow(const float* row, float* slot) = 0;
+
+	/// <summary>
+	/// Выходная строка по windowHeight строкам кольца, отражённым у краёв.
+	/// </summary>
+	virtual void ComputeRow(const float* const* window, float* output) = 0;
+
+public:
+	virtual ~PipelineStage() = default;
+
+	/// <summary>
+	/// Копия оператора с начальным состоянием - каждой полосе изображения своя.
+	/// </summary>
+	virtual std::unique_ptr<PipelineStage> Clone() const = 0;
+
+	int WindowHeight() const noexcept
+	{
+		return windowHeight_;
+	}
+
+	int VerticalRadius() const noexcept
+	{
+		return verticalRadius_;
+	}
+
+	int HorizontalRadius() const noexcept
+	{
+		return horizontalRadius_;
+	}
+
+	virtual void Start(int widthPx, int heightPx, int channelCount)
+	{
+		widthPx_ = widthPx;
+		heightPx_ = heightPx;
+		channelCount_ = channelCount;
+
+		rows_.assign((size_t)windowHeight_ * SlotPlaneWidth() * channelCount, 0.f);
+		outputRow_.assign((size_t)widthPx * channelCount, 0.f);
+		window_.assign(windowHeight_, nullptr);
+
+		pushedRowsCount_ = 0;
+		emittedRowsCount_ = 0;
+	}
+
+	void Push(const float* row)
+	{
+		size_t slotLength = (size_t)SlotPlaneWidth() * channelCount_;
+
+		StoreRow(row, &rows_[(size_t)(pushedRowsCount_ % windowHeight_) * slotLength]);
+		pushedRowsCount_++;
+	}
+
+	/// <summary>
+	/// Следующая выходная строка или nullptr, если для неё получено ещё не всё окно.
+	/// Строка действительна до следующего вызова.
+	/// </summary>
+	const float* TryEmit()
+	{
+		int y = emittedRowsCount_;
+
+		if (y == heightPx_ ||
+			(pushedRowsCount_ < heightPx_ &&
+				pushedRowsCount_ <= y + windowHeight_ - 1 - verticalRadius_))
+		{
+			return nullptr;
+		}
+
+		size_t slotLength = (size_t)SlotPlaneWidth() * channelCount_;
+
+		for (int i = 0; i < windowHeight_; i++)
+		{
+			int imageRow = MirrorIndex(y + i - verticalRadius_, heightPx_);
+
+			window_[i] = &rows_[(size_t)(imageRow % windowHeight_) * slotLength];
+		}
+
+		ComputeRow(window_.data(), outputRow_.data());
+		emittedRowsCount_++;
+
+		return outputRow_.data();
+	}
+};
+
+/// <summary>
+/// Свёртка с произвольным двумерным ядром: каждая строка ядра - векторная свёртка по X.
+/// </summary>
+class ConvolutionStage : public PipelineStage
+{
+private:
+	Kernel kernel_;
+	vector<float> convolutedRow_;
+
+protected:
+	int SlotPlaneWidth() const override
+	{
+		return widthPx_ + 2 * kernel_.HorizontalRadius();
+	}
+
+	void StoreRow(const float* row, float* slot) override
+	{
+		MirrorEdgesInPlanes(row, slot, widthPx_, channelCount_, kernel_.HorizontalRadius());
+	}
+
+	void ComputeRow(const float* const* window, float* output) override
+	{
+		int slotPlaneWidth = SlotPlaneWidth();
+
+		convolutedRow_.resize(widthPx_);
+		std::fill(output, output + (size_t)widthPx_ * channelCount_, 0.f);
+
+		for (int c = 0; c < channelCount_; c++)
+		{
+			float* outputPlane = output + (size_t)c * widthPx_;
+
+			for (int i = 0; i < kernel_.Height(); i++)
+			{
+				ConvolvePlaneX(window[i] + (size_t)c * slotPlaneWidth, convolutedRow_.data(),
+					kernel_.Data() + (size_t)i * kernel_.Width(), kernel_.Width(), widthPx_);
+
+				for (int x = 0; x < widthPx_; x++)
+				{
+					outputPlane[x] += convolutedRow_[x];
+				}
+			}
+		}
+	}
+
+public:
+	explicit ConvolutionStage(const Kernel& kernel)
+		: PipelineStage(kernel.Height(), kernel.VerticalRadius(), kernel.HorizontalRadius()),
+		kernel_(kernel)
+	{
+	}
+
+	std::unique_ptr<PipelineStage> Clone() const override
+	{
+		return std::make_unique<ConvolutionStage>(*this);
+	}
+};
+
+/// <summary>
+/// Разделимая свёртка: строки кольца уже свёрнуты по X, выход - свёртка окна по Y.
+/// Гауссово размытие - ядра GaussianBlurKernel(1, w) и GaussianBlurKernel(h, 1).
+/// </summary>
+class SeparableConvolutionStage : public PipelineStage
+{
+private:
+	Kernel kernelX_;
+	Kernel kernelY_;
+	vector<float> expandedRow_;
+	vector<const float*> planeWindow_;
+
+protected:
+	void StoreRow(const float* row, float* slot) override
+	{
+		int expandedWidth = widthPx_ + 2 * kernelX_.HorizontalRadius();
+
+		expandedRow_.resize((size_t)expandedWidth * channelCount_);
+		MirrorEdgesInPlanes(row, expandedRow_.data(), widthPx_, channelCount_, kernelX_.HorizontalRadius());
+
+		for (int c = 0; c < channelCount_; c++)
+		{
+			ConvolvePlaneX(expandedRow_.data() + (size_t)c * expandedWidth, slot + (size_t)c * widthPx_,
+				kernelX_.Data(), kernelX_.Width(), widthPx_);
+		}
+	}
+
+	void ComputeRow(const float* const* window, float* output) override
+	{
+		planeWindow_.resize(kernelY_.Height());
+		std::fill(output, output + (size_t)widthPx_ * channelCount_, 0.f);
+
+		for (int c = 0; c < channelCount_; c++)
+		{
+			for (int i = 0; i < kernelY_.Height(); i++)
+			{
+				planeWindow_[i] = window[i] + (size_t)c * widthPx_;
+			}
+
+			AccumulatePlaneY(planeWindow_.data(), kernelY_.Data(), kernelY_.Height(),
+				output + (size_t)c * widthPx_, widthPx_);
+		}
+	}
+
+public:
+	SeparableConvolutionStage(const Kernel& kernelX, const Kernel& kernelY)
+		: PipelineStage(kernelY.Height(), kernelY.VerticalRadius(), kernelX.HorizontalRadius()),
+		kernelX_(kernelX),
+		kernelY_(kernelY)
+	{
+		if (kernelX.Height() != 1 || kernelY.Width() != 1)
+		{
+			throw std::invalid_argument("Ядра разделимой свёртки должны быть строкой и столбцом");
+		}
+	}
+
+	std::unique_ptr<PipelineStage> Clone() const override
+	{
+		return std::make_unique<SeparableConvolutionStage>(*this);
+	}
+};
+
+/// <summary>
+/// Модуль градиента оператором Собеля или Шарра. В строке кольца две половины
+/// плоскости: строка, свёрнутая с rowX, и строка, свёрнутая с rowY.
+/// </summary>
+class GradientStage : public PipelineStage
+{
+private:
+	GradientOperator operator_;
+	vector<float> expandedRow_;
+
+	template<const auto& rowX, const auto& rowY>
+	void StoreGradientRow(const float* row, float* slot)
+	{
+		int expandedWidth = widthPx_ + 2;
+
+		expandedRow_.resize((size_t)expandedWidth * channelCount_);
+		MirrorEdgesInPlanes(row, expandedRow_.data(), widthPx_, channelCount_, 1);
+
+		for (int c = 0; c < channelCount_; c++)
+		{
+			const float* expandedPlane = expandedRow_.data() + (size_t)c * expandedWidth;
+			float* convolutedX = slot + (size_t)c * 2 * widthPx_;
+			float* convolutedY = convolutedX + widthPx_;
+
+			for (int x = 0; x < widthPx_; x++)
+			{
+				auto load = [&](int, int j) { return expandedPlane[x + j]; };
+
+				convolutedX[x] = CorrelateFixed<rowX>(load);
+				convolutedY[x] = CorrelateFixed<rowY>(load);
+			}
+		}
+	}
+
+	template<const auto& columnX, const auto& columnY>
+	void ComputeGradientRow(const float* const* window, float* output)
+	{
+		for (int c = 0; c < channelCount_; c++)
+		{
+			size_t offset = (size_t)c * 2 * widthPx_;
+			float* outputPlane = output + (size_t)c * widthPx_;
+
+			for (int x = 0; x < widthPx_; x++)
+			{
+				float gradientX = CorrelateFixed<columnX>([&](int i, int) { return window[i][offset + x]; });
+				float gradientY = CorrelateFixed<columnY>([&](int i, int) { return window[i][offset + widthPx_ + x]; });
+
+				outputPlane[x] = std::sqrt(gradientX * gradientX + gradientY * gradientY);
+			}
+		}
+	}
+
+protected:
+	int SlotPlaneWidth() const override
+	{
+		return 2 * widthPx_;
+	}
+
+	void StoreRow(const float* row, float* slot) override
+	{
+		if (operator_ == GradientOperator::Scharr)
+		{
+			StoreGradientRow<CentralDifferenceRow, ScharrSmoothingRow>(row, slot);
+		}
+		else
+		{
+			StoreGradientRow<CentralDifferenceRow, SobelSmoothingRow>(row, slot);
+		}
+	}
+
+	void ComputeRow(const float* const* window, float* output) override
+	{
+		if (operator_ == GradientOperator::Scharr)
+		{
+			ComputeGradientRow<ScharrSmoothingColumn, CentralDifferenceColumn>(window, output);
+		}
+		else
+		{
+			ComputeGradientRow<SobelSmoothingColumn, CentralDifferenceColumn>(window, output);
+		}
+	}
+
+public:
+	explicit GradientStage(GradientOperator gradientOperator = GradientOperator::Sobel)
+		: PipelineStage(SobelSmoothingColumn.Height, SobelSmoothingColumn.VerticalRadius,
+			CentralDifferenceRow.HorizontalRadius),
+		operator_(gradientOperator)
+	{
+	}
+
+	std::unique_ptr<PipelineStage> Clone() const override
+	{
+		return std::make_unique<GradientStage>(*this);
+	}
+};
+
+/// <summary>
+/// Среднее или СКО по окну. В строке кольца две половины плоскости: суммы значений
+/// и суммы квадратов по окну в строке, посчитанные через префиксные суммы в double.
+/// </summary>
+class BoxStatisticStage : public PipelineStage
+{
+private:
+	BoxWindow window_;
+	BoxStatistic statistic_;
+	vector<float> expandedRow_;
+	vector<float> coefficients_;
+	vector<float> meanOfSquares_;
+	vector<const float*> planeWindow_;
+
+protected:
+	int SlotPlaneWidth() const override
+	{
+		return 2 * widthPx_;
+	}
+
+	void StoreRow(const float* row, float* slot) override
+	{
+		int windowWidth = 2 * window_.radiusX + 1;
+		int expandedWidth = widthPx_ + windowWidth - 1;
+
+		expandedRow_.resize((size_t)expandedWidth * channelCount_);
+		MirrorEdgesInPlanes(row, expandedRow_.data(), widthPx_, channelCount_, window_.radiusX);
+
+		for (int c = 0; c < channelCount_; c++)
+		{
+			const float* expandedPlane = expandedRow_.data() + (size_t)c * expandedWidth;
+			float* sums = slot + (size_t)c * 2 * widthPx_;
+			float* squareSums = sums + widthPx_;
+
+			// Префиксные суммы расширенной строки: prefixSum до правого края окна пикселя x,
+			// leftSum - до его левого края
+			double prefixSum = 0;
+			double prefixSquareSum = 0;
+			double leftSum = 0;
+			double leftSquareSum = 0;
+
+			for (int n = 0; n < windowWidth - 1; n++)
+			{
+				prefixSum += expandedPlane[n];
+				prefixSquareSum += (double)expandedPlane[n] * expandedPlane[n];
+			}
+
+			for (int x = 0; x < widthPx_; x++)
+			{
+				double addend = expandedPlane[x + windowWidth - 1];
+				double subtrahend = expandedPlane[x];
+
+				prefixSum += addend;
+				prefixSquareSum += addend * addend;
+
+				sums[x] = (float)(prefixSum - leftSum);
+				squareSums[x] = (float)(prefixSquareSum - leftSquareSum);
+
+				leftSum += subtrahend;
+				leftSquareSum += subtrahend * subtrahend;
+			}
+		}
+	}
+
+	void ComputeRow(const float* const* window, float* output) override
+	{
+		int windowHeight = WindowHeight();
+
+		planeWindow_.resize(windowHeight);
+		meanOfSquares_.resize(widthPx_);
+
+		for (int c = 0; c < channelCount_; c++)
+		{
+			size_t offset = (size_t)c * 2 * widthPx_;
+			float* mean = output + (size_t)c * widthPx_;
+
+			for (int i = 0; i < windowHeight; i++)
+			{
+				planeWindow_[i] = window[i] + offset;
+			}
+
+			std::fill(mean, mean + widthPx_, 0.f);
+			AccumulatePlaneY(planeWindow_.data(), coefficients_.data(), windowHeight, mean, widthPx_);
+
+			if (statistic_ == BoxStatistic::Mean)
+			{
+				continue;
+			}
+
+			for (int i = 0; i < windowHeight; i++)
+			{
+				planeWindow_[i] = window[i] + offset + widthPx_;
+			}
+
+			std::fill(meanOfSquares_.begin(), meanOfSquares_.end(), 0.f);
+			AccumulatePlaneY(planeWindow_.data(), coefficients_.data(), windowHeight,
+				meanOfSquares_.data(), widthPx_);
+
+			for (int x = 0; x < widthPx_; x++)
+			{
+				mean[x] = std::sqrt(std::max(meanOfSquares_[x] - mean[x] * mean[x], 0.f));
+			}
+		}
+	}
+
+public:
+	BoxStatisticStage(BoxWindow window, BoxStatistic statistic)
+		: PipelineStage(2 * window.radiusY + 1, window.radiusY, window.radiusX),
+		window_(window),
+		statistic_(statistic),
+		coefficients_(2 * window.radiusY + 1,
+			1.f / ((2 * window.radiusX + 1) * (2 * window.radiusY + 1)))
+	{
+		if (window.radiusX < 0 || window.radiusY < 0)
+		{
+			throw std::invalid_argument("Радиус окна не может быть отрицательным");
+		}
+	}
+
+	std::unique_ptr<PipelineStage> Clone() const override
+	{
+		return std::make_unique<BoxStatisticStage>(*this);
+	}
+};
+
+/// <summary>
+/// Цепочка операторов, которая выполняется за один проход по изображению:
+/// строки передаются от оператора к оператору во float, в памяти только кольца операторов.
+/// </summary>
+class FilterPipeline
+{
+private:
+	vector<std::unique_ptr<PipelineStage>> stages_;
+
+public:
+	FilterPipeline() = default;
+
+	template<class Stage, class... Args>
+	void Add(Args&&... args)
+	{
+		stages_.push_back(std::make_unique<Stage>(std::forward<Args>(args)...));
+	}
+
+	const vector<std::unique_ptr<PipelineStage>>& Stages() const noexcept
+	{
+		return stages_;
+	}
+
+	/// <summary>
+	/// Ореол цепочки - сумма ореолов операторов: ошибка отражения на краю полосы
+	/// каждым оператором сдвигается внутрь на его радиус.
+	/// </summary>
+	BandHalo Halo() const
+	{
+		BandHalo halo{ 0, 0 };
+
+		for (const std::unique_ptr<PipelineStage>& stage : stages_)
+		{
+			BandHalo stageHalo = KernelBandHalo(stage->WindowHeight(), stage->VerticalRadius());
+
+			halo.topRowsCount += stageHalo.topRowsCount;
+			halo.bottomRowsCount += stageHalo.bottomRowsCount;
+		}
+
+		return halo;
+	}
+};
+
+template<class Px>
+void ApplyFilterPipeline(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const FilterPipeline& pipeline)
+{
+	const int imageWidthPx = info.imageWidthPx;
+
+	vector<std::unique_ptr<PipelineStage>> stages;
+
+	for (const std::unique_ptr<PipelineStage>& stage : pipeline.Stages())
+	{
+		stages.push_back(stage->Clone());
+		stages.back()->Start(imageWidthPx, info.imageHeightPx, Px::ChannelCount);
+	}
+
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+	vector<float> srcPlanes((size_t)imageWidthPx * Px::ChannelCount);
+
+	int writtenRowsCount = 0;
+
+	auto writeRow = [&](const float* row)
+		{
+			uint8_t* destRow = dest.Rows(writtenRowsCount, 1);
+
+			InterleaveRow<Px>(row, imageWidthPx, destRow, imageWidthPx);
+
+			dest.CommitRows();
+			writtenRowsCount++;
+		};
+
+	// Передаёт готовые строки оператора i дальше по цепочке
+	auto drain = [&](auto& self, size_t i) -> void
+		{
+			while (const float* row = stages[i]->TryEmit())
+			{
+				if (i + 1 == stages.size())
+				{
+					writeRow(row);
+				}
+				else
+				{
+					stages[i + 1]->Push(row);
+					self(self, i + 1);
+				}
+			}
+		};
+
+	for (int y = 0; y < info.imageHeightPx; y++)
+	{
+		src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+		src.ignore(info.paddingBytesCount);
+
+		DeinterleaveRow<Px>(srcRowBuffer.data(), srcPlanes.data(), imageWidthPx, imageWidthPx);
+
+		if (stages.empty())
+		{
+			writeRow(srcPlanes.data());
+			continue;
+		}
+
+		stages[0]->Push(srcPlanes.data());
+		drain(drain, 0);
+	}
+}
+
+/// <summary>
+/// Применяет цепочку операторов за один проход: изображение читается и пишется один раз,
+/// округление до 8 бит только на выходе последнего оператора.
+/// </summary>
+void ApplyFilterPipeline(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	const FilterPipeline& pipeline,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	for (const std::unique_ptr<PipelineStage>& stage : pipeline.Stages())
+	{
+		if (stage->HorizontalRadius() > info.imageWidthPx ||
+			stage->VerticalRadius() > info.imageHeightPx ||
+			stage->WindowHeight() - 1 - stage->VerticalRadius() > info.imageHeightPx)
+		{
+			throw std::invalid_argument("Изображение слишком мало");
+		}
+	}
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			FilterInBands(srcPath, src, destFile, info, pipeline.Halo(), threadsCount,
+				[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+				{
+					ApplyFilterPipeline<decltype(format)>(bandSrc, bandDest, bandInfo, pipeline);
+				});
+		});
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+/// <summary>
+/// Ядро, размеры и коэффициенты которого известны на этапе компиляции.
+/// Используется как шаблонный параметр (const auto&), поэтому свёртка с ним
+/// разворачивается полностью, а нулевые коэффициенты не порождают кода.
+/// </summary>
+template<int height, int width>
+struct FixedKernel
+{
+	static constexpr int Height = height;
+	static constexpr int Width = width;
+
+	// Расстояние от центрального элемента до краёв ядра, как у Kernel
+	static constexpr int VerticalRadius = height / 2;
+	static constexpr int HorizontalRadius = width / 2;
+
+	std::array<float, height * width> coefficients;
+
+	constexpr float operator()(int y, int x) const
+	{
+		return coefficients[y * width + x];
+	}
+};
+
+/// <summary>
+/// Внешнее произведение столбца и строки - двумерное разделимое ядро.
+/// </summary>
+template<int height, int width>
+constexpr FixedKernel<height, width> OuterProduct(
+	const FixedKernel<height, 1>& column,
+	const FixedKernel<1, width>& row)
+{
+	FixedKernel<height, width> kernel{};
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			kernel.coefficients[y * width + x] = column.coefficients[y] * row.coefficients[x];
+		}
+	}
+
+	return kernel;
+}
+
+template<const auto& kernel, size_t index, class Load>
+inline void AccumulateFixedTap(float& sum, Load& load)
+{
+	constexpr int width = std::remove_cvref_t<decltype(kernel)>::Width;
+	constexpr float coefficient = kernel.coefficients[index];
+
+	if constexpr (coefficient == 1)
+	{
+		sum += load((int)index / width, (int)index % width);
+	}
+	else if constexpr (coefficient == -1)
+	{
+		sum -= load((int)index / width, (int)index % width);
+	}
+	else if constexpr (coefficient != 0)
+	{
+		sum += coefficient * load((int)index / width, (int)index % width);
+	}
+}
+
+/// <summary>
+/// Сумма kernel(i, j) * load(i, j) по всем ненулевым коэффициентам, развёрнутая
+/// на этапе компиляции. load(i, j) возвращает значение под коэффициентом (i, j).
+/// </summary>
+template<const auto& kernel, class Load>
+inline float CorrelateFixed(Load&& load)
+{
+	using KernelType = std::remove_cvref_t<decltype(kernel)>;
+
+	float sum = 0;
+
+	[&]<size_t... indices>(std::index_sequence<indices...>)
+	{
+		(AccumulateFixedTap<kernel, indices>(sum, load), ...);
+	}(std::make_index_sequence<KernelType::Height * KernelType::Width>{});
+
+	return sum;
+}
@@ -70,3 +70,8 @@ float Kernel::operator()(int y, int x) const
 
 	return kernel_[(size_t)y * width_ + x];
 }
+
+const float* Kernel::Data() const noexcept
+{
+	return kernel_.data();
+}
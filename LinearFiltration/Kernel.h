@@ -30,5 +30,8 @@ public:
 	int HorizontalRadius() const noexcept;
 
 	float operator()(int y, int x) const;
+
+	// Коэффициенты построчно, без проверки границ - для внутренних циклов свёртки
+	const float* Data() const noexcept;
 };
 
@@ -0,0 +1,156 @@
+#include "KernelDecomposition.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// Предельное число проходов вращений, на практике хватает 5-10
+const int MaxJacobiSweeps = 60;
+
+std::vector<SeparableTerm> DecomposeKernel(const Kernel& kernel)
+{
+	const int height = kernel.Height();
+	const int width = kernel.Width();
+
+	// Односторонний метод Якоби: вращения столбцов делают столбцы A * V
+	// попарно ортогональными, тогда A * V = U * S, а A = сумма S_j * u_j * v_j^T
+	std::vector<double> a((size_t)height * width);
+	std::vector<double> v((size_t)width * width);
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			a[(size_t)y * width + x] = kernel(y, x);
+		}
+	}
+	for (int x = 0; x < width; x++)
+	{
+		v[(size_t)x * width + x] = 1;
+	}
+
+	for (int sweep = 0; sweep < MaxJacobiSweeps; sweep++)
+	{
+		bool isRotated = false;
+
+		for (int p = 0; p < width - 1; p++)
+		{
+			for (int q = p + 1; q < width; q++)
+			{
+				double alpha = 0, beta = 0, gamma = 0;
+
+				for (int y = 0; y < height; y++)
+				{
+					double ap = a[(size_t)y * width + p];
+					double aq = a[(size_t)y * width + q];
+
+					alpha += ap * ap;
+					beta += aq * aq;
+					gamma += ap * aq;
+				}
+
+				// Столбцы уже ортогональны с точностью double
+				if (std::abs(gamma) <= 1e-15 * std::sqrt(alpha * beta) || gamma == 0)
+				{
+					continue;
+				}
+				isRotated = true;
+
+				double zeta = (beta - alpha) / (2 * gamma);
+				double t = (zeta >= 0 ? 1 : -1) / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+				double c = 1 / std::sqrt(1 + t * t);
+				double s = c * t;
+
+				for (int y = 0; y < height; y++)
+				{
+					double ap = a[(size_t)y * width + p];
+					double aq = a[(size_t)y * width + q];
+
+					a[(size_t)y * width + p] = c * ap - s * aq;
+					a[(size_t)y * width + q] = s * ap + c * aq;
+				}
+				for (int x = 0; x < width; x++)
+				{
+					double vp = v[(size_t)x * width + p];
+					double vq = v[(size_t)x * width + q];
+
+					v[(size_t)x * width + p] = c * vp - s * vq;
+					v[(size_t)x * width + q] = s * vp + c * vq;
+				}
+			}
+		}
+
+		if (!isRotated)
+		{
+			break;
+		}
+	}
+
+	// Сингулярные числа - длины столбцов A * V
+	std::vector<double> singularValues(width);
+	for (int x = 0; x < width; x++)
+	{
+		double sumOfSquares = 0;
+		for (int y = 0; y < height; y++)
+		{
+			sumOfSquares += a[(size_t)y * width + x] * a[(size_t)y * width + x];
+		}
+		singularValues[x] = std::sqrt(sumOfSquares);
+	}
+
+	std::vector<int> order(width);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](int l, int r)
+		{
+			return singularValues[l] > singularValues[r];
+		});
+
+	// Отброшенное слагаемое меняет пиксель не больше чем на S_j * ||окно||,
+	// а длина окна из H * W значений не больше 255 * sqrt(H * W)
+	const double maxDroppedSum = MaxDecompositionError / (255 * std::sqrt((double)height * width));
+
+	size_t termsCount = width;
+	double droppedSum = 0;
+	while (termsCount > 1 && droppedSum + singularValues[order[termsCount - 1]] <= maxDroppedSum)
+	{
+		droppedSum += singularValues[order[--termsCount]];
+	}
+
+	std::vector<SeparableTerm> terms;
+	terms.reserve(termsCount);
+
+	for (size_t k = 0; k < termsCount; k++)
+	{
+		int j = order[k];
+		double sigma = singularValues[j];
+
+		if (sigma == 0 && k != 0)
+		{
+			break;
+		}
+
+		// Сингулярное число делится поровну между столбцом и строкой
+		double rootSigma = std::sqrt(sigma);
+
+		std::vector<float> kernelX(width);
+		std::vector<float> kernelY(height);
+
+		for (int x = 0; x < width; x++)
+		{
+			kernelX[x] = (float)(v[(size_t)x * width + j] * rootSigma);
+		}
+		for (int y = 0; y < height; y++)
+		{
+			kernelY[y] = sigma == 0 ? 0.f : (float)(a[(size_t)y * width + j] / rootSigma);
+		}
+
+		terms.push_back({ Kernel(1, width, std::move(kernelX)), Kernel(height, 1, std::move(kernelY)) });
+	}
+
+	return terms;
+}
+
+bool IsDecompositionFaster(const Kernel& kernel, size_t termsCount) noexcept
+{
+	return termsCount * (kernel.Height() + kernel.Width()) < (size_t)kernel.Height() * kernel.Width();
+}
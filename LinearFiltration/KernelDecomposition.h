@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "Kernel.h"
+
+/// <summary>
+/// Слагаемое разложения двумерного ядра: столбец kernelY (H x 1), умноженный на строку kernelX (1 x W).
+/// </summary>
+struct SeparableTerm
+{
+	Kernel kernelX;
+	Kernel kernelY;
+};
+
+// Допустимая ошибка отбрасывания малых слагаемых в уровнях яркости выходного пикселя
+const double MaxDecompositionError = 0.01;
+
+/// <summary>
+/// Разложение ядра в сумму разделимых слагаемых по сингулярному разложению.
+/// Слагаемые упорядочены по убыванию сингулярного числа, малые отбрасываются,
+/// пока их суммарный вклад в пиксель меньше MaxDecompositionError.
+/// Для ядра ранга 1 возвращается одно слагаемое.
+/// </summary>
+std::vector<SeparableTerm> DecomposeKernel(const Kernel& kernel);
+
+/// <summary>
+/// Выгоднее ли k разделимых проходов (k * (H + W) умножений на пиксель) прямой свёртки (H * W).
+/// </summary>
+bool IsDecompositionFaster(const Kernel& kernel, size_t termsCount) noexcept;
@@ -0,0 +1,70 @@
+#include "KernelQuantization.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Наибольший сдвиг, при котором 2^shift и поправка округления помещаются в int32
+const int MaxQuantizationShift = 30;
+
+std::optional<QuantizedKernel> QuantizeKernel(const Kernel& kernel)
+{
+	const int size = kernel.Height() * kernel.Width();
+	const float* coefficients = kernel.Data();
+
+	double maxAbs = 0;
+
+	for (int n = 0; n < size; n++)
+	{
+		maxAbs = std::max(maxAbs, (double)std::abs(coefficients[n]));
+	}
+
+	// Наибольший сдвиг, при котором коэффициенты помещаются в int16
+	int shift = MaxQuantizationShift;
+
+	while (shift > 1 && std::round(maxAbs * std::ldexp(1.0, shift)) > INT16_MAX)
+	{
+		shift--;
+	}
+
+	for (; shift >= 1; shift--)
+	{
+		QuantizedKernel quantized{ std::vector<int16_t>(size), shift, 0 };
+
+		double scale = std::ldexp(1.0, shift);
+		double sumAbs = 0;
+		double error = 0;
+
+		for (int n = 0; n < size; n++)
+		{
+			double value = std::round(coefficients[n] * scale);
+
+			if (std::abs(value) > INT16_MAX)
+			{
+				return std::nullopt;
+			}
+
+			quantized.coefficients[n] = (int16_t)value;
+
+			sumAbs += std::abs(value);
+			error += std::abs(value / scale - coefficients[n]);
+		}
+
+		// Сумма произведений вместе с поправкой округления 2^(shift - 1) не должна переполнить int32
+		if (sumAbs * UINT8_MAX + scale / 2 > INT32_MAX)
+		{
+			continue;
+		}
+
+		// Меньший сдвиг только огрубляет коэффициенты, поэтому дальше не перебирается
+		quantized.maxError = error * UINT8_MAX;
+
+		if (quantized.maxError >= MaxQuantizationError)
+		{
+			return std::nullopt;
+		}
+
+		return quantized;
+	}
+
+	return std::nullopt;
+}
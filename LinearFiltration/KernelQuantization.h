@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "Kernel.h"
+
+/// <summary>
+/// Ядро с целыми коэффициентами: kernel(y, x) ~ coefficients[y * W + x] / 2^shift.
+/// </summary>
+struct QuantizedKernel
+{
+	std::vector<int16_t> coefficients;
+	int shift;
+
+	// Оценка сверху ошибки свёртки 8-битного изображения в уровнях яркости
+	double maxError;
+};
+
+// Допустимая ошибка целочисленной свёртки - половина младшего разряда выходного пикселя
+const double MaxQuantizationError = 0.5;
+
+/// <summary>
+/// Квантование коэффициентов в int16 с наибольшим сдвигом, при котором ни коэффициенты,
+/// ни 32-битная сумма произведений на значения 0..255 не переполняются.
+/// Возвращает пустое значение, если ошибка не меньше MaxQuantizationError -
+/// такому ядру нужна свёртка во float.
+/// </summary>
+std::optional<QuantizedKernel> QuantizeKernel(const Kernel& kernel);
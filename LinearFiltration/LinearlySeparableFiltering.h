@@ -5,243 +5,196 @@
 #include <vector>
 #include <numeric>
 #include <numbers>
+#include <algorithm>
 
 #include "Kernel.h"
+#include "KernelDecomposition.h"
 #include "BmpHeader.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "RowRing.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "SimdConvolution.h"
+#include "BandFiltering.h"
 
 using std::vector;
 
-const int ChannelCount = 3;
-const int BytePerPx = 3;
-const int BytePerFloatPx = 12;
-
-void MirrorEdgePixelsInRow(
-	vector<uint8_t>& expandedRow,
-	int imageWidthPx,
-	const Kernel& kernelX)
-{
-	// Левый край
-	for (int x = 0; x < kernelX.HorizontalRadius(); x++)
-	{
-		int mirrorX = kernelX.HorizontalRadius() * 2 - 1 - x;
-
-		expandedRow[x * BytePerPx] = expandedRow[mirrorX * BytePerPx];
-		expandedRow[x * BytePerPx + 1] = expandedRow[mirrorX * BytePerPx + 1];
-		expandedRow[x * BytePerPx + 2] = expandedRow[mirrorX * BytePerPx + 2];
-	}
-
-	// Правый край
-	for (int x = imageWidthPx + kernelX.HorizontalRadius();
-		x < imageWidthPx + kernelX.HorizontalRadius() * 2;
-		x++)
-	{
-		int mirrorX = 2 * (imageWidthPx + kernelX.HorizontalRadius()) - x - 1;
-
-		expandedRow[x * BytePerPx] = expandedRow[mirrorX * BytePerPx];
-		expandedRow[x * BytePerPx + 1] = expandedRow[mirrorX * BytePerPx + 1];
-		expandedRow[x * BytePerPx + 2] = expandedRow[mirrorX * BytePerPx + 2];
-	}
-}
-
-void ConvolutionX(
+/// <summary>
+/// Горизонтальная свёртка расширенной строки всеми kernelX. Строка один раз
+/// раскладывается по плоскостям каналов, результат слагаемого t пишется
+/// в плоскости строки кольца с t * rowWidth.
+/// </summary>
+template<class Px>
+void ConvolveRowX(
 	const vector<uint8_t>& expandedRow,
-	vector<float>& outputRowsBuffer,
-	int currentRowOffset,
-	const Kernel& kernelX,
+	vector<float>& expandedPlanes,
+	float* convolutedXRow,
+	const vector<SeparableTerm>& terms,
 	int imageWidthPx)
 {
-	int xOffsetPx = 0;
+	int expandedWidthPx = (int)expandedPlanes.size() / Px::ChannelCount;
+	int rowWidth = imageWidthPx * Px::ChannelCount;
+
+	DeinterleaveRow<Px>(expandedRow.data(), expandedPlanes.data(), expandedWidthPx, expandedWidthPx);
 
-	for (int x = kernelX.HorizontalRadius();
-		x < imageWidthPx + kernelX.HorizontalRadius();
-		x++)
+	for (int t = 0; t < (int)terms.size(); t++)
 	{
-		float sumB = 0;
-		float sumG = 0;
-		float sumR = 0;
+		float* outputRow = convolutedXRow + (size_t)t * rowWidth;
 
-		for (int j = xOffsetPx; j < xOffsetPx + kernelX.Width(); j++)
+		for (int c = 0; c < Px::ChannelCount; c++)
 		{
-			sumB += kernelX(0, j - xOffsetPx) * expandedRow[j * BytePerPx];
-
-			sumG += kernelX(0, j - xOffsetPx) * expandedRow[j * BytePerPx + 1];
-
-			sumR += kernelX(0, j - xOffsetPx) * expandedRow[j * BytePerPx + 2];
+			ConvolvePlaneX(
+				expandedPlanes.data() + (size_t)c * expandedWidthPx,
+				outputRow + (size_t)c * imageWidthPx,
+				terms[t].kernelX.Data(),
+				terms[t].kernelX.Width(),
+				imageWidthPx);
 		}
-
-		outputRowsBuffer[currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx] = sumB;
-
-		outputRowsBuffer[currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx + 1] = sumG;
-
-		outputRowsBuffer[currentRowOffset + (x - kernelX.HorizontalRadius()) * BytePerPx + 2] = sumR;
-
-		xOffsetPx++;
 	}
 }
 
+/// <summary>
+/// Сумма разделимых свёрток с общими размерами ядер. Строка источника читается
+/// и расширяется один раз, её свёртки со всеми kernelX лежат в одной строке кольца:
+/// слагаемому t отведены значения [t * rowWidth, (t + 1) * rowWidth), внутри них
+/// каналы лежат отдельными плоскостями по imageWidthPx значений.
+/// </summary>
+template<class Px, class Border>
 void FilterImage(
-	std::filesystem::path srcPath,
-	std::filesystem::path destPath,
-	const Kernel& kernelX,
-	const Kernel& kernelY)
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const vector<SeparableTerm>& terms)
 {
-	std::ifstream src(srcPath, std::ios::binary);
-	if (!src.is_open())
-	{
-		std::string errorMessage = "Can't find or open file with input path: ";
-		throw std::invalid_argument(errorMessage + srcPath.string());
-	}
-	std::ofstream dest(destPath, std::ios::binary);
-	if (!dest.is_open())
-	{
-		std::string errorMessage = "Can't save file with output path: ";
-		throw std::invalid_argument(errorMessage + destPath.string());
-	}
+	int imageWidthBytes = info.imageWidthBytes;
+	int rowWidth = info.imageWidthPx * Px::ChannelCount;
+	int paddingBytesCount = info.paddingBytesCount;
 
-	BmpHeader header{};
-	src.read((char*)&header, sizeof(header));
+	int termsCount = (int)terms.size();
+	int kernelHeight = terms[0].kernelY.Height();
+	int verticalRadius = terms[0].kernelY.VerticalRadius();
+	int horizontalRadius = terms[0].kernelX.HorizontalRadius();
 
-	// Проверка на возможность отражения
-	if (kernelX.HorizontalRadius() > header.imageWidthPx ||
-		kernelY.VerticalRadius() > header.imageHeightPx)
-	{
-		throw std::invalid_argument("Изображение слишком мало");
-	}
+	// Длина расширенной краевыми пикселями строки
+	int expandedWidthPx = info.imageWidthPx + horizontalRadius * 2;
+	int expandedWidthBytes = expandedWidthPx * Px::BytePerPx;
 
-	dest.write((char*)&header, sizeof(header));
+	vector<uint8_t> srcRowBuffer(expandedWidthBytes);
+	vector<float> expandedPlanes((size_t)expandedWidthPx * Px::ChannelCount);
+	vector<float> outputPlanes(rowWidth);
 
-	int imageWidthBytes = header.imageWidthPx * BytePerPx;
-	int rowWidth = header.imageWidthPx * ChannelCount;
-	int rowStrideBytes = (imageWidthBytes + 3) & ~3;
-	int paddingBytesCount = rowStrideBytes - imageWidthBytes;
+	RowRing<float, Border> convolutedXRows(rowWidth * termsCount, info.imageHeightPx, kernelHeight);
 
-	// Длина расширенной отражёнными краевыми пикселями строки
-	int expandedWidthBytes = imageWidthBytes + kernelX.HorizontalRadius() * 2 * BytePerPx;
+	// Строки окна в порядке коэффициентов kernelY и их плоскости одного канала одного слагаемого
+	vector<const float*> window(kernelHeight);
+	vector<const float*> windowPlanes(kernelHeight);
 
-	vector<uint8_t> srcRowBuffer(expandedWidthBytes);
-	vector<float> convolutedXRows(rowWidth * kernelY.Height());
-	vector<uint8_t> destRowBuffer(rowStrideBytes);
-
-	src.seekg(header.imageOffsetBytes);
-	// Формирование первоначального буфера строк с отражением
-	// 1 0 0 1 2
-	for (int bufferY = kernelY.VerticalRadius(); bufferY < kernelY.Height(); bufferY++)
+	for (int y = 0; y < info.imageHeightPx; y++)
 	{
-		int imageY = bufferY - kernelY.VerticalRadius();
+		int firstWindowRow = y - verticalRadius;
 
-		src.read((char*)&srcRowBuffer[kernelX.HorizontalRadius() * BytePerPx],
-			imageWidthBytes);
-		src.seekg(paddingBytesCount, std::ios_base::cur);
+		while (!convolutedXRows.HasWindow(firstWindowRow, kernelHeight))
+		{
+			src.read((char*)&srcRowBuffer[horizontalRadius * Px::BytePerPx], imageWidthBytes);
+			src.ignore(paddingBytesCount);
 
-		MirrorEdgePixelsInRow(srcRowBuffer, header.imageWidthPx, kernelX);
+			ExpandRowEdges<Px, Border>(srcRowBuffer.data(), info.imageWidthPx, horizontalRadius);
 
-		ConvolutionX(
-			srcRowBuffer,
-			convolutedXRows,
-			bufferY * rowWidth,
-			kernelX,
-			header.imageWidthPx
-		);
-	}
+			ConvolveRowX<Px>(srcRowBuffer, expandedPlanes, convolutedXRows.AppendRow(),
+				terms, info.imageWidthPx);
+		}
 
-	// Отражение
-	for (int bufferY = 0; bufferY < kernelY.VerticalRadius(); bufferY++)
-	{
-		int y = 2 * kernelY.VerticalRadius() - 1 - bufferY;
+		convolutedXRows.Window(firstWindowRow, kernelHeight, window.data());
 
-		std::copy(convolutedXRows.data() + y * rowWidth,
-			convolutedXRows.data() + (y + 1) * rowWidth,
-			convolutedXRows.data() + bufferY * rowWidth);
-	}
+		uint8_t* destRow = dest.Rows(y, 1);
 
-	// Индекс первой строки в буфере
-	int firstRowIndex = 0;
-	int oldFirstRowIndex = 0;
-	int bufIndexToCopy = 0;
+		std::fill(outputPlanes.begin(), outputPlanes.end(), 0.f);
 
-	for (int y = kernelY.VerticalRadius();
-		y < header.imageHeightPx + kernelY.VerticalRadius();
-		y++)
-	{
-		for (int x = 0; x < header.imageWidthPx; x++)
+		// Свёртка по вертикали каждого слагаемого
+		for (int t = 0; t < termsCount; t++)
 		{
-			float sumB = 0;
-			float sumG = 0;
-			float sumR = 0;
-
-			// Свёртка
-			for (int i = 0; i < kernelY.Height(); i++)
+			for (int c = 0; c < Px::ChannelCount; c++)
 			{
-				int currentRowIndex = (i + firstRowIndex) % kernelY.Height();
-				
-				sumB += kernelY(i, 0) *
-					convolutedXRows[currentRowIndex * rowWidth + x * ChannelCount];
-
-				sumG += kernelY(i, 0) *
-					convolutedXRows[currentRowIndex * rowWidth + x * ChannelCount + 1];
-
-				sumR += kernelY(i, 0) *
-					convolutedXRows[currentRowIndex * rowWidth + x * ChannelCount + 2];
-				
+				size_t planeOffset = (size_t)t * rowWidth + (size_t)c * info.imageWidthPx;
+
+				for (int i = 0; i < kernelHeight; i++)
+				{
+					windowPlanes[i] = window[i] + planeOffset;
+				}
+
+				AccumulatePlaneY(
+					windowPlanes.data(),
+					terms[t].kernelY.Data(),
+					kernelHeight,
+					outputPlanes.data() + c * info.imageWidthPx,
+					info.imageWidthPx);
 			}
-
-			destRowBuffer[x * BytePerPx]
-				= (uint8_t)std::clamp(sumB + 0.5f, 0.f, 255.f);
-
-			destRowBuffer[x * BytePerPx + 1]
-				= (uint8_t)std::clamp(sumG + 0.5f, 0.f, 255.f);
-
-			destRowBuffer[x * BytePerPx + 2]
-				= (uint8_t)std::clamp(sumR + 0.5f, 0.f, 255.f);
 		}
 
-		// Чтобы при чётных размерах условие отражение не срабатывало 
-		// на 1 строку раньше и последняя строка тоже обрабатывалась 
-		int imageY = y;
-		if (kernelY.Height() % 2 == 0)
-		{
-			imageY = y - 1;
-		}
+		InterleaveRow<Px>(outputPlanes.data(), info.imageWidthPx, destRow, info.imageWidthPx);
 
-		// Отражение 
-		if (imageY >= header.imageHeightPx - 1)
-		{
-			if (imageY == header.imageHeightPx - 1)
-			{
-				oldFirstRowIndex = firstRowIndex;
-				bufIndexToCopy = (firstRowIndex + kernelY.Height() - 1) % kernelY.Height();
-			}
-			if (bufIndexToCopy != firstRowIndex)
-			{
-				std::copy(convolutedXRows.data() + bufIndexToCopy * rowWidth,
-					convolutedXRows.data() + (bufIndexToCopy + 1) * rowWidth,
-					convolutedXRows.data() + firstRowIndex * rowWidth);
-			}
+		dest.CommitRows();
+	}
+}
 
-			bufIndexToCopy--;
-			if (bufIndexToCopy < 0)
-			{
-				bufIndexToCopy = kernelY.Height() - 1;
-			}
-		}
-		else
-		{
-			src.read(
-				(char*)&srcRowBuffer[kernelX.HorizontalRadius() * BytePerPx],
-				imageWidthBytes);
-			src.seekg(paddingBytesCount, std::ios_base::cur);
+template<class Px, class Border>
+void FilterImage(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const Kernel& kernelX,
+	const Kernel& kernelY)
+{
+	FilterImage<Px, Border>(src, dest, info, vector<SeparableTerm>{ { kernelX, kernelY } });
+}
 
-			MirrorEdgePixelsInRow(srcRowBuffer, header.imageWidthPx, kernelX);
+void FilterImage(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	const Kernel& kernelX,
+	const Kernel& kernelY,
+	BorderMode border = BorderMode::Mirror,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
 
-			ConvolutionX(srcRowBuffer, convolutedXRows,
-				firstRowIndex * rowWidth,
-				kernelX,
-				header.imageWidthPx);
-		}
+	BmpImageInfo info = srcFile.Info();
 
-		// Вторая становится первой и т.д.
-		firstRowIndex = (firstRowIndex + 1) % kernelY.Height();
+	// Проверка на возможность отражения
+	if (kernelX.HorizontalRadius() > info.imageWidthPx ||
+		kernelY.VerticalRadius() > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
 
-		dest.write((char*)destRowBuffer.data(), rowStrideBytes);
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	// Периодической границе нужен противоположный край изображения, полосы его не видят
+	if (border == BorderMode::Wrap)
+	{
+		threadsCount = 1;
 	}
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			DispatchBorderMode(border, [&](auto borderPolicy)
+				{
+					FilterInBands(srcPath, src, destFile, info, KernelBandHalo(kernelY.Height(), kernelY.VerticalRadius()), threadsCount,
+						[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+						{
+							FilterImage<decltype(format), decltype(borderPolicy)>(bandSrc, bandDest, bandInfo, kernelX, kernelY);
+						});
+				});
+		});
 }
\ No newline at end of file
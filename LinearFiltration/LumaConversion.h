@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "PixelFormats.h"
+#include "SimdConvolution.h"
+
+/// <summary>
+/// Перевод цветного входа в яркость при чтении.
+/// </summary>
+enum class LumaStandard
+{
+	// Каналы обрабатываются как есть
+	None,
+
+	// Y = 0.299 R + 0.587 G + 0.114 B
+	Bt601,
+
+	// Y = 0.2126 R + 0.7152 G + 0.0722 B
+	Bt709
+};
+
+// Веса яркости в Q15, сумма ровно 2^15, чтобы белый оставался 255
+const int LumaWeightShift = 15;
+
+struct LumaWeights
+{
+	int16_t blue;
+	int16_t green;
+	int16_t red;
+};
+
+inline LumaWeights LumaStandardWeights(LumaStandard standard)
+{
+	return standard == LumaStandard::Bt709
+		? LumaWeights{ 2366, 23436, 6966 }
+		: LumaWeights{ 3736, 19234, 9798 };
+}
+
+/// <summary>
+/// Яркость пикселей строки с округлением. Векторный проход берёт по 8 пикселей,
+/// пиксель Bgr24 расширяется перестановкой байтов до слова, как у Bgra32 (четвёртый байт
+/// не учитывается), пары (B, R) и G умножаются на веса одной pmaddwd каждая.
+/// 8-битная строка уже яркость и копируется.
+/// </summary>
+template<class Px>
+void ConvertRowToLuma(const uint8_t* row, uint8_t* luma, int widthPx, const LumaWeights& weights)
+{
+	if constexpr (Px::ChannelCount == 1)
+	{
+		std::memcpy(luma, row, widthPx);
+		return;
+	}
+
+	int x = 0;
+
+#ifdef CONVOLUTION_AVX2
+	const __m256i blueRedWeights = _mm256_set1_epi32(
+		(uint16_t)weights.blue | ((int32_t)weights.red << 16));
+	const __m256i greenWeights = _mm256_set1_epi32(weights.green);
+	const __m256i byteMask = _mm256_set1_epi32(0x00FF00FF);
+	const __m256i lowByteMask = _mm256_set1_epi32(0xFF);
+	const __m256i rounding = _mm256_set1_epi32(1 << (LumaWeightShift - 1));
+
+	// Слова результата 0..3 в младшей половине регистра, 4..7 - в старшей
+	const __m256i gatherResults = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+	// Bgr24: 12 байтов четырёх пикселей в каждую половину регистра, затем пиксель - в слово
+	const __m256i gatherPixels = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+	const __m256i expandPixels = _mm256_setr_epi8(
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+	// Загрузка 32 байтов: у Bgr24 последние 8 принадлежат следующим пикселям
+	const int loadPx = Px::BytePerPx == 3 ? 11 : 8;
+
+	for (; x + loadPx <= widthPx; x += 8)
+	{
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)(row + (size_t)x * Px::BytePerPx));
+
+		if constexpr (Px::BytePerPx == 3)
+		{
+			pixels = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(pixels, gatherPixels), expandPixels);
+		}
+
+		__m256i blueRed = _mm256_and_si256(pixels, byteMask);
+		__m256i green = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), lowByteMask);
+
+		__m256i sums = _mm256_add_epi32(
+			_mm256_madd_epi16(blueRed, blueRedWeights),
+			_mm256_madd_epi16(green, greenWeights));
+		sums = _mm256_srli_epi32(_mm256_add_epi32(sums, rounding), LumaWeightShift);
+
+		__m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(sums, sums), _mm256_setzero_si256());
+		bytes = _mm256_permutevar8x32_epi32(bytes, gatherResults);
+
+		_mm_storel_epi64((__m128i*)(luma + x), _mm256_castsi256_si128(bytes));
+	}
+#endif
+
+	for (; x < widthPx; x++)
+	{
+		const uint8_t* px = row + (size_t)x * Px::BytePerPx;
+
+		int32_t sum = weights.blue * px[0] + weights.green * px[1] + weights.red * px[2];
+
+		luma[x] = (uint8_t)((sum + (1 << (LumaWeightShift - 1))) >> LumaWeightShift);
+	}
+}
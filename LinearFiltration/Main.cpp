@@ -1,5 +1,6 @@
 ﻿#include <iostream>
 #include <chrono>
+#include <string>
 #include <vector>
 
 #include "Kernel.h"
@@ -12,22 +13,32 @@ using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
 
-int main()
+// Путь "-" - стандартный ввод или вывод, поэтому всё, кроме изображения, пишется в std::cerr
+const char Usage[] = "Usage: LinearFiltration <input.bmp|-> <output.bmp|-> [windowWidth windowHeight]\n";
+
+int main(int argc, char* argv[])
 {
+	if (argc != 3 && argc != 5)
+	{
+		std::cerr << Usage;
+		return 1;
+	}
+
 	try
 	{
-		int n = 30;
-		int m = 30;
+		int n = argc == 5 ? std::stoi(argv[3]) : 30;
+		int m = argc == 5 ? std::stoi(argv[4]) : 30;
 		Kernel kX(1, n, vector<float>(n, 1.f / n));
 		Kernel kY(m, 1, vector<float>(m, 1.f/ m));
 
 		auto now = high_resolution_clock::now();
-		MovingRmse("C:\\Users\\Duck\\Desktop\\test images\\test2.bmp", "C:\\Users\\Duck\\Desktop\\test images\\rmse.bmp", kX, kY);
+		MovingRmse(argv[1], argv[2], kX, kY);
 		auto resultTime = duration_cast<milliseconds>(high_resolution_clock::now() - now);
-		std::cout << "Program has been completed in " << resultTime.count() << " ms.\n";
+		std::cerr << "Program has been completed in " << resultTime.count() << " ms.\n";
 	}
-	catch (const std::invalid_argument& e)
+	catch (const std::exception& e)
 	{
-		std::cout << e.what() << '\n';
+		std::cerr << e.what() << '\n';
+		return 1;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "SimdConvolution.h"
+#include "BandFiltering.h"
+
+using std::vector;
+
+/// <summary>
+/// Эрозия и дилатация - скользящие минимум и максимум по прямоугольному окну,
+/// размыкание - эрозия, затем дилатация, замыкание - наоборот.
+/// </summary>
+enum class MorphologyOperation
+{
+	Erode,
+	Dilate,
+	Open,
+	Close
+};
+
+/// <summary>
+/// Покомпонентный минимум (эрозия) или максимум (дилатация) двух строк.
+/// </summary>
+template<bool isDilation>
+void ExtremumOfRows(const uint8_t* a, const uint8_t* b, uint8_t* output, int length)
+{
+	int n = 0;
+
+#ifdef CONVOLUTION_AVX2
+	const int bytesPerRegister = sizeof(__m256i);
+
+	for (; n + bytesPerRegister <= length; n += bytesPerRegister)
+	{
+		__m256i valuesA = _mm256_loadu_si256((const __m256i*)(a + n));
+		__m256i valuesB = _mm256_loadu_si256((const __m256i*)(b + n));
+
+		if constexpr (isDilation)
+		{
+			_mm256_storeu_si256((__m256i*)(output + n), _mm256_max_epu8(valuesA, valuesB));
+		}
+		else
+		{
+			_mm256_storeu_si256((__m256i*)(output + n), _mm256_min_epu8(valuesA, valuesB));
+		}
+	}
+#endif
+
+	for (; n < length; n++)
+	{
+		output[n] = isDilation ? std::max(a[n], b[n]) : std::min(a[n], b[n]);
+	}
+}
+
+/// <summary>
+/// Горизонтальный проход ван Херка - Гил - Вермана по строке, расширенной на radius
+/// отражённых пикселей с каждой стороны. Строка делится на блоки по ширине окна,
+/// в каждом считаются экстремумы от начала блока (prefix) и до его конца (suffix),
+/// окно, начинающееся в x, покрывает конец одного блока и начало следующего:
+/// output[x] = экстремум(suffix[x], prefix[x + 2 * radius]).
+/// </summary>
+template<class Px, bool isDilation>
+void VanHerkRowPass(
+	const uint8_t* expandedRow,
+	uint8_t* prefix,
+	uint8_t* suffix,
+	uint8_t* output,
+	int imageWidthPx,
+	int radius)
+{
+	auto extremum = [](uint8_t a, uint8_t b)
+		{
+			return isDilation ? std::max(a, b) : std::min(a, b);
+		};
+
+	const int pixelBytes = Px::BytePerPx;
+	const int expandedLength = (imageWidthPx + 2 * radius) * pixelBytes;
+	const int blockLength = (2 * radius + 1) * pixelBytes;
+
+	for (int blockStart = 0; blockStart < expandedLength; blockStart += blockLength)
+	{
+		int blockEnd = std::min(blockStart + blockLength, expandedLength);
+
+		std::memcpy(prefix + blockStart, expandedRow + blockStart, pixelBytes);
+		for (int n = blockStart + pixelBytes; n < blockEnd; n++)
+		{
+			prefix[n] = extremum(prefix[n - pixelBytes], expandedRow[n]);
+		}
+
+		std::memcpy(suffix + blockEnd - pixelBytes, expandedRow + blockEnd - pixelBytes, pixelBytes);
+		for (int n = blockEnd - pixelBytes - 1; n >= blockStart; n--)
+		{
+			suffix[n] = extremum(suffix[n + pixelBytes], expandedRow[n]);
+		}
+	}
+
+	ExtremumOfRows<isDilation>(suffix, prefix + 2 * radius * pixelBytes, output, imageWidthPx * pixelBytes);
+}
+
+/// <summary>
+/// Эрозия или дилатация прямоугольным окном за три сравнения на значение независимо от его размеров.
+/// Строки поступают по одной, горизонтальный проход выполняется сразу, вертикальный -
+/// тем же алгоритмом над строками: последовательность строк, расширенная отражением,
+/// делится на блоки по высоте окна, экстремум от начала блока накапливается в одной строке,
+/// экстремумы до конца блока считаются, когда блок прочитан целиком.
+/// Выходная строка y готова, когда обработана расширенная строка y + 2 * radiusY.
+/// </summary>
+template<class Px>
+class VanHerkStage
+{
+private:
+	bool isDilation_;
+	int radiusX_;
+	int radiusY_;
+	int windowHeight_;
+	int imageWidthPx_;
+	int imageHeightPx_;
+	int rowWidth_;
+
+	// Кольцо строк после горизонтального прохода: отражённым строкам у краёв
+	// нужны radiusY последних
+	int ringRowsCount_;
+	vector<uint8_t> ring_;
+
+	vector<uint8_t> expandedRow_;
+	vector<uint8_t> rowPrefix_;
+	vector<uint8_t> rowSuffix_;
+
+	// Строки текущего блока, экстремумы до конца предыдущего блока и от начала текущего
+	vector<uint8_t> blockRows_;
+	vector<uint8_t> blockSuffixes_;
+	vector<uint8_t> blockPrefix_;
+	vector<uint8_t> outputRow_;
+
+	int pushedRowsCount_ = 0;
+	int extendedRowsCount_ = 0;
+
+	void Extremum(const uint8_t* a, const uint8_t* b, uint8_t* output) const
+	{
+		if (isDilation_)
+		{
+			ExtremumOfRows<true>(a, b, output, rowWidth_);
+		}
+		else
+		{
+			ExtremumOfRows<false>(a, b, output, rowWidth_);
+		}
+	}
+
+	uint8_t* BlockRow(vector<uint8_t>& rows, int index)
+	{
+		return &rows[(size_t)index * rowWidth_];
+	}
+
+public:
+	VanHerkStage(bool isDilation, int radiusX, int radiusY, int imageWidthPx, int imageHeightPx)
+		: isDilation_(isDilation),
+		radiusX_(radiusX),
+		radiusY_(radiusY),
+		windowHeight_(2 * radiusY + 1),
+		imageWidthPx_(imageWidthPx),
+		imageHeightPx_(imageHeightPx),
+		rowWidth_(imageWidthPx * Px::BytePerPx),
+		ringRowsCount_(radiusY + 1),
+		ring_((size_t)(radiusY + 1) * imageWidthPx * Px::BytePerPx),
+		expandedRow_((size_t)(imageWidthPx + 2 * radiusX) * Px::BytePerPx),
+		rowPrefix_(expandedRow_.size()),
+		rowSuffix_(expandedRow_.size()),
+		blockRows_((size_t)(2 * radiusY + 1) * imageWidthPx * Px::BytePerPx),
+		blockSuffixes_(blockRows_.size()),
+		blockPrefix_((size_t)imageWidthPx * Px::BytePerPx),
+		outputRow_((size_t)imageWidthPx * Px::BytePerPx)
+	{
+	}
+
+	void Push(const uint8_t* row)
+	{
+		std::memcpy(&expandedRow_[(size_t)radiusX_ * Px::BytePerPx], row, rowWidth_);
+		MirrorEdgePixelsInRow<Px>(expandedRow_.data(), imageWidthPx_, radiusX_);
+
+		uint8_t* ringRow = &ring_[(size_t)(pushedRowsCount_ % ringRowsCount_) * rowWidth_];
+
+		if (isDilation_)
+		{
+			VanHerkRowPass<Px, true>(expandedRow_.data(), rowPrefix_.data(), rowSuffix_.data(),
+				ringRow, imageWidthPx_, radiusX_);
+		}
+		else
+		{
+			VanHerkRowPass<Px, false>(expandedRow_.data(), rowPrefix_.data(), rowSuffix_.data(),
+				ringRow, imageWidthPx_, radiusX_);
+		}
+
+		pushedRowsCount_++;
+	}
+
+	/// <summary>
+	/// Следующая выходная строка, если для неё уже хватает входных, иначе nullptr.
+	/// </summary>
+	const uint8_t* TryEmit()
+	{
+		while (extendedRowsCount_ < imageHeightPx_ + 2 * radiusY_)
+		{
+			int e = extendedRowsCount_;
+			int imageRow = MirrorIndex(e - radiusY_, imageHeightPx_);
+
+			if (imageRow >= pushedRowsCount_)
+			{
+				return nullptr;
+			}
+
+			const uint8_t* row = &ring_[(size_t)(imageRow % ringRowsCount_) * rowWidth_];
+			int position = e % windowHeight_;
+
+			if (position == 0)
+			{
+				if (e > 0)
+				{
+					std::memcpy(BlockRow(blockSuffixes_, windowHeight_ - 1),
+						BlockRow(blockRows_, windowHeight_ - 1), rowWidth_);
+
+					for (int i = windowHeight_ - 2; i >= 0; i--)
+					{
+						Extremum(BlockRow(blockSuffixes_, i + 1), BlockRow(blockRows_, i),
+							BlockRow(blockSuffixes_, i));
+					}
+				}
+
+				std::memcpy(blockPrefix_.data(), row, rowWidth_);
+			}
+			else
+			{
+				Extremum(blockPrefix_.data(), row, blockPrefix_.data());
+			}
+
+			std::memcpy(BlockRow(blockRows_, position), row, rowWidth_);
+			extendedRowsCount_++;
+
+			// Окно выходной строки e - 2 * radiusY - хвост предыдущего блока и начало текущего
+			if (e >= windowHeight_ - 1)
+			{
+				if (position == windowHeight_ - 1)
+				{
+					return blockPrefix_.data();
+				}
+
+				Extremum(BlockRow(blockSuffixes_, position + 1), blockPrefix_.data(), outputRow_.data());
+				return outputRow_.data();
+			}
+		}
+
+		return nullptr;
+	}
+};
+
+/// <summary>
+/// Последовательность эрозий (false) и дилатаций (true) за один потоковый проход:
+/// строка, вышедшая из одной ступени, сразу подаётся в следующую.
+/// </summary>
+template<class Px>
+void ApplyMorphology(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const vector<bool>& dilations,
+	int radiusX,
+	int radiusY)
+{
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+
+	vector<VanHerkStage<Px>> stages;
+	for (bool isDilation : dilations)
+	{
+		stages.emplace_back(isDilation, radiusX, radiusY, info.imageWidthPx, info.imageHeightPx);
+	}
+
+	int writtenRowsCount = 0;
+
+	auto pushRow = [&](auto& self, size_t stageIndex, const uint8_t* row) -> void
+		{
+			if (stageIndex == stages.size())
+			{
+				std::memcpy(dest.Rows(writtenRowsCount++, 1), row, info.imageWidthBytes);
+				dest.CommitRows();
+				return;
+			}
+
+			VanHerkStage<Px>& stage = stages[stageIndex];
+
+			stage.Push(row);
+
+			while (const uint8_t* outputRow = stage.TryEmit())
+			{
+				self(self, stageIndex + 1, outputRow);
+			}
+		};
+
+	for (int y = 0; y < info.imageHeightPx; y++)
+	{
+		src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+		src.ignore(info.paddingBytesCount);
+
+		pushRow(pushRow, 0, srcRowBuffer.data());
+	}
+}
+
+/// <summary>
+/// Морфологическая операция прямоугольным окном (2 * radiusX + 1) x (2 * radiusY + 1)
+/// с отражёнными краями.
+/// </summary>
+void ApplyMorphology(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	MorphologyOperation operation,
+	int radiusX,
+	int radiusY,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	if (radiusX < 0 || radiusY < 0)
+	{
+		throw std::invalid_argument("Радиус окна не может быть отрицательным");
+	}
+
+	vector<bool> dilations;
+
+	switch (operation)
+	{
+	case MorphologyOperation::Erode:
+		dilations = { false };
+		break;
+	case MorphologyOperation::Dilate:
+		dilations = { true };
+		break;
+	case MorphologyOperation::Open:
+		dilations = { false, true };
+		break;
+	case MorphologyOperation::Close:
+		dilations = { true, false };
+		break;
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	if (radiusX > info.imageWidthPx ||
+		radiusY > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	// Ошибка отражения у края полосы накапливается по всем ступеням
+	int haloRowsCount = radiusY * (int)dilations.size();
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			FilterInBands(srcPath, src, destFile, info,
+				BandHalo{ haloRowsCount, haloRowsCount }, threadsCount,
+				[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+				{
+					ApplyMorphology<decltype(format)>(bandSrc, bandDest, bandInfo, dilations, radiusX, radiusY);
+				});
+		});
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "BandFiltering.h"
+
+using std::vector;
+
+// Гистограмма 8-битного канала двухуровневая: 16 грубых корзин по 16 точных
+const int HistogramBinsCount = 256;
+const int CoarseBinsCount = 16;
+const int FineBinsPerCoarse = HistogramBinsCount / CoarseBinsCount;
+
+// Счётчики гистограмм столбцов 16-битные
+const int MaxRankRadiusY = (UINT16_MAX - 1) / 2;
+
+/// <summary>
+/// Номер по возрастанию (от 0) значения percentile-го процентиля в окне из windowArea значений.
+/// </summary>
+inline uint32_t PercentileRank(double percentile, int64_t windowArea)
+{
+	return (uint32_t)std::lround(percentile / 100 * (windowArea - 1));
+}
+
+/// <summary>
+/// Прибавляет (delta = 1) или вычитает (delta = -1) строку из гистограмм столбцов.
+/// Гистограмма значения n строки - точные корзины с n * 256, грубые с n * 16.
+/// </summary>
+inline void UpdateColumnHistograms(
+	const uint8_t* row,
+	int rowWidth,
+	int delta,
+	uint16_t* columnFine,
+	uint16_t* columnCoarse)
+{
+	for (int n = 0; n < rowWidth; n++)
+	{
+		uint8_t value = row[n];
+
+		columnFine[(size_t)n * HistogramBinsCount + value] += (uint16_t)delta;
+		columnCoarse[(size_t)n * CoarseBinsCount + value / FineBinsPerCoarse] += (uint16_t)delta;
+	}
+}
+
+/// <summary>
+/// Ранговый фильтр Перро - Эбера за O(1) на пиксель от радиуса. Для каждого столбца хранится
+/// гистограмма окна по вертикали, при переходе к следующей строке из неё вычитается
+/// уходящая строка и прибавляется новая. Гистограмма ядра сдвигается вдоль строки
+/// прибавлением и вычитанием грубых гистограмм столбцов, точная корзина приводится
+/// к текущему x только когда в неё попадает искомый ранг.
+/// </summary>
+template<class Px>
+void PercentileFilter(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	int radiusX,
+	int radiusY,
+	double percentile)
+{
+	const int imageWidthPx = info.imageWidthPx;
+	const int imageHeightPx = info.imageHeightPx;
+	const int windowWidth = 2 * radiusX + 1;
+	const int windowHeight = 2 * radiusY + 1;
+
+	// У всех форматов канал занимает байт, поэтому соседний пиксель
+	// того же канала отстоит на ChannelCount значений
+	int rowWidth = imageWidthPx * Px::ChannelCount;
+	uint32_t rank = PercentileRank(percentile, (int64_t)windowWidth * windowHeight);
+
+	vector<uint8_t> rows((size_t)windowHeight * info.imageWidthBytes);
+	vector<uint16_t> columnFine((size_t)rowWidth * HistogramBinsCount);
+	vector<uint16_t> columnCoarse((size_t)rowWidth * CoarseBinsCount);
+
+	int readRowsCount = 0;
+
+	auto ringRow = [&](int imageRow)
+		{
+			return &rows[(size_t)(imageRow % windowHeight) * info.imageWidthBytes];
+		};
+
+	auto readRow = [&]()
+		{
+			src.read((char*)ringRow(readRowsCount), info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+			readRowsCount++;
+		};
+
+	auto updateColumns = [&](int imageRow, int delta)
+		{
+			UpdateColumnHistograms(ringRow(imageRow), rowWidth, delta,
+				columnFine.data(), columnCoarse.data());
+		};
+
+	uint32_t kernelCoarse[CoarseBinsCount];
+	uint32_t kernelFine[HistogramBinsCount];
+
+	// x, к которому приведена точная корзина гистограммы ядра
+	int fineX[CoarseBinsCount];
+
+	for (int y = 0; y < imageHeightPx; y++)
+	{
+		if (y == 0)
+		{
+			while (readRowsCount < imageHeightPx && readRowsCount <= radiusY)
+			{
+				readRow();
+			}
+
+			for (int i = -radiusY; i <= radiusY; i++)
+			{
+				updateColumns(MirrorIndex(i, imageHeightPx), 1);
+			}
+		}
+		else
+		{
+			// Уходящая строка вычитается до того, как её место в кольце займёт новая
+			updateColumns(MirrorIndex(y - 1 - radiusY, imageHeightPx), -1);
+
+			if (readRowsCount < imageHeightPx)
+			{
+				readRow();
+			}
+
+			updateColumns(MirrorIndex(y + radiusY, imageHeightPx), 1);
+		}
+
+		uint8_t* destRow = dest.Rows(y, 1);
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			auto column = [&](int x)
+				{
+					return (size_t)MirrorIndex(x, imageWidthPx) * Px::ChannelCount + c;
+				};
+
+			std::fill(std::begin(kernelCoarse), std::end(kernelCoarse), 0);
+			std::fill(std::begin(fineX), std::end(fineX), INT32_MIN);
+
+			for (int j = -radiusX; j <= radiusX; j++)
+			{
+				const uint16_t* coarse = &columnCoarse[column(j) * CoarseBinsCount];
+
+				for (int b = 0; b < CoarseBinsCount; b++)
+				{
+					kernelCoarse[b] += coarse[b];
+				}
+			}
+
+			for (int x = 0; x < imageWidthPx; x++)
+			{
+				uint32_t count = 0;
+				int b = 0;
+
+				while (count + kernelCoarse[b] <= rank)
+				{
+					count += kernelCoarse[b++];
+				}
+
+				uint32_t* fine = &kernelFine[b * FineBinsPerCoarse];
+
+				// Сдвиг на d столбцов - 2 * d гистограмм столбцов, пересчёт - windowWidth
+				if ((int64_t)x - fineX[b] > windowWidth / 2)
+				{
+					std::fill(fine, fine + FineBinsPerCoarse, 0);
+
+					for (int j = x - radiusX; j <= x + radiusX; j++)
+					{
+						const uint16_t* columnBins = &columnFine[column(j) * HistogramBinsCount + b * FineBinsPerCoarse];
+
+						for (int i = 0; i < FineBinsPerCoarse; i++)
+						{
+							fine[i] += columnBins[i];
+						}
+					}
+				}
+				else
+				{
+					for (int t = fineX[b] + 1; t <= x; t++)
+					{
+						const uint16_t* addend = &columnFine[column(t + radiusX) * HistogramBinsCount + b * FineBinsPerCoarse];
+						const uint16_t* subtrahend = &columnFine[column(t - 1 - radiusX) * HistogramBinsCount + b * FineBinsPerCoarse];
+
+						for (int i = 0; i < FineBinsPerCoarse; i++)
+						{
+							fine[i] += addend[i] - subtrahend[i];
+						}
+					}
+				}
+
+				fineX[b] = x;
+
+				int i = 0;
+
+				while (count + fine[i] <= rank)
+				{
+					count += fine[i++];
+				}
+
+				destRow[x * Px::BytePerPx + c] = (uint8_t)(b * FineBinsPerCoarse + i);
+
+				if (x + 1 < imageWidthPx)
+				{
+					const uint16_t* addend = &columnCoarse[column(x + 1 + radiusX) * CoarseBinsCount];
+					const uint16_t* subtrahend = &columnCoarse[column(x - radiusX) * CoarseBinsCount];
+
+					for (int k = 0; k < CoarseBinsCount; k++)
+					{
+						kernelCoarse[k] += addend[k] - subtrahend[k];
+					}
+				}
+			}
+		}
+
+		dest.CommitRows();
+	}
+}
+
+/// <summary>
+/// Процентильный фильтр по окну (2 * radiusX + 1) x (2 * radiusY + 1) с отражёнными краями.
+/// percentile от 0 (минимум) до 100 (максимум), 50 - медиана.
+/// </summary>
+void PercentileFilter(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	int radiusX,
+	int radiusY,
+	double percentile,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	if (radiusX < 0 || radiusY < 0)
+	{
+		throw std::invalid_argument("Радиус окна не может быть отрицательным");
+	}
+	if (radiusY > MaxRankRadiusY)
+	{
+		throw std::invalid_argument("Вертикальный радиус окна слишком велик");
+	}
+	if (!(percentile >= 0 && percentile <= 100))
+	{
+		throw std::invalid_argument("Процентиль должен быть от 0 до 100");
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	if (radiusX > info.imageWidthPx ||
+		radiusY > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			FilterInBands(srcPath, src, destFile, info,
+				KernelBandHalo(2 * radiusY + 1, radiusY), threadsCount,
+				[&](std::istream& bandSrc, BmpRowWriter& bandDest, const BmpImageInfo& bandInfo)
+				{
+					PercentileFilter<decltype(format)>(bandSrc, bandDest, bandInfo,
+						radiusX, radiusY, percentile);
+				});
+		});
+}
+
+void MedianFilter(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	int radiusX,
+	int radiusY,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	PercentileFilter(srcPath, destPath, radiusX, radiusY, 50, backend, threadsCount);
+}
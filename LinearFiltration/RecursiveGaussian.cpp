@@ -0,0 +1,208 @@
+#include "RecursiveGaussian.h"
+
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+#include <algorithm>
+
+using std::vector;
+
+namespace
+{
+	using ComplexPole = std::complex<double>;
+
+	// Полюса для sigma = 2 (van Vliet, Young, Verbeek, 1998),
+	// комплексные полюса идут сопряжёнными парами
+	const double BasePolesSigma = 2.0;
+
+	vector<ComplexPole> BasePoles(RecursiveGaussianOrder order)
+	{
+		switch (order)
+		{
+		case RecursiveGaussianOrder::Third:
+			return {
+				{ 1.41650, 1.00829 }, { 1.41650, -1.00829 },
+				{ 1.86543, 0 } };
+
+		case RecursiveGaussianOrder::Fourth:
+			return {
+				{ 1.13228, 1.28114 }, { 1.13228, -1.28114 },
+				{ 1.78534, 0.46763 }, { 1.78534, -0.46763 } };
+
+		case RecursiveGaussianOrder::Fifth:
+			return {
+				{ 0.86430, 1.45389 }, { 0.86430, -1.45389 },
+				{ 1.61433, 0.83134 }, { 1.61433, -0.83134 },
+				{ 1.87504, 0 } };
+		}
+
+		throw std::invalid_argument("Неизвестный порядок рекурсивного фильтра");
+	}
+
+	vector<ComplexPole> ScalePoles(const vector<ComplexPole>& poles, double q)
+	{
+		vector<ComplexPole> scaledPoles;
+
+		for (const ComplexPole& pole : poles)
+		{
+			scaledPoles.push_back(std::polar(std::pow(std::abs(pole), 1 / q), std::arg(pole) / q));
+		}
+
+		return scaledPoles;
+	}
+
+	// Дисперсия прямого и обратного проходов вместе
+	double Variance(const vector<ComplexPole>& poles)
+	{
+		ComplexPole variance = 0;
+
+		for (const ComplexPole& pole : poles)
+		{
+			variance += 2.0 * pole / ((pole - 1.0) * (pole - 1.0));
+		}
+
+		return variance.real();
+	}
+}
+
+RecursiveGaussian::RecursiveGaussian(double sigma, RecursiveGaussianOrder order)
+{
+	if (!(sigma >= MinRecursiveGaussianSigma))
+	{
+		throw std::invalid_argument("Sigma рекурсивного фильтра должно быть не меньше 0.5");
+	}
+
+	vector<ComplexPole> basePoles = BasePoles(order);
+	order_ = (int)basePoles.size();
+
+	// Дисперсия растёт с q монотонно, q подбирается делением отрезка
+	double minQ = 0.01;
+	double maxQ = 10 * sigma / BasePolesSigma + 10;
+
+	for (int i = 0; i < 100; i++)
+	{
+		double q = (minQ + maxQ) / 2;
+
+		if (Variance(ScalePoles(basePoles, q)) < sigma * sigma)
+		{
+			minQ = q;
+		}
+		else
+		{
+			maxQ = q;
+		}
+	}
+
+	vector<ComplexPole> poles = ScalePoles(basePoles, (minQ + maxQ) / 2);
+
+	// Сопряжённые пары дают звено (1 - 2 Re(1 / d) z^-1 + |1 / d|^2 z^-2),
+	// вещественный полюс - звено (1 - z^-1 / d). Усиление каждого звена единичное
+	for (size_t i = 0; i < poles.size(); i++)
+	{
+		ComplexPole inversePole = 1.0 / poles[i];
+		Section section{};
+
+		if (poles[i].imag() != 0)
+		{
+			double a1 = -2 * inversePole.real();
+			double a2 = std::norm(inversePole);
+
+			section.order = 2;
+			section.gain = (float)(1 + a1 + a2);
+			section.feedback[0] = (float)-a1;
+			section.feedback[1] = (float)-a2;
+
+			// Вторая из пары уже учтена
+			i++;
+		}
+		else
+		{
+			section.order = 1;
+			section.gain = (float)(1 - inversePole.real());
+			section.feedback[0] = (float)inversePole.real();
+		}
+
+		sections_.push_back(section);
+	}
+
+	// Импульсная характеристика затухает как |1 / d|^n по ближайшему к единице полюсу
+	double minPoleAbs = std::abs(*std::min_element(poles.begin(), poles.end(),
+		[](const ComplexPole& a, const ComplexPole& b) { return std::abs(a) < std::abs(b); }));
+
+	marginLength_ = (int)std::ceil(std::log(1e4) / std::log(minPoleAbs)) + order_;
+}
+
+int RecursiveGaussian::Order() const noexcept
+{
+	return order_;
+}
+
+int RecursiveGaussian::MarginLength() const noexcept
+{
+	return marginLength_;
+}
+
+void RecursiveGaussian::FilterSequence(float* samples, int length, int lanesCount) const
+{
+	// Значения до начала прохода считаются равными первому отсчёту. На постоянном
+	// сигнале звено с единичным усилением его не меняет, поэтому первый отсчёт
+	// остаётся как есть, а индексы предыдущих ограничиваются нулём
+	const float* previousRows[2];
+
+	// Прямые проходы звеньев
+	for (const Section& section : sections_)
+	{
+		for (int n = 1; n < length; n++)
+		{
+			for (int k = 0; k < section.order; k++)
+			{
+				previousRows[k] = samples + (size_t)std::max(n - 1 - k, 0) * lanesCount;
+			}
+
+			AccumulateRecursion(section, samples + (size_t)n * lanesCount, previousRows, lanesCount);
+		}
+	}
+
+	// Обратные проходы
+	for (const Section& section : sections_)
+	{
+		for (int n = length - 2; n >= 0; n--)
+		{
+			for (int k = 0; k < section.order; k++)
+			{
+				previousRows[k] = samples + (size_t)std::min(n + 1 + k, length - 1) * lanesCount;
+			}
+
+			AccumulateRecursion(section, samples + (size_t)n * lanesCount, previousRows, lanesCount);
+		}
+	}
+}
+
+void RecursiveGaussian::AccumulateRecursion(
+	const Section& section,
+	float* current,
+	const float* const* previousRows,
+	int lanesCount)
+{
+	if (section.order == 1)
+	{
+		const float* previous = previousRows[0];
+
+		for (int j = 0; j < lanesCount; j++)
+		{
+			current[j] = section.gain * current[j] + section.feedback[0] * previous[j];
+		}
+	}
+	else
+	{
+		const float* previous1 = previousRows[0];
+		const float* previous2 = previousRows[1];
+
+		for (int j = 0; j < lanesCount; j++)
+		{
+			current[j] = section.gain * current[j] +
+				section.feedback[0] * previous1[j] +
+				section.feedback[1] * previous2[j];
+		}
+	}
+}
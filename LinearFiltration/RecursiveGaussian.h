@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+
+/// <summary>
+/// Порядок рекурсивного гауссова фильтра: число полюсов каждого из проходов.
+/// Больший порядок точнее приближает гауссиану, время растёт линейно с порядком.
+/// </summary>
+enum class RecursiveGaussianOrder
+{
+	// Самый быстрый, но у резких краёв отличается от гауссианы на несколько уровней яркости
+	Third = 3,
+	// Отличается не больше чем на 1, изредка на 2 у резких краёв
+	Fourth = 4,
+	// Отличается не больше чем на 1
+	Fifth = 5
+};
+
+// Меньшие sigma рекурсивный фильтр приближает плохо
+const double MinRecursiveGaussianSigma = 0.5;
+
+/// <summary>
+/// Индекс после зеркального отражения на любом удалении от краёв (период 2 * size).
+/// </summary>
+inline int ReflectIndex(int index, int size)
+{
+	int period = 2 * size;
+
+	index %= period;
+	if (index < 0)
+	{
+		index += period;
+	}
+
+	return index < size ? index : period - 1 - index;
+}
+
+/// <summary>
+/// Рекурсивный гауссов фильтр Янга - ван Влиета: прямой каузальный проход и обратный
+/// антикаузальный с одинаковыми коэффициентами. Полюса взяты для sigma = 2 и возводятся
+/// в степень 1 / q так, чтобы дисперсия фильтра равнялась sigma^2, поэтому число операций
+/// на отсчёт не зависит от sigma.
+/// </summary>
+class RecursiveGaussian
+{
+private:
+	/// <summary>
+	/// Звено первого (вещественный полюс) или второго (пара сопряжённых) порядка:
+	/// w[n] = gain * x[n] + сумма feedback[k] * w[n - 1 - k].
+	/// Высокий порядок одним многочленом при sigma в десятки пикселей
+	/// теряет устойчивость из-за округления коэффициентов во float.
+	/// </summary>
+	struct Section
+	{
+		int order;
+		float gain;
+		float feedback[2];
+	};
+
+	int order_;
+	std::vector<Section> sections_;
+
+	// Число отражённых отсчётов перед и после последовательности, за которое
+	// влияние нулевых начальных условий затухает до неразличимого
+	int marginLength_;
+
+	static void AccumulateRecursion(
+		const Section& section,
+		float* current,
+		const float* const* previousRows,
+		int lanesCount);
+
+public:
+	RecursiveGaussian(double sigma, RecursiveGaussianOrder order);
+
+	int Order() const noexcept;
+
+	int MarginLength() const noexcept;
+
+	/// <summary>
+	/// Прямой и обратный проходы на месте по последовательности из length отсчётов.
+	/// Отсчёт n - это lanesCount соседних значений samples[n * lanesCount + j],
+	/// которые фильтруются независимо (строки блока или столбцы полосы).
+	/// Края уже должны быть расширены на MarginLength() отсчётов.
+	/// </summary>
+	void FilterSequence(float* samples, int length, int lanesCount) const;
+};
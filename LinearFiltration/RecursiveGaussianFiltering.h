@@ -0,0 +1,319 @@
+#pragma once
+
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+#include "RecursiveGaussian.h"
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "SimdConvolution.h"
+#include "BandFiltering.h"
+
+using std::vector;
+
+// Столько строк фильтруются по горизонтали одновременно, как значения одного отсчёта
+const int RecursiveRowsPerBlock = 16;
+
+// Полоса столбцов для вертикального прохода: отсчёты полосы с отражёнными краями
+// должны умещаться в кэше второго уровня
+const int64_t RecursiveColumnBandBytes = 1 << 20;
+const int RecursiveMaxColumnsPerBand = 256;
+
+// Полоса строк для вертикального прохода. Перекрытие соседних полос по MarginLength() строк
+// с каждой стороны считается заново, поэтому полоса во столько раз длиннее перекрытия
+const int RecursiveStripToMarginRatio = 8;
+const int RecursiveMinStripRows = 256;
+
+inline int RecursiveColumnsPerBand(int rowsCount, const RecursiveGaussian& filter)
+{
+	int64_t sequenceBytes = (int64_t)(rowsCount + 2 * filter.MarginLength()) * sizeof(float);
+	int64_t columnsCount = RecursiveColumnBandBytes / sequenceBytes / FloatLanes * FloatLanes;
+
+	return (int)std::clamp<int64_t>(columnsCount, FloatLanes, RecursiveMaxColumnsPerBand);
+}
+
+inline int RecursiveStripRows(int imageHeightPx, int marginLength)
+{
+	int stripRows = std::max(RecursiveMinStripRows, RecursiveStripToMarginRatio * marginLength);
+
+	return std::min(stripRows, imageHeightPx);
+}
+
+/// <summary>
+/// Горизонтальный проход по блокам строк [firstBlock, endBlock) плоскости.
+/// Строки блока переставляются так, что отсчёт x всех строк лежит подряд,
+/// края расширяются отражением на MarginLength() отсчётов.
+/// </summary>
+inline void FilterPlaneRows(
+	float* plane,
+	int widthPx,
+	int heightPx,
+	int firstBlock,
+	int endBlock,
+	const RecursiveGaussian& filter,
+	vector<float>& samples)
+{
+	int marginLength = filter.MarginLength();
+	int length = widthPx + 2 * marginLength;
+
+	for (int block = firstBlock; block < endBlock; block++)
+	{
+		int firstRow = block * RecursiveRowsPerBlock;
+		int rowsCount = std::min(RecursiveRowsPerBlock, heightPx - firstRow);
+		const float* blockRows = plane + (size_t)firstRow * widthPx;
+
+		samples.resize((size_t)length * rowsCount);
+
+		for (int n = 0; n < length; n++)
+		{
+			int x = ReflectIndex(n - marginLength, widthPx);
+
+			for (int r = 0; r < rowsCount; r++)
+			{
+				samples[(size_t)n * rowsCount + r] = blockRows[(size_t)r * widthPx + x];
+			}
+		}
+
+		filter.FilterSequence(samples.data(), length, rowsCount);
+
+		for (int r = 0; r < rowsCount; r++)
+		{
+			float* row = plane + (size_t)(firstRow + r) * widthPx;
+
+			for (int x = 0; x < widthPx; x++)
+			{
+				row[x] = samples[(size_t)(x + marginLength) * rowsCount + r];
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Вертикальный проход по полосам столбцов [firstBand, endBand) для строк
+/// [firstRow, firstRow + rowsCount) изображения высотой heightPx. Строки берутся из окна
+/// плоскости, которое начинается со строки windowFirstRow и захватывает MarginLength() строк
+/// над и под полосой (у краёв изображения - отражённых). Рекурсия идёт по строкам
+/// и векторизуется по столбцам полосы, результат пишется в stripPlane с первой строки.
+/// </summary>
+inline void FilterPlaneColumns(
+	const float* windowPlane,
+	int windowFirstRow,
+	float* stripPlane,
+	int widthPx,
+	int heightPx,
+	int firstRow,
+	int rowsCount,
+	int columnsPerBand,
+	int firstBand,
+	int endBand,
+	const RecursiveGaussian& filter,
+	vector<float>& samples)
+{
+	int marginLength = filter.MarginLength();
+	int length = rowsCount + 2 * marginLength;
+
+	for (int band = firstBand; band < endBand; band++)
+	{
+		int firstColumn = band * columnsPerBand;
+		int columnsCount = std::min(columnsPerBand, widthPx - firstColumn);
+
+		samples.resize((size_t)length * columnsCount);
+
+		for (int n = 0; n < length; n++)
+		{
+			int y = ReflectIndex(firstRow + n - marginLength, heightPx);
+			const float* row = windowPlane + (size_t)(y - windowFirstRow) * widthPx;
+
+			std::copy(row + firstColumn, row + firstColumn + columnsCount,
+				samples.begin() + (size_t)n * columnsCount);
+		}
+
+		filter.FilterSequence(samples.data(), length, columnsCount);
+
+		for (int y = 0; y < rowsCount; y++)
+		{
+			const float* filteredRow = samples.data() + (size_t)(y + marginLength) * columnsCount;
+
+			std::copy(filteredRow, filteredRow + columnsCount,
+				stripPlane + (size_t)y * widthPx + firstColumn);
+		}
+	}
+}
+
+/// <summary>
+/// Рекурсивное гауссово размытие. Горизонтальному проходу нужны целые строки, и он
+/// выполняется над каждой строкой один раз при чтении. Вертикальный проход идёт полосами
+/// строк с перекрытием MarginLength(), на котором отклик фильтра затухает до 1e-4, поэтому
+/// в памяти держится окно из полосы и двух перекрытий в плоскостях каналов, а не всё изображение. Строки блоков и полосы столбцов делятся между потоками.
+/// Отсутствующий фильтр означает отсутствие размытия по этой оси.
+/// </summary>
+template<class Px>
+void RecursiveGaussianBlur(
+	std::istream& src,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const std::optional<RecursiveGaussian>& filterX,
+	const std::optional<RecursiveGaussian>& filterY,
+	int threadsCount)
+{
+	const int imageWidthPx = info.imageWidthPx;
+	const int imageHeightPx = info.imageHeightPx;
+	const int marginLength = filterY ? filterY->MarginLength() : 0;
+	const int stripRows = RecursiveStripRows(imageHeightPx, marginLength);
+	const int windowRows = std::min(imageHeightPx, stripRows + 2 * marginLength);
+	const size_t planeSize = (size_t)imageWidthPx * windowRows;
+
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+
+	// Строки изображения [windowFirstRow, readRowsCount) после горизонтального прохода
+	vector<float> window(planeSize * Px::ChannelCount);
+	int windowFirstRow = 0;
+	int readRowsCount = 0;
+
+	// Результат вертикального прохода полосы. Окно ещё нужно следующей полосе,
+	// и только последняя полоса пишется в него на месте
+	vector<float> strip(filterY && stripRows < imageHeightPx ? window.size() : 0);
+
+	for (int firstRow = 0; firstRow < imageHeightPx; firstRow += stripRows)
+	{
+		const int rowsCount = std::min(stripRows, imageHeightPx - firstRow);
+		const int neededFirstRow = std::max(0, firstRow - marginLength);
+		const int neededEndRow = std::min(imageHeightPx, firstRow + rowsCount + marginLength);
+
+		if (neededFirstRow > windowFirstRow)
+		{
+			size_t droppedSize = (size_t)(neededFirstRow - windowFirstRow) * imageWidthPx;
+			size_t keptSize = (size_t)(readRowsCount - neededFirstRow) * imageWidthPx;
+
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				float* plane = window.data() + planeSize * c;
+				std::copy(plane + droppedSize, plane + droppedSize + keptSize, plane);
+			}
+
+			windowFirstRow = neededFirstRow;
+		}
+
+		const int newFirstRow = readRowsCount;
+
+		for (; readRowsCount < neededEndRow; readRowsCount++)
+		{
+			src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+
+			DeinterleaveRow<Px>(srcRowBuffer.data(),
+				window.data() + (size_t)(readRowsCount - windowFirstRow) * imageWidthPx,
+				(int)planeSize, imageWidthPx);
+		}
+
+		if (filterX && readRowsCount > newFirstRow)
+		{
+			float* newRows = window.data() + (size_t)(newFirstRow - windowFirstRow) * imageWidthPx;
+			int newRowsCount = readRowsCount - newFirstRow;
+			int blocksCount = (newRowsCount + RecursiveRowsPerBlock - 1) / RecursiveRowsPerBlock;
+
+			ParallelFor(blocksCount * Px::ChannelCount, threadsCount, [&](int first, int end)
+				{
+					vector<float> samples;
+
+					for (int i = first; i < end; i++)
+					{
+						FilterPlaneRows(newRows + planeSize * (i / blocksCount),
+							imageWidthPx, newRowsCount, i % blocksCount, i % blocksCount + 1,
+							*filterX, samples);
+					}
+				});
+		}
+
+		float* stripPlanes = window.data() + (size_t)(firstRow - windowFirstRow) * imageWidthPx;
+
+		if (filterY)
+		{
+			if (firstRow + rowsCount < imageHeightPx)
+			{
+				stripPlanes = strip.data();
+			}
+
+			int columnsPerBand = RecursiveColumnsPerBand(rowsCount, *filterY);
+			int bandsCount = (imageWidthPx + columnsPerBand - 1) / columnsPerBand;
+
+			ParallelFor(bandsCount * Px::ChannelCount, threadsCount, [&](int first, int end)
+				{
+					vector<float> samples;
+
+					for (int i = first; i < end; i++)
+					{
+						size_t planeOffset = planeSize * (i / bandsCount);
+
+						FilterPlaneColumns(window.data() + planeOffset, windowFirstRow,
+							stripPlanes + planeOffset, imageWidthPx, imageHeightPx, firstRow, rowsCount,
+							columnsPerBand, i % bandsCount, i % bandsCount + 1, *filterY, samples);
+					}
+				});
+		}
+
+		for (int y = 0; y < rowsCount; y++)
+		{
+			uint8_t* destRow = dest.Rows(firstRow + y, 1);
+
+			InterleaveRow<Px>(stripPlanes + (size_t)y * imageWidthPx, (int)planeSize,
+				destRow, imageWidthPx);
+
+			dest.CommitRows();
+		}
+	}
+}
+
+/// <summary>
+/// Гауссово размытие рекурсивным фильтром, время не зависит от sigma.
+/// Нулевое sigma отключает размытие по своей оси. Порядок по умолчанию - четвёртый,
+/// третий заметно ошибается у резких краёв.
+/// </summary>
+void RecursiveGaussianBlur(
+	const SourceImage& srcPath,
+	std::filesystem::path destPath,
+	double sigmaX,
+	double sigmaY,
+	RecursiveGaussianOrder order = RecursiveGaussianOrder::Fourth,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	std::optional<RecursiveGaussian> filterX;
+	std::optional<RecursiveGaussian> filterY;
+
+	if (sigmaX != 0)
+	{
+		filterX.emplace(sigmaX, order);
+	}
+	if (sigmaY != 0)
+	{
+		filterY.emplace(sigmaY, order);
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+	BmpRowWriter dest(destFile);
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			RecursiveGaussianBlur<decltype(format)>(src, dest, info, filterX, filterY, threadsCount);
+		});
+
+	dest.Flush();
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "EdgeMirroring.h"
+
+/// <summary>
+/// Как продолжается изображение за краем.
+/// </summary>
+enum class BorderMode
+{
+	// 1 0 | 0 1 2 | 2 1
+	Mirror,
+
+	// 0 0 | 0 1 2 | 2 2
+	Clamp,
+
+	// 1 2 | 0 1 2 | 0 1. Нужен противоположный край, поэтому изображение
+	// держится в памяти целиком и фильтруется одним потоком
+	Wrap,
+
+	// 0 0 | a b c | 0 0
+	Constant
+};
+
+/// <summary>
+/// Политики границы для RowRing и ExpandRowEdges: Index отображает индекс строки
+/// или столбца за краем в индекс внутри [0, size) либо в -1 - нулевое значение.
+/// IsPeriodic - нужен ли противоположный край.
+/// </summary>
+struct MirrorBorder
+{
+	static constexpr bool IsPeriodic = false;
+
+	static int Index(int index, int size)
+	{
+		return MirrorIndex(index, size);
+	}
+};
+
+struct ClampBorder
+{
+	static constexpr bool IsPeriodic = false;
+
+	static int Index(int index, int size)
+	{
+		return std::clamp(index, 0, size - 1);
+	}
+};
+
+struct WrapBorder
+{
+	static constexpr bool IsPeriodic = true;
+
+	static int Index(int index, int size)
+	{
+		index %= size;
+		return index < 0 ? index + size : index;
+	}
+};
+
+struct ConstantBorder
+{
+	static constexpr bool IsPeriodic = false;
+
+	static int Index(int index, int size)
+	{
+		return index < 0 || index >= size ? -1 : index;
+	}
+};
+
+/// <summary>
+/// Вызывает fn с объектом политики, соответствующей mode.
+/// </summary>
+template<class Fn>
+void DispatchBorderMode(BorderMode mode, Fn&& fn)
+{
+	switch (mode)
+	{
+	case BorderMode::Clamp:
+		fn(ClampBorder{});
+		break;
+	case BorderMode::Wrap:
+		fn(WrapBorder{});
+		break;
+	case BorderMode::Constant:
+		fn(ConstantBorder{});
+		break;
+	default:
+		fn(MirrorBorder{});
+		break;
+	}
+}
+
+/// <summary>
+/// Заполняет по политике Border края строки, расширенной на horizontalRadius
+/// пикселей с каждой стороны. Для MirrorBorder совпадает с MirrorEdgePixelsInRow.
+/// </summary>
+template<class Px, class Border>
+void ExpandRowEdges(
+	uint8_t* expandedRow,
+	int imageWidthPx,
+	int horizontalRadius)
+{
+	auto fillPixel = [&](int expandedX)
+		{
+			int x = Border::Index(expandedX - horizontalRadius, imageWidthPx);
+			uint8_t* pixel = expandedRow + expandedX * Px::BytePerPx;
+
+			if (x < 0)
+			{
+				std::memset(pixel, 0, Px::BytePerPx);
+			}
+			else
+			{
+				std::memcpy(pixel, expandedRow + (x + horizontalRadius) * Px::BytePerPx, Px::BytePerPx);
+			}
+		};
+
+	for (int x = 0; x < horizontalRadius; x++)
+	{
+		fillPixel(x);
+	}
+
+	for (int x = imageWidthPx + horizontalRadius; x < imageWidthPx + 2 * horizontalRadius; x++)
+	{
+		fillPixel(x);
+	}
+}
+
+/// <summary>
+/// Кольцо строк потокового фильтра. Строки изображения добавляются по порядку,
+/// окно строк выдаётся по виртуальным индексам (в том числе за краями изображения),
+/// которые политика Border отображает в строки кольца, поэтому отражение и прочие
+/// края ничего не копируют. За краем ConstantBorder выдаётся нулевая строка.
+/// Кольцо хранит windowHeight + extraRowsCount последних строк (extraRowsCount -
+/// строки, которые ещё нужны после выхода из окна, например вычитаемая из скользящей суммы),
+/// для периодической границы - всё изображение.
+/// </summary>
+template<class T, class Border>
+class RowRing
+{
+private:
+	int rowWidth_;
+	int imageHeightPx_;
+	int slotsCount_;
+
+	std::vector<T> slots_;
+	std::vector<T> zeroRow_;
+
+	int pushedRowsCount_ = 0;
+
+public:
+	RowRing(int rowWidth, int imageHeightPx, int windowHeight, int extraRowsCount = 0)
+		: rowWidth_(rowWidth),
+		imageHeightPx_(imageHeightPx),
+		slotsCount_(Border::IsPeriodic
+			? imageHeightPx
+			: std::min(windowHeight + extraRowsCount, imageHeightPx)),
+		slots_((size_t)slotsCount_ * rowWidth),
+		zeroRow_(rowWidth)
+	{
+	}
+
+	int PushedRowsCount() const noexcept
+	{
+		return pushedRowsCount_;
+	}
+
+	/// <summary>
+	/// Место для следующей строки изображения, заполняется вызывающим.
+	/// </summary>
+	T* AppendRow()
+	{
+		T* row = &slots_[(size_t)(pushedRowsCount_ % slotsCount_) * rowWidth_];
+
+		pushedRowsCount_++;
+		return row;
+	}
+
+	/// <summary>
+	/// Строка с виртуальным индексом virtualRow (должна быть уже добавлена и ещё не вытеснена).
+	/// </summary>
+	const T* Row(int virtualRow) const
+	{
+		int imageRow = Border::Index(virtualRow, imageHeightPx_);
+
+		return imageRow < 0
+			? zeroRow_.data()
+			: &slots_[(size_t)(imageRow % slotsCount_) * rowWidth_];
+	}
+
+	/// <summary>
+	/// Добавлены ли все строки окна [firstVirtualRow, firstVirtualRow + rowsCount).
+	/// </summary>
+	bool HasWindow(int firstVirtualRow, int rowsCount) const
+	{
+		if (pushedRowsCount_ == imageHeightPx_)
+		{
+			return true;
+		}
+
+		for (int i = 0; i < rowsCount; i++)
+		{
+			if (Border::Index(firstVirtualRow + i, imageHeightPx_) >= pushedRowsCount_)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/// <summary>
+	/// Указатели на строки окна [firstVirtualRow, firstVirtualRow + rowsCount) для внутренних
+	/// циклов: кольцо индексируется один раз на строку окна, а не на значение.
+	/// </summary>
+	void Window(int firstVirtualRow, int rowsCount, const T** rows) const
+	{
+		for (int i = 0; i < rowsCount; i++)
+		{
+			rows[i] = Row(firstVirtualRow + i);
+		}
+	}
+};
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#include <immintrin.h>
+#define CONVOLUTION_AVX2
+#endif
+
+// Число float в одном векторном регистре AVX
+const int FloatLanes = 8;
+
+// Число int16 в одном векторном регистре AVX2
+const int Int16Lanes = 16;
+
+/// <summary>
+/// Раскладывает каналы строки по плоскостям: planes[c * planeStride + x] = row[x * BytePerPx + c].
+/// </summary>
+template<class Px>
+void DeinterleaveRow(const uint8_t* row, float* planes, int planeStride, int widthPx)
+{
+	for (int c = 0; c < Px::ChannelCount; c++)
+	{
+		float* plane = planes + (size_t)planeStride * c;
+
+		for (int x = 0; x < widthPx; x++)
+		{
+			plane[x] = row[(size_t)x * Px::BytePerPx + c];
+		}
+	}
+}
+
+/// <summary>
+/// Собирает строку из плоскостей каналов с округлением и ограничением [0, 255].
+/// </summary>
+template<class Px>
+void InterleaveRow(const float* planes, int planeStride, uint8_t* row, int widthPx)
+{
+	for (int c = 0; c < Px::ChannelCount; c++)
+	{
+		const float* plane = planes + (size_t)planeStride * c;
+
+		for (int x = 0; x < widthPx; x++)
+		{
+			row[(size_t)x * Px::BytePerPx + c] = (uint8_t)std::clamp(plane[x] + 0.5f, 0.f, 255.f);
+		}
+	}
+}
+
+/// <summary>
+/// Горизонтальная свёртка плоскости: output[x] = сумма kernel[j] * input[x + j], x < widthPx.
+/// Коэффициент размножается на все элементы регистра, соседние x считаются параллельно.
+/// </summary>
+inline void ConvolvePlaneX(
+	const float* input,
+	float* output,
+	const float* kernel,
+	int kernelWidth,
+	int widthPx)
+{
+	int x = 0;
+
+#ifdef CONVOLUTION_AVX2
+	// Четыре независимых суммы скрывают задержку FMA
+	for (; x + 4 * FloatLanes <= widthPx; x += 4 * FloatLanes)
+	{
+		__m256 sums0 = _mm256_setzero_ps();
+		__m256 sums1 = _mm256_setzero_ps();
+		__m256 sums2 = _mm256_setzero_ps();
+		__m256 sums3 = _mm256_setzero_ps();
+
+		for (int j = 0; j < kernelWidth; j++)
+		{
+			__m256 coefficient = _mm256_set1_ps(kernel[j]);
+			const float* values = input + x + j;
+
+			sums0 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values), sums0);
+			sums1 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values + FloatLanes), sums1);
+			sums2 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values + 2 * FloatLanes), sums2);
+			sums3 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values + 3 * FloatLanes), sums3);
+		}
+
+		_mm256_storeu_ps(output + x, sums0);
+		_mm256_storeu_ps(output + x + FloatLanes, sums1);
+		_mm256_storeu_ps(output + x + 2 * FloatLanes, sums2);
+		_mm256_storeu_ps(output + x + 3 * FloatLanes, sums3);
+	}
+
+	for (; x + FloatLanes <= widthPx; x += FloatLanes)
+	{
+		__m256 sums = _mm256_setzero_ps();
+
+		for (int j = 0; j < kernelWidth; j++)
+		{
+			sums = _mm256_fmadd_ps(_mm256_set1_ps(kernel[j]), _mm256_loadu_ps(input + x + j), sums);
+		}
+
+		_mm256_storeu_ps(output + x, sums);
+	}
+#endif
+
+	for (; x < widthPx; x++)
+	{
+		float sum = 0;
+
+		for (int j = 0; j < kernelWidth; j++)
+		{
+			sum += kernel[j] * input[x + j];
+		}
+
+		output[x] = sum;
+	}
+}
+
+/// <summary>
+/// Вертикальная свёртка: output[x] += сумма kernel[i] * rows[i][x].
+/// Векторизована по столбцам, строки окна передаются указателями без индексации по модулю.
+/// </summary>
+inline void AccumulatePlaneY(
+	const float* const* rows,
+	const float* kernel,
+	int kernelHeight,
+	float* output,
+	int widthPx)
+{
+	int x = 0;
+
+#ifdef CONVOLUTION_AVX2
+	for (; x + 4 * FloatLanes <= widthPx; x += 4 * FloatLanes)
+	{
+		__m256 sums0 = _mm256_loadu_ps(output + x);
+		__m256 sums1 = _mm256_loadu_ps(output + x + FloatLanes);
+		__m256 sums2 = _mm256_loadu_ps(output + x + 2 * FloatLanes);
+		__m256 sums3 = _mm256_loadu_ps(output + x + 3 * FloatLanes);
+
+		for (int i = 0; i < kernelHeight; i++)
+		{
+			__m256 coefficient = _mm256_set1_ps(kernel[i]);
+			const float* values = rows[i] + x;
+
+			sums0 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values), sums0);
+			sums1 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values + FloatLanes), sums1);
+			sums2 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values + 2 * FloatLanes), sums2);
+			sums3 = _mm256_fmadd_ps(coefficient, _mm256_loadu_ps(values + 3 * FloatLanes), sums3);
+		}
+
+		_mm256_storeu_ps(output + x, sums0);
+		_mm256_storeu_ps(output + x + FloatLanes, sums1);
+		_mm256_storeu_ps(output + x + 2 * FloatLanes, sums2);
+		_mm256_storeu_ps(output + x + 3 * FloatLanes, sums3);
+	}
+
+	for (; x + FloatLanes <= widthPx; x += FloatLanes)
+	{
+		__m256 sums = _mm256_loadu_ps(output + x);
+
+		for (int i = 0; i < kernelHeight; i++)
+		{
+			sums = _mm256_fmadd_ps(_mm256_set1_ps(kernel[i]), _mm256_loadu_ps(rows[i] + x), sums);
+		}
+
+		_mm256_storeu_ps(output + x, sums);
+	}
+#endif
+
+	for (; x < widthPx; x++)
+	{
+		float sum = output[x];
+
+		for (int i = 0; i < kernelHeight; i++)
+		{
+			sum += kernel[i] * rows[i][x];
+		}
+
+		output[x] = sum;
+	}
+}
+
+/// <summary>
+/// Упаковывает коэффициенты int16 каждой строки ядра парами для pmaddwd:
+/// pair[p] = k[2p] | k[2p + 1] << 16, у нечётной ширины последняя пара дополнена нулём.
+/// </summary>
+inline std::vector<int32_t> PackCoefficientPairs(const int16_t* coefficients, int kernelHeight, int kernelWidth)
+{
+	int pairsCount = (kernelWidth + 1) / 2;
+	std::vector<int32_t> pairs((size_t)kernelHeight * pairsCount);
+
+	for (int i = 0; i < kernelHeight; i++)
+	{
+		for (int j = 0; j < kernelWidth; j++)
+		{
+			uint32_t coefficient = (uint16_t)coefficients[(size_t)i * kernelWidth + j];
+
+			pairs[(size_t)i * pairsCount + j / 2] |= (int32_t)(coefficient << (j % 2 * 16));
+		}
+	}
+
+	return pairs;
+}
+
+/// <summary>
+/// Целочисленная свёртка строк байтов: output[n] = (сумма k[i][j] * rows[i][n + j * tapStride]
+/// + 2^(shift - 1)) >> shift с ограничением [0, 255], n < count. Коэффициенты - пары из
+/// PackCoefficientPairs: pmaddwd умножает 16 значений int16 двух соседних отводов на пару
+/// коэффициентов и складывает произведения в 8 сумм int32.
+/// </summary>
+inline void ConvolveRowsFixedPoint(
+	const uint8_t* const* rows,
+	const int32_t* coefficientPairs,
+	int kernelHeight,
+	int kernelWidth,
+	int tapStride,
+	int shift,
+	uint8_t* output,
+	int count)
+{
+	int pairsCount = (kernelWidth + 1) / 2;
+	int32_t rounding = 1 << (shift - 1);
+	int n = 0;
+
+#ifdef CONVOLUTION_AVX2
+	int fullPairsCount = kernelWidth / 2;
+	__m256i roundingVector = _mm256_set1_epi32(rounding);
+	__m128i shiftCount = _mm_cvtsi32_si128(shift);
+
+	auto loadValues = [](const uint8_t* values)
+		{
+			return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)values));
+		};
+
+	for (; n + Int16Lanes <= count; n += Int16Lanes)
+	{
+		// unpacklo/unpackhi чередуют отводы внутри 128-битных половин регистра,
+		// поэтому sumsLow - суммы значений 0-3 и 8-11, sumsHigh - 4-7 и 12-15
+		__m256i sumsLow = _mm256_setzero_si256();
+		__m256i sumsHigh = _mm256_setzero_si256();
+
+		for (int i = 0; i < kernelHeight; i++)
+		{
+			const uint8_t* values = rows[i] + n;
+			const int32_t* pairs = coefficientPairs + (size_t)i * pairsCount;
+
+			for (int p = 0; p < fullPairsCount; p++)
+			{
+				__m256i first = loadValues(values + 2 * p * tapStride);
+				__m256i second = loadValues(values + (2 * p + 1) * tapStride);
+				__m256i coefficients = _mm256_set1_epi32(pairs[p]);
+
+				sumsLow = _mm256_add_epi32(sumsLow, _mm256_madd_epi16(_mm256_unpacklo_epi16(first, second), coefficients));
+				sumsHigh = _mm256_add_epi32(sumsHigh, _mm256_madd_epi16(_mm256_unpackhi_epi16(first, second), coefficients));
+			}
+
+			if (pairsCount != fullPairsCount)
+			{
+				__m256i last = loadValues(values + (kernelWidth - 1) * tapStride);
+				__m256i zero = _mm256_setzero_si256();
+				__m256i coefficients = _mm256_set1_epi32(pairs[fullPairsCount]);
+
+				sumsLow = _mm256_add_epi32(sumsLow, _mm256_madd_epi16(_mm256_unpacklo_epi16(last, zero), coefficients));
+				sumsHigh = _mm256_add_epi32(sumsHigh, _mm256_madd_epi16(_mm256_unpackhi_epi16(last, zero), coefficients));
+			}
+		}
+
+		sumsLow = _mm256_sra_epi32(_mm256_add_epi32(sumsLow, roundingVector), shiftCount);
+		sumsHigh = _mm256_sra_epi32(_mm256_add_epi32(sumsHigh, roundingVector), shiftCount);
+
+		// packs восстанавливает порядок 0-7 | 8-15, packus ограничивает [0, 255],
+		// перестановка собирает младшие 8 байт обеих половин
+		__m256i words = _mm256_packs_epi32(sumsLow, sumsHigh);
+		__m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0b1000);
+
+		_mm_storeu_si128((__m128i*)(output + n), _mm256_castsi256_si128(bytes));
+	}
+#endif
+
+	for (; n < count; n++)
+	{
+		int32_t sum = rounding;
+
+		for (int i = 0; i < kernelHeight; i++)
+		{
+			const uint8_t* values = rows[i] + n;
+			const int32_t* pairs = coefficientPairs + (size_t)i * pairsCount;
+
+			for (int j = 0; j < kernelWidth; j++)
+			{
+				int16_t coefficient = (int16_t)(pairs[j / 2] >> (j % 2 * 16));
+
+				sum += coefficient * values[j * tapStride];
+			}
+		}
+
+		output[n] = (uint8_t)std::clamp(sum >> shift, 0, 255);
+	}
+}
@@ -0,0 +1,484 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "RowRing.h"
+#include "SimdConvolution.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "BandFiltering.h"
+
+using std::vector;
+
+/// <summary>
+/// Статистика значений канала по окну.
+/// </summary>
+enum class LocalMoment
+{
+	Mean,
+
+	// Записывается делённой на 64: дисперсия 8-битных значений не больше 127.5^2
+	Variance,
+
+	// Среднеквадратическое отклонение, как в MovingRmse
+	StdDev,
+
+	// Коэффициент асимметрии, записывается как 128 + 32 * skewness
+	Skewness
+};
+
+/// <summary>
+/// Одно выходное изображение: статистика moment в файл destPath.
+/// </summary>
+struct LocalMomentOutput
+{
+	LocalMoment moment;
+	std::filesystem::path destPath;
+};
+
+const double VarianceOutputScale = 1.0 / 64;
+const double SkewnessOutputScale = 32;
+const double SkewnessOutputOffset = 128;
+
+// Степенные суммы до третьей, число double в векторном регистре AVX
+const int MaxMomentPowers = 3;
+const int DoubleLanes = 4;
+
+// Суммы меньше 2^52 переводятся в double точно, в том числе векторно
+const double MaxExactMomentSum = 4503599627370496.0;
+
+// Дисперсия меньше этой - погрешность округления ровной области, асимметрия в ней 0
+const double MinSkewnessVariance = 1e-6;
+
+/// <summary>
+/// Сколько степенных сумм (значений, квадратов, кубов) нужно статистике.
+/// </summary>
+inline int MomentPowersCount(LocalMoment moment)
+{
+	switch (moment)
+	{
+	case LocalMoment::Mean:
+		return 1;
+	case LocalMoment::Skewness:
+		return 3;
+	default:
+		return 2;
+	}
+}
+
+/// <summary>
+/// Скользящие по строке суммы p-х степеней значений канала по окну шириной windowWidth
+/// для p = 1..powersCount: сумма степени p пикселя x лежит в powerSums[(p - 1) * rowWidth + x * ChannelCount + c].
+/// powerTables[p - 1][v] = v^p, поэтому добавление и вычитание значения не ветвится по p.
+/// </summary>
+template<class Px>
+void SumColPowersInRow(
+	const uint8_t* expandedRow,
+	uint64_t* powerSums,
+	const uint64_t (*powerTables)[256],
+	int powersCount,
+	int windowWidth,
+	int imageWidthPx)
+{
+	int rowWidth = imageWidthPx * Px::ChannelCount;
+
+	for (int p = 0; p < powersCount; p++)
+	{
+		const uint64_t* powerTable = powerTables[p];
+		uint64_t* outputRow = powerSums + (size_t)p * rowWidth;
+		uint64_t sums[Px::ChannelCount]{};
+
+		// Проход для накопления первоначальной суммы
+		for (int j = 0; j < windowWidth; j++)
+		{
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				sums[c] += powerTable[expandedRow[j * Px::BytePerPx + c]];
+			}
+		}
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			outputRow[c] = sums[c];
+		}
+
+		// Основной проход скользящим окном
+		for (int x = 1; x < imageWidthPx; x++)
+		{
+			const uint8_t* subtrahend = expandedRow + (x - 1) * Px::BytePerPx;
+			const uint8_t* addend = expandedRow + (x + windowWidth - 1) * Px::BytePerPx;
+
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				sums[c] += powerTable[addend[c]] - powerTable[subtrahend[c]];
+
+				outputRow[x * Px::ChannelCount + c] = sums[c];
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Статистики строки, вычисленные по степенным суммам окна.
+/// Заполнены только те, для которых хватает степенных сумм.
+/// </summary>
+struct LocalMomentsRow
+{
+	vector<double> mean;
+	vector<double> variance;
+	vector<double> stdDev;
+	vector<double> skewness;
+
+	explicit LocalMomentsRow(int count)
+		: mean(count),
+		variance(count),
+		stdDev(count),
+		skewness(count)
+	{
+	}
+
+	const double* Values(LocalMoment moment) const
+	{
+		switch (moment)
+		{
+		case LocalMoment::Variance:
+			return variance.data();
+		case LocalMoment::StdDev:
+			return stdDev.data();
+		case LocalMoment::Skewness:
+			return skewness.data();
+		default:
+			return mean.data();
+		}
+	}
+};
+
+/// <summary>
+/// Статистики count значений по степенным суммам окна площади area (суммы степени p
+/// с (p - 1) * count): mean = S1 / n, variance = S2 / n - mean^2,
+/// третий центральный момент = S3 / n - mean * (3 * S2 / n - 2 * mean^2).
+/// </summary>
+inline void ComputeMomentsRow(
+	const uint64_t* windowSums,
+	int powersCount,
+	int count,
+	double area,
+	LocalMomentsRow& moments)
+{
+	const uint64_t* sums = windowSums;
+	const uint64_t* sumsOfSquares = windowSums + count;
+	const uint64_t* sumsOfCubes = windowSums + 2 * (size_t)count;
+
+	double inverseArea = 1 / area;
+	int n = 0;
+
+#ifdef CONVOLUTION_AVX2
+	// Целое v < 2^52 в мантиссе числа 2^52 даёт double 2^52 + v
+	const __m256i exponentBits = _mm256_set1_epi64x(0x4330000000000000);
+	const __m256d exponentValue = _mm256_set1_pd(MaxExactMomentSum);
+
+	auto loadDoubles = [&](const uint64_t* values)
+		{
+			__m256i integers = _mm256_loadu_si256((const __m256i*)values);
+
+			return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(integers, exponentBits)), exponentValue);
+		};
+
+	const __m256d inverse = _mm256_set1_pd(inverseArea);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d two = _mm256_set1_pd(2);
+	const __m256d three = _mm256_set1_pd(3);
+	const __m256d minVariance = _mm256_set1_pd(MinSkewnessVariance);
+
+	for (; n + DoubleLanes <= count; n += DoubleLanes)
+	{
+		__m256d mean = _mm256_mul_pd(loadDoubles(sums + n), inverse);
+		_mm256_storeu_pd(&moments.mean[n], mean);
+
+		if (powersCount < 2)
+		{
+			continue;
+		}
+
+		__m256d meanOfSquares = _mm256_mul_pd(loadDoubles(sumsOfSquares + n), inverse);
+		__m256d variance = _mm256_max_pd(_mm256_sub_pd(meanOfSquares, _mm256_mul_pd(mean, mean)), zero);
+		__m256d stdDev = _mm256_sqrt_pd(variance);
+
+		_mm256_storeu_pd(&moments.variance[n], variance);
+		_mm256_storeu_pd(&moments.stdDev[n], stdDev);
+
+		if (powersCount < 3)
+		{
+			continue;
+		}
+
+		__m256d meanOfCubes = _mm256_mul_pd(loadDoubles(sumsOfCubes + n), inverse);
+		__m256d thirdMoment = _mm256_sub_pd(meanOfCubes, _mm256_mul_pd(mean,
+			_mm256_sub_pd(_mm256_mul_pd(three, meanOfSquares), _mm256_mul_pd(two, _mm256_mul_pd(mean, mean)))));
+		__m256d skewness = _mm256_div_pd(thirdMoment, _mm256_mul_pd(variance, stdDev));
+
+		skewness = _mm256_and_pd(skewness, _mm256_cmp_pd(variance, minVariance, _CMP_GE_OQ));
+		_mm256_storeu_pd(&moments.skewness[n], skewness);
+	}
+#endif
+
+	for (; n < count; n++)
+	{
+		double mean = sums[n] * inverseArea;
+		moments.mean[n] = mean;
+
+		if (powersCount < 2)
+		{
+			continue;
+		}
+
+		double meanOfSquares = sumsOfSquares[n] * inverseArea;
+		double variance = std::max(meanOfSquares - mean * mean, 0.0);
+		double stdDev = std::sqrt(variance);
+
+		moments.variance[n] = variance;
+		moments.stdDev[n] = stdDev;
+
+		if (powersCount < 3)
+		{
+			continue;
+		}
+
+		double meanOfCubes = sumsOfCubes[n] * inverseArea;
+		double thirdMoment = meanOfCubes - mean * (3 * meanOfSquares - 2 * (mean * mean));
+
+		moments.skewness[n] = variance >= MinSkewnessVariance ? thirdMoment / (variance * stdDev) : 0;
+	}
+}
+
+/// <summary>
+/// Записывает статистику moment строки в 8-битную строку вывода (значение n - байт n строки).
+/// </summary>
+inline void WriteMomentRow(LocalMoment moment, const LocalMomentsRow& moments, uint8_t* destRow, int count)
+{
+	double scale = 1;
+	double offset = 0;
+
+	if (moment == LocalMoment::Variance)
+	{
+		scale = VarianceOutputScale;
+	}
+	else if (moment == LocalMoment::Skewness)
+	{
+		scale = SkewnessOutputScale;
+		offset = SkewnessOutputOffset;
+	}
+
+	const double* values = moments.Values(moment);
+
+	for (int n = 0; n < count; n++)
+	{
+		destRow[n] = (uint8_t)std::clamp(offset + scale * values[n] + 0.5, 0.0, 255.0);
+	}
+}
+
+/// <summary>
+/// СКО по суммам значений и квадратов окна площади area, как в ComputeMomentsRow.
+/// </summary>
+inline uint8_t Rmse(uint64_t sumOfSquares, uint64_t sum, double area)
+{
+	double inverseArea = 1 / area;
+	double mean = sum * inverseArea;
+	double variance = std::max(sumOfSquares * inverseArea - mean * mean, 0.0);
+
+	return (uint8_t)std::clamp(std::sqrt(variance) + 0.5, 0.0, 255.0);
+}
+
+/// <summary>
+/// Статистики по окну windowWidth x windowHeight за один проход. Строка кольца -
+/// скользящие по строке суммы степеней значений, суммы окна обновляются прибавлением
+/// нижней строки и вычитанием верхней, как в BoxBlur. Все суммы 64-битные.
+/// </summary>
+template<class Px, class Border>
+void ComputeLocalMoments(
+	std::istream& src,
+	const vector<BmpRowWriter*>& dests,
+	const BmpImageInfo& info,
+	const vector<LocalMoment>& moments,
+	int windowWidth,
+	int windowHeight)
+{
+	int imageWidthBytes = info.imageWidthBytes;
+	int rowWidth = info.imageWidthPx * Px::ChannelCount;
+	int horizontalRadius = windowWidth / 2;
+	int verticalRadius = windowHeight / 2;
+
+	int powersCount = 1;
+
+	for (LocalMoment moment : moments)
+	{
+		powersCount = std::max(powersCount, MomentPowersCount(moment));
+	}
+
+	uint64_t powerTables[MaxMomentPowers][256];
+
+	for (int v = 0; v < 256; v++)
+	{
+		powerTables[0][v] = v;
+		powerTables[1][v] = (uint64_t)v * v;
+		powerTables[2][v] = (uint64_t)v * v * v;
+	}
+
+	int slotWidth = powersCount * rowWidth;
+
+	// Буфер длиной расширенной краевыми пикселями строки
+	vector<uint8_t> srcRowBuffer(imageWidthBytes + horizontalRadius * 2 * Px::BytePerPx);
+	RowRing<uint64_t, Border> powerSumsRows(slotWidth, info.imageHeightPx, windowHeight);
+
+	vector<uint64_t> windowSums(slotWidth);
+	LocalMomentsRow momentsRow(rowWidth);
+	double area = (double)windowWidth * windowHeight;
+
+	auto addRow = [&](const uint64_t* row)
+		{
+			for (int n = 0; n < slotWidth; n++)
+			{
+				windowSums[n] += row[n];
+			}
+		};
+
+	for (int y = 0; y < info.imageHeightPx; y++)
+	{
+		int firstWindowRow = y - verticalRadius;
+
+		while (!powerSumsRows.HasWindow(firstWindowRow, windowHeight))
+		{
+			src.read((char*)&srcRowBuffer[horizontalRadius * Px::BytePerPx], imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+
+			ExpandRowEdges<Px, Border>(srcRowBuffer.data(), info.imageWidthPx, horizontalRadius);
+
+			SumColPowersInRow<Px>(srcRowBuffer.data(), powerSumsRows.AppendRow(), powerTables,
+				powersCount, windowWidth, info.imageWidthPx);
+		}
+
+		// Накопление начальной суммы, затем прибавление нижней строки
+		if (y == 0)
+		{
+			for (int i = 0; i < windowHeight; i++)
+			{
+				addRow(powerSumsRows.Row(firstWindowRow + i));
+			}
+		}
+		else
+		{
+			addRow(powerSumsRows.Row(firstWindowRow + windowHeight - 1));
+		}
+
+		ComputeMomentsRow(windowSums.data(), powersCount, rowWidth, area, momentsRow);
+
+		for (size_t i = 0; i < moments.size(); i++)
+		{
+			WriteMomentRow(moments[i], momentsRow, dests[i]->Rows(y, 1), rowWidth);
+			dests[i]->CommitRows();
+		}
+
+		// Вычитание верхней строки
+		const uint64_t* topRow = powerSumsRows.Row(firstWindowRow);
+
+		for (int n = 0; n < slotWidth; n++)
+		{
+			windowSums[n] -= topRow[n];
+		}
+	}
+}
+
+/// <summary>
+/// Записывает статистики outputs по окну windowWidth x windowHeight (центр окна как у Kernel
+/// тех же размеров) за один проход по источнику, каждую в своё изображение.
+/// </summary>
+void ComputeLocalMoments(
+	const SourceImage& srcPath,
+	const vector<LocalMomentOutput>& outputs,
+	int windowWidth,
+	int windowHeight,
+	BorderMode border = BorderMode::Mirror,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	if (outputs.empty())
+	{
+		throw std::invalid_argument("Не заданы выходные изображения");
+	}
+	if (windowWidth < 1 || windowHeight < 1)
+	{
+		throw std::invalid_argument("Размеры окна должны быть положительными");
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	if (windowWidth / 2 > info.imageWidthPx ||
+		windowHeight / 2 > info.imageHeightPx)
+	{
+		throw std::invalid_argument("Изображение слишком мало");
+	}
+
+	vector<LocalMoment> moments;
+	int powersCount = 1;
+
+	for (const LocalMomentOutput& output : outputs)
+	{
+		moments.push_back(output.moment);
+		powersCount = std::max(powersCount, MomentPowersCount(output.moment));
+	}
+
+	// Суммы степеней окна должны точно переводиться в double
+	if ((double)windowWidth * windowHeight * std::pow(255.0, powersCount) >= MaxExactMomentSum)
+	{
+		throw std::invalid_argument("Окно слишком велико для вычисления статистик");
+	}
+
+	vector<std::unique_ptr<BmpOutputFile>> destFiles;
+	vector<BmpOutputFile*> destFilePointers;
+
+	for (const LocalMomentOutput& output : outputs)
+	{
+		destFiles.push_back(std::make_unique<BmpOutputFile>(
+			output.destPath,
+			BmpImageInfoBytes(info),
+			info.imageWidthBytes,
+			info.rowStrideBytes,
+			info.imageHeightPx,
+			backend));
+		destFilePointers.push_back(destFiles.back().get());
+	}
+
+	// Периодической границе нужен противоположный край изображения, полосы его не видят
+	if (border == BorderMode::Wrap)
+	{
+		threadsCount = 1;
+	}
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			DispatchBorderMode(border, [&](auto borderPolicy)
+				{
+					FilterInBands(srcPath, src, destFilePointers, info,
+						KernelBandHalo(windowHeight, windowHeight / 2), threadsCount,
+						[&](std::istream& bandSrc, const vector<BmpRowWriter*>& bandDests, const BmpImageInfo& bandInfo)
+						{
+							ComputeLocalMoments<decltype(format), decltype(borderPolicy)>(
+								bandSrc, bandDests, bandInfo, moments, windowWidth, windowHeight);
+						});
+				});
+		});
+}
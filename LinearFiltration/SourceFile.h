@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <streambuf>
+#include <memory>
+#include <vector>
+
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "FileStreams.h"
+#include "LumaConversion.h"
+
+/// <summary>
+/// Поток 8-битных строк яркости поверх потока цветных строк изображения colorInfo.
+/// Строки яркости идут подряд без выравнивания, поэтому позиция в потоке -
+/// номер строки * ширина + столбец. Переход к позиции - переход к строке источника.
+/// </summary>
+class LumaStreamBuffer : public std::streambuf
+{
+private:
+	std::istream& src_;
+	BmpImageInfo colorInfo_;
+	LumaWeights weights_;
+
+	void (*convertRow_)(const uint8_t*, uint8_t*, int, const LumaWeights&) = nullptr;
+
+	std::vector<uint8_t> colorRow_;
+	std::vector<char> lumaRow_;
+
+	// Следующая строка источника
+	int nextRow_ = 0;
+
+	pos_type Position() const
+	{
+		int64_t rowStart = (int64_t)(egptr() == eback() ? nextRow_ : nextRow_ - 1) * colorInfo_.imageWidthPx;
+
+		return pos_type(off_type(rowStart + (gptr() - eback())));
+	}
+
+protected:
+	int_type underflow() override
+	{
+		if (gptr() < egptr())
+		{
+			return traits_type::to_int_type(*gptr());
+		}
+		if (nextRow_ == colorInfo_.imageHeightPx)
+		{
+			return traits_type::eof();
+		}
+
+		src_.read((char*)colorRow_.data(), colorInfo_.imageWidthBytes);
+		src_.ignore(colorInfo_.paddingBytesCount);
+
+		if (src_.fail())
+		{
+			return traits_type::eof();
+		}
+
+		convertRow_(colorRow_.data(), (uint8_t*)lumaRow_.data(), colorInfo_.imageWidthPx, weights_);
+		nextRow_++;
+
+		setg(lumaRow_.data(), lumaRow_.data(), lumaRow_.data() + lumaRow_.size());
+		return traits_type::to_int_type(*gptr());
+	}
+
+	pos_type seekpos(pos_type position, std::ios_base::openmode) override
+	{
+		int64_t offset = (int64_t)off_type(position);
+		int64_t row = offset / colorInfo_.imageWidthPx;
+		int column = (int)(offset % colorInfo_.imageWidthPx);
+
+		if (offset < 0 || row > colorInfo_.imageHeightPx ||
+			(row == colorInfo_.imageHeightPx && column != 0))
+		{
+			return pos_type(off_type(-1));
+		}
+
+		src_.clear();
+		src_.seekg(colorInfo_.srcDataOffsetBytes + colorInfo_.srcRowStrideBytes * row);
+
+		if (!src_)
+		{
+			return pos_type(off_type(-1));
+		}
+
+		nextRow_ = (int)row;
+		setg(lumaRow_.data(), lumaRow_.data(), lumaRow_.data());
+
+		if (column != 0)
+		{
+			if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+			{
+				return pos_type(off_type(-1));
+			}
+
+			gbump(column);
+		}
+
+		return position;
+	}
+
+	pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override
+	{
+		if (direction == std::ios_base::beg)
+		{
+			return seekpos(pos_type(offset), which);
+		}
+		if (direction == std::ios_base::cur)
+		{
+			return offset == 0 ? Position() : seekpos(Position() + offset, which);
+		}
+
+		return pos_type(off_type(-1));
+	}
+
+public:
+	/// <summary>
+	/// src стоит на первой строке данных colorInfo.
+	/// </summary>
+	LumaStreamBuffer(std::istream& src, const BmpImageInfo& colorInfo, LumaStandard standard)
+		: src_(src),
+		colorInfo_(colorInfo),
+		weights_(LumaStandardWeights(standard)),
+		colorRow_(colorInfo.imageWidthBytes),
+		lumaRow_(colorInfo.imageWidthPx)
+	{
+		DispatchPixelFormat(colorInfo.header.bitPerPixel, [&](auto format)
+			{
+				convertRow_ = &ConvertRowToLuma<decltype(format)>;
+			});
+
+		setg(lumaRow_.data(), lumaRow_.data(), lumaRow_.data());
+	}
+};
+
+/// <summary>
+/// Описание строк яркости цветного изображения colorInfo: 8-битное изображение
+/// того же размера, порядка строк и разрешения с палитрой оттенков серого.
+/// </summary>
+inline BmpImageInfo LumaImageInfo(const BmpImageInfo& colorInfo)
+{
+	BmpImageInfo info = RawImageInfo({
+		colorInfo.imageWidthPx, colorInfo.imageHeightPx, Gray8::BitPerPixel, colorInfo.isTopDown });
+
+	info.header.xPixelPerMetre = colorInfo.header.xPixelPerMetre;
+	info.header.yPixelPerMetre = colorInfo.header.yPixelPerMetre;
+
+	return info;
+}
+
+/// <summary>
+/// Открытое входное изображение: поток строк и их описание, стоящий на первой строке.
+/// Если у источника задан перевод в яркость, цветные строки переводятся в 8-битную яркость
+/// при чтении, а Info() описывает 8-битное изображение с палитрой оттенков серого -
+/// фильтры считают один канал вместо трёх и пишут серый bmp.
+/// </summary>
+class SourceFile
+{
+private:
+	std::ifstream file_;
+	std::istream* stream_;
+	BmpImageInfo info_;
+
+	std::unique_ptr<LumaStreamBuffer> lumaBuffer_;
+	std::unique_ptr<std::istream> lumaStream_;
+
+public:
+	explicit SourceFile(const SourceImage& source)
+		: stream_(&OpenInputStream(source.path, file_)),
+		info_(ReadImageInfo(*stream_, source))
+	{
+		if (source.luma == LumaStandard::None || info_.header.bitPerPixel == Gray8::BitPerPixel)
+		{
+			return;
+		}
+
+		lumaBuffer_ = std::make_unique<LumaStreamBuffer>(*stream_, info_, source.luma);
+		lumaStream_ = std::make_unique<std::istream>(lumaBuffer_.get());
+
+		stream_ = lumaStream_.get();
+		info_ = LumaImageInfo(info_);
+	}
+
+	SourceFile(const SourceFile&) = delete;
+	SourceFile& operator=(const SourceFile&) = delete;
+
+	std::istream& Stream() noexcept
+	{
+		return *stream_;
+	}
+
+	const BmpImageInfo& Info() const noexcept
+	{
+		return info_;
+	}
+};
@@ -0,0 +1,536 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include "BmpImageInfo.h"
+#include "PixelFormats.h"
+#include "EdgeMirroring.h"
+#include "FileStreams.h"
+#include "SourceFile.h"
+#include "BmpOutput.h"
+#include "BoxBlurringFunctions.h"
+#include "BandFiltering.h"
+
+using std::vector;
+
+// Столько строк адаптивной статистики вычисляются по одной полосе и делятся между потоками
+const int AdaptiveBoxRowsPerBatch = 16;
+
+/// <summary>
+/// Окно (2 * radiusX + 1) x (2 * radiusY + 1) с центром в пикселе.
+/// </summary>
+struct BoxWindow
+{
+	int radiusX;
+	int radiusY;
+};
+
+enum class BoxStatistic
+{
+	Mean,
+	Rmse
+};
+
+/// <summary>
+/// Одно выходное изображение: статистика по окну window в файл destPath.
+/// </summary>
+struct BoxStatisticOutput
+{
+	BoxWindow window;
+	BoxStatistic statistic;
+	std::filesystem::path destPath;
+};
+
+/// <summary>
+/// Отрезок [first, end) строк или столбцов изображения.
+/// </summary>
+struct MirroredSegment
+{
+	int first;
+	int end;
+};
+
+/// <summary>
+/// Раскладывает отражённое окно [center - radius, center + radius] на не более чем три
+/// отрезка внутри [0, size): отражение верхнего края, середину и отражение нижнего.
+/// radius не больше size.
+/// </summary>
+inline int MirroredSegments(int center, int radius, int size, MirroredSegment segments[3])
+{
+	int first = center - radius;
+	int last = center + radius;
+	int count = 0;
+
+	// -1 ... first отражаются в 0 ... -1 - first
+	if (first < 0)
+	{
+		segments[count++] = { 0, -first };
+	}
+
+	segments[count++] = { std::max(first, 0), std::min(last, size - 1) + 1 };
+
+	// size ... last отражаются в 2 * size - 1 - last ... size - 1
+	if (last >= size)
+	{
+		segments[count++] = { 2 * size - 1 - last, size };
+	}
+
+	return count;
+}
+
+/// <summary>
+/// Скользящая полоса интегрального изображения: строка k хранит суммы значений
+/// и квадратов значений по прямоугольнику [0, k) x [0, x) для каждого канала.
+/// 64-битные суммы не переполняются при любых размерах изображения. В полосе
+/// bandRowsCount последних строк, нулевая строка нулевая и не хранится.
+/// Чтение окон из нескольких потоков безопасно, пока строки не добавляются.
+/// </summary>
+template<class Px>
+class IntegralImageBand
+{
+private:
+	int widthPx_;
+	int heightPx_;
+	int bandRowsCount_;
+	int rowValuesCount_;
+
+	vector<uint64_t> sums_;
+	vector<uint64_t> squareSums_;
+	vector<uint64_t> zeroRow_;
+
+	// Число добавленных строк изображения
+	int rowsCount_ = 0;
+
+	const uint64_t* SumsRow(const vector<uint64_t>& values, int k) const
+	{
+		return k == 0
+			? zeroRow_.data()
+			: &values[(size_t)((k - 1) % bandRowsCount_) * rowValuesCount_];
+	}
+
+public:
+	/// <summary>
+	/// maxRadiusY - наибольший вертикальный радиус запрашиваемых окон,
+	/// extraRowsCount - на сколько строк ниже первой запрашиваются окна по одной полосе.
+	/// </summary>
+	IntegralImageBand(int widthPx, int heightPx, int maxRadiusY, int extraRowsCount = 0)
+		: widthPx_(widthPx),
+		heightPx_(heightPx),
+		bandRowsCount_(2 * maxRadiusY + 2 + extraRowsCount),
+		rowValuesCount_((widthPx + 1) * Px::ChannelCount),
+		sums_((size_t)bandRowsCount_ * rowValuesCount_),
+		squareSums_(sums_.size()),
+		zeroRow_(rowValuesCount_)
+	{
+	}
+
+	int RowsCount() const noexcept
+	{
+		return rowsCount_;
+	}
+
+	void AppendRow(const uint8_t* row)
+	{
+		const uint64_t* previousSums = SumsRow(sums_, rowsCount_);
+		const uint64_t* previousSquareSums = SumsRow(squareSums_, rowsCount_);
+
+		rowsCount_++;
+
+		uint64_t* rowSums = &sums_[(size_t)((rowsCount_ - 1) % bandRowsCount_) * rowValuesCount_];
+		uint64_t* rowSquareSums = &squareSums_[(size_t)((rowsCount_ - 1) % bandRowsCount_) * rowValuesCount_];
+
+		uint64_t sums[Px::ChannelCount]{};
+		uint64_t squareSums[Px::ChannelCount]{};
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			rowSums[c] = previousSums[c];
+			rowSquareSums[c] = previousSquareSums[c];
+		}
+
+		for (int x = 0; x < widthPx_; x++)
+		{
+			for (int c = 0; c < Px::ChannelCount; c++)
+			{
+				uint64_t value = row[x * Px::BytePerPx + c];
+				size_t index = (size_t)(x + 1) * Px::ChannelCount + c;
+
+				sums[c] += value;
+				squareSums[c] += value * value;
+
+				rowSums[index] = previousSums[index] + sums[c];
+				rowSquareSums[index] = previousSquareSums[index] + squareSums[c];
+			}
+		}
+	}
+
+	/// <summary>
+	/// Прибавляет суммы и суммы квадратов отражённого окна с центром (x, y).
+	/// Строки до y + radiusY (или до последней) должны быть уже добавлены.
+	/// </summary>
+	void AddWindowSums(
+		int x,
+		int y,
+		const BoxWindow& window,
+		uint64_t sums[Px::ChannelCount],
+		uint64_t squareSums[Px::ChannelCount]) const
+	{
+		MirroredSegment rows[3];
+		MirroredSegment columns[3];
+
+		int rowSegmentsCount = MirroredSegments(y, window.radiusY, heightPx_, rows);
+		int columnSegmentsCount = MirroredSegments(x, window.radiusX, widthPx_, columns);
+
+		for (int i = 0; i < rowSegmentsCount; i++)
+		{
+			const uint64_t* topSums = SumsRow(sums_, rows[i].first);
+			const uint64_t* bottomSums = SumsRow(sums_, rows[i].end);
+			const uint64_t* topSquareSums = SumsRow(squareSums_, rows[i].first);
+			const uint64_t* bottomSquareSums = SumsRow(squareSums_, rows[i].end);
+
+			for (int j = 0; j < columnSegmentsCount; j++)
+			{
+				size_t left = (size_t)columns[j].first * Px::ChannelCount;
+				size_t right = (size_t)columns[j].end * Px::ChannelCount;
+
+				for (int c = 0; c < Px::ChannelCount; c++)
+				{
+					sums[c] += bottomSums[right + c] - bottomSums[left + c]
+						- topSums[right + c] + topSums[left + c];
+					squareSums[c] += bottomSquareSums[right + c] - bottomSquareSums[left + c]
+						- topSquareSums[right + c] + topSquareSums[left + c];
+				}
+			}
+		}
+	}
+};
+
+/// <summary>
+/// Значение статистики по суммам окна площади area, с тем же округлением, что BoxBlur и MovingRmse.
+/// </summary>
+inline uint8_t BoxStatisticValue(BoxStatistic statistic, uint64_t sum, uint64_t squareSum, float area)
+{
+	if (statistic == BoxStatistic::Rmse)
+	{
+		return Rmse(squareSum, sum, area);
+	}
+
+	return (uint8_t)((float)sum / area + 0.5f);
+}
+
+/// <summary>
+/// Записывает строку y статистики по окну window.
+/// </summary>
+template<class Px>
+void WriteBoxStatisticRow(
+	const IntegralImageBand<Px>& band,
+	int y,
+	int imageWidthPx,
+	const BoxWindow& window,
+	BoxStatistic statistic,
+	uint8_t* destRow)
+{
+	float area = (float)(2 * window.radiusX + 1) * (2 * window.radiusY + 1);
+
+	for (int x = 0; x < imageWidthPx; x++)
+	{
+		uint64_t sums[Px::ChannelCount]{};
+		uint64_t squareSums[Px::ChannelCount]{};
+
+		band.AddWindowSums(x, y, window, sums, squareSums);
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			destRow[x * Px::BytePerPx + c] = BoxStatisticValue(statistic, sums[c], squareSums[c], area);
+		}
+	}
+}
+
+/// <summary>
+/// Статистики по нескольким окнам за одно чтение изображения: строка y каждого
+/// выхода записывается, как только в полосу добавлена строка y + наибольший radiusY.
+/// </summary>
+template<class Px>
+void ComputeBoxStatistics(
+	std::istream& src,
+	const BmpImageInfo& info,
+	const vector<BoxStatisticOutput>& outputs,
+	const vector<BmpRowWriter*>& dests)
+{
+	int maxRadiusY = 0;
+	for (const BoxStatisticOutput& output : outputs)
+	{
+		maxRadiusY = std::max(maxRadiusY, output.window.radiusY);
+	}
+
+	IntegralImageBand<Px> band(info.imageWidthPx, info.imageHeightPx, maxRadiusY);
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+
+	for (int y = 0; y < info.imageHeightPx; y++)
+	{
+		while (band.RowsCount() < info.imageHeightPx && band.RowsCount() <= y + maxRadiusY)
+		{
+			src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+
+			band.AppendRow(srcRowBuffer.data());
+		}
+
+		for (size_t i = 0; i < outputs.size(); i++)
+		{
+			uint8_t* destRow = dests[i]->Rows(y, 1);
+
+			WriteBoxStatisticRow<Px>(band, y, info.imageWidthPx,
+				outputs[i].window, outputs[i].statistic, destRow);
+
+			dests[i]->CommitRows();
+		}
+	}
+}
+
+/// <summary>
+/// Статистики по окнам outputs, каждая в своё изображение. Полосы изображения
+/// обрабатываются параллельно с ореолом в наибольший radiusY.
+/// </summary>
+void ComputeBoxStatistics(
+	const SourceImage& srcPath,
+	const vector<BoxStatisticOutput>& outputs,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	BmpImageInfo info = srcFile.Info();
+
+	// Проверка на возможность отражения
+	for (const BoxStatisticOutput& output : outputs)
+	{
+		if (output.window.radiusX < 0 || output.window.radiusY < 0)
+		{
+			throw std::invalid_argument("Радиус окна не может быть отрицательным");
+		}
+		if (output.window.radiusX > info.imageWidthPx ||
+			output.window.radiusY > info.imageHeightPx)
+		{
+			throw std::invalid_argument("Изображение слишком мало");
+		}
+	}
+
+	int maxRadiusY = 0;
+	vector<std::unique_ptr<BmpOutputFile>> destFiles;
+	vector<BmpOutputFile*> destFilePointers;
+
+	for (const BoxStatisticOutput& output : outputs)
+	{
+		maxRadiusY = std::max(maxRadiusY, output.window.radiusY);
+
+		destFiles.push_back(std::make_unique<BmpOutputFile>(
+			output.destPath,
+			BmpImageInfoBytes(info),
+			info.imageWidthBytes,
+			info.rowStrideBytes,
+			info.imageHeightPx,
+			backend));
+		destFilePointers.push_back(destFiles.back().get());
+	}
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			FilterInBands(srcPath, src, destFilePointers, info,
+				KernelBandHalo(2 * maxRadiusY + 1, maxRadiusY), threadsCount,
+				[&](std::istream& bandSrc, const vector<BmpRowWriter*>& bandDests, const BmpImageInfo& bandInfo)
+				{
+					ComputeBoxStatistics<decltype(format)>(bandSrc, bandInfo, outputs, bandDests);
+				});
+		});
+}
+
+/// <summary>
+/// Наибольший радиус карты радиусов (первый канал). Карта читается до конца,
+/// затем поток возвращается к началу её данных.
+/// </summary>
+template<class MapPx>
+int MaxRadiusMapValue(std::istream& radiusMap, const BmpImageInfo& radiusMapInfo)
+{
+	std::streampos dataPosition = radiusMap.tellg();
+	vector<uint8_t> radiusRowBuffer(radiusMapInfo.imageWidthBytes);
+	int maxRadius = 0;
+
+	for (int y = 0; y < radiusMapInfo.imageHeightPx; y++)
+	{
+		radiusMap.read((char*)radiusRowBuffer.data(), radiusMapInfo.imageWidthBytes);
+		radiusMap.ignore(radiusMapInfo.paddingBytesCount);
+
+		for (int x = 0; x < radiusMapInfo.imageWidthPx; x++)
+		{
+			maxRadius = std::max<int>(maxRadius, radiusRowBuffer[x * MapPx::BytePerPx]);
+		}
+	}
+
+	radiusMap.clear();
+	radiusMap.seekg(dataPosition);
+
+	return maxRadius;
+}
+
+/// <summary>
+/// Записывает строку y статистики по окнам с радиусами строки карты radiusRow,
+/// радиусы ограничены maxRadius.
+/// </summary>
+template<class Px, class MapPx>
+void WriteAdaptiveBoxStatisticRow(
+	const IntegralImageBand<Px>& band,
+	int y,
+	int imageWidthPx,
+	const uint8_t* radiusRow,
+	int maxRadius,
+	BoxStatistic statistic,
+	uint8_t* destRow)
+{
+	for (int x = 0; x < imageWidthPx; x++)
+	{
+		int radius = std::min<int>(radiusRow[x * MapPx::BytePerPx], maxRadius);
+		float area = (float)(2 * radius + 1) * (2 * radius + 1);
+
+		uint64_t sums[Px::ChannelCount]{};
+		uint64_t squareSums[Px::ChannelCount]{};
+
+		band.AddWindowSums(x, y, BoxWindow{ radius, radius }, sums, squareSums);
+
+		for (int c = 0; c < Px::ChannelCount; c++)
+		{
+			destRow[x * Px::BytePerPx + c] = BoxStatisticValue(statistic, sums[c], squareSums[c], area);
+		}
+	}
+}
+
+/// <summary>
+/// Статистика по квадратному окну, радиус которого в каждом пикселе задаёт
+/// карта радиусов - изображение тех же размеров, радиус берётся из первого канала.
+/// Полоса интегрального изображения рассчитана на радиусы до maxRadius, большие ограничиваются им.
+/// Строки считаются пакетами по AdaptiveBoxRowsPerBatch, строки пакета делятся между потоками.
+/// </summary>
+template<class Px, class MapPx>
+void AdaptiveBoxStatistic(
+	std::istream& src,
+	std::istream& radiusMap,
+	BmpRowWriter& dest,
+	const BmpImageInfo& info,
+	const BmpImageInfo& radiusMapInfo,
+	BoxStatistic statistic,
+	int maxRadius,
+	int threadsCount)
+{
+	IntegralImageBand<Px> band(info.imageWidthPx, info.imageHeightPx, maxRadius, AdaptiveBoxRowsPerBatch - 1);
+	vector<uint8_t> srcRowBuffer(info.imageWidthBytes);
+	vector<uint8_t> radiusRows((size_t)radiusMapInfo.imageWidthBytes * AdaptiveBoxRowsPerBatch);
+
+	for (int firstRow = 0; firstRow < info.imageHeightPx; firstRow += AdaptiveBoxRowsPerBatch)
+	{
+		int rowsCount = std::min(AdaptiveBoxRowsPerBatch, info.imageHeightPx - firstRow);
+
+		while (band.RowsCount() < info.imageHeightPx && band.RowsCount() < firstRow + rowsCount + maxRadius)
+		{
+			src.read((char*)srcRowBuffer.data(), info.imageWidthBytes);
+			src.ignore(info.paddingBytesCount);
+
+			band.AppendRow(srcRowBuffer.data());
+		}
+
+		for (int r = 0; r < rowsCount; r++)
+		{
+			radiusMap.read((char*)radiusRows.data() + (size_t)r * radiusMapInfo.imageWidthBytes,
+				radiusMapInfo.imageWidthBytes);
+			radiusMap.ignore(radiusMapInfo.paddingBytesCount);
+		}
+
+		uint8_t* destRows = dest.Rows(firstRow, rowsCount);
+
+		ParallelFor(rowsCount, threadsCount, [&](int first, int end)
+			{
+				for (int r = first; r < end; r++)
+				{
+					WriteAdaptiveBoxStatisticRow<Px, MapPx>(band, firstRow + r, info.imageWidthPx,
+						radiusRows.data() + (size_t)r * radiusMapInfo.imageWidthBytes, maxRadius, statistic,
+						destRows + (size_t)r * info.rowStrideBytes);
+				}
+			});
+
+		dest.CommitRows();
+	}
+}
+
+/// <summary>
+/// Статистика по окнам с радиусами из карты radiusMapPath. Радиусы больше maxRadius
+/// и сторон изображения ограничиваются ими. Карта из файла перед вычислением
+/// просматривается целиком, и полоса интегрального изображения берётся по её
+/// наибольшему радиусу; карта из стандартного ввода полагается на maxRadius.
+/// Карта читается последовательно вместе с изображением, поэтому вместо полос
+/// изображения между потоками делятся строки каждого пакета.
+/// </summary>
+void AdaptiveBoxStatistic(
+	const SourceImage& srcPath,
+	std::filesystem::path radiusMapPath,
+	std::filesystem::path destPath,
+	BoxStatistic statistic,
+	int maxRadius = 255,
+	OutputBackend backend = OutputBackend::Auto,
+	int threadsCount = DefaultThreadsCount())
+{
+	if (maxRadius < 0)
+	{
+		throw std::invalid_argument("Радиус окна не может быть отрицательным");
+	}
+
+	SourceFile srcFile(srcPath);
+	std::istream& src = srcFile.Stream();
+
+	std::ifstream radiusMapFile;
+	std::istream& radiusMap = OpenInputStream(radiusMapPath, radiusMapFile);
+
+	BmpImageInfo info = srcFile.Info();
+	BmpImageInfo radiusMapInfo = ReadBmpImageInfo(radiusMap);
+
+	if (radiusMapInfo.imageWidthPx != info.imageWidthPx ||
+		radiusMapInfo.imageHeightPx != info.imageHeightPx ||
+		radiusMapInfo.isTopDown != info.isTopDown)
+	{
+		throw std::invalid_argument("Размеры карты радиусов не совпадают с изображением");
+	}
+
+	maxRadius = std::min({ maxRadius, info.imageWidthPx, info.imageHeightPx });
+
+	BmpOutputFile destFile(
+		destPath,
+		BmpImageInfoBytes(info),
+		info.imageWidthBytes,
+		info.rowStrideBytes,
+		info.imageHeightPx,
+		backend);
+	BmpRowWriter dest(destFile);
+
+	DispatchPixelFormat(info.header.bitPerPixel, [&](auto format)
+		{
+			DispatchPixelFormat(radiusMapInfo.header.bitPerPixel, [&](auto mapFormat)
+				{
+					using MapPx = decltype(mapFormat);
+
+					int bandRadius = IsSeekablePath(radiusMapPath)
+						? std::min(maxRadius, MaxRadiusMapValue<MapPx>(radiusMap, radiusMapInfo))
+						: maxRadius;
+
+					AdaptiveBoxStatistic<decltype(format), MapPx>(
+						src, radiusMap, dest, info, radiusMapInfo, statistic, bandRadius, threadsCount);
+				});
+		});
+
+	// Деструктор глотает ошибки записи, поэтому последний пакет сбрасывается явно
+	dest.Flush();
+}